@@ -0,0 +1,206 @@
+/* buddy.c
+ * Power-of-two block allocator for the CMA buffer pool.
+ *
+ * Each minimum-size block has an entry in a handful of flat arrays.  Only the
+ * first entry of a block (its "head") carries meaning; the free lists are
+ * doubly linked through the next/prev arrays so that a block can be pulled
+ * out of the middle of a list when its buddy is freed.
+ *
+ * This file is shared between the cmabuffer kernel module and the user-space
+ * tests in drivers/test, so it must not use anything beyond the few
+ * allocation functions wrapped below.
+ */
+
+#ifdef __KERNEL__
+#include <linux/vmalloc.h>
+#include <linux/string.h>
+#define buddy_zalloc(n) vzalloc(n)
+#define buddy_release(p) vfree(p)
+#else
+#include <stdlib.h>
+#include <string.h>
+#define buddy_zalloc(n) calloc(1, n)
+#define buddy_release(p) free(p)
+#endif
+
+#include "buddy.h"
+
+static void list_push(BuddyPool* pool, int block, int order)
+{
+  pool->next[block] = pool->free_head[order];
+  pool->prev[block] = -1;
+  if(pool->free_head[order] >= 0){
+    pool->prev[pool->free_head[order]] = block;
+  }
+  pool->free_head[order] = block;
+
+  pool->order[block] = order;
+  pool->is_free[block] = 1;
+}
+
+static void list_remove(BuddyPool* pool, int block, int order)
+{
+  if(pool->prev[block] >= 0){
+    pool->next[pool->prev[block]] = pool->next[block];
+  }
+  else{
+    pool->free_head[order] = pool->next[block];
+  }
+  if(pool->next[block] >= 0){
+    pool->prev[pool->next[block]] = pool->prev[block];
+  }
+  pool->is_free[block] = 0;
+}
+
+int buddy_init(BuddyPool* pool, unsigned long size, unsigned int min_shift)
+{
+  unsigned int i, block;
+  int order;
+
+  memset(pool, 0, sizeof(BuddyPool));
+  pool->min_shift = min_shift;
+  pool->nr_blocks = size >> min_shift;
+
+  // Use as many orders as it takes for one block to cover the whole pool
+  while(pool->nr_orders < BUDDY_MAX_ORDERS &&
+        (1UL << pool->nr_orders) <= pool->nr_blocks){
+    pool->nr_orders++;
+  }
+
+  pool->next = buddy_zalloc(pool->nr_blocks * sizeof(int));
+  pool->prev = buddy_zalloc(pool->nr_blocks * sizeof(int));
+  pool->order = buddy_zalloc(pool->nr_blocks * sizeof(signed char));
+  pool->is_free = buddy_zalloc(pool->nr_blocks * sizeof(unsigned char));
+  if(pool->next == NULL || pool->prev == NULL ||
+     pool->order == NULL || pool->is_free == NULL){
+    buddy_destroy(pool);
+    return(-1);
+  }
+
+  for(i = 0; i < BUDDY_MAX_ORDERS; i++){
+    pool->free_head[i] = -1;
+  }
+  memset(pool->order, -1, pool->nr_blocks);
+
+  // Seed the free lists with the largest aligned blocks that fit.  If the pool
+  // isn't a power of two, the tail end gets split into progressively smaller
+  // blocks which can never merge with anything beyond the end.
+  block = 0;
+  while(block < pool->nr_blocks){
+    order = pool->nr_orders - 1;
+    while(order > 0 && ((block & ((1U << order) - 1)) != 0 ||
+                        block + (1U << order) > pool->nr_blocks)){
+      order--;
+    }
+    list_push(pool, block, order);
+    block += 1U << order;
+  }
+  pool->free_count = pool->nr_blocks;
+
+  return(0);
+}
+
+void buddy_destroy(BuddyPool* pool)
+{
+  buddy_release(pool->next);
+  buddy_release(pool->prev);
+  buddy_release(pool->order);
+  buddy_release(pool->is_free);
+  pool->next = pool->prev = NULL;
+  pool->order = NULL;
+  pool->is_free = NULL;
+  pool->nr_blocks = 0;
+}
+
+int buddy_order(BuddyPool* pool, unsigned long size)
+{
+  int order = 0;
+  while(order < pool->nr_orders && (1UL << (order + pool->min_shift)) < size){
+    order++;
+  }
+  return(order < pool->nr_orders ? order : -1);
+}
+
+long buddy_alloc(BuddyPool* pool, unsigned long size)
+{
+  int order, k, block;
+
+  // Smallest order which holds the request
+  order = buddy_order(pool, size);
+  if(order < 0){
+    return(-1);
+  }
+
+  // Find the smallest free block at least that big
+  for(k = order; k < pool->nr_orders && pool->free_head[k] < 0; k++) {}
+  if(k >= pool->nr_orders){
+    return(-1);
+  }
+
+  block = pool->free_head[k];
+  list_remove(pool, block, k);
+
+  // Split it down to size, putting the upper halves back on the free lists
+  while(k > order){
+    k--;
+    list_push(pool, block + (1 << k), k);
+  }
+
+  pool->order[block] = order;
+  pool->free_count -= 1U << order;
+  return((long)block << pool->min_shift);
+}
+
+void buddy_free(BuddyPool* pool, unsigned long offset)
+{
+  int block = offset >> pool->min_shift;
+  int order, buddy;
+
+  if(block >= pool->nr_blocks || pool->order[block] < 0 || pool->is_free[block]){
+    return; // Not something we handed out
+  }
+
+  order = pool->order[block];
+  pool->free_count += 1U << order;
+
+  // Merge upward for as long as the buddy is a whole free block
+  while(order < pool->nr_orders - 1){
+    buddy = block ^ (1 << order);
+    if(buddy + (1U << order) > pool->nr_blocks ||
+       !pool->is_free[buddy] || pool->order[buddy] != order){
+      break;
+    }
+    list_remove(pool, buddy, order);
+    pool->order[buddy] = -1;
+    pool->order[block] = -1;
+    block = block < buddy ? block : buddy;
+    order++;
+  }
+
+  list_push(pool, block, order);
+}
+
+unsigned long buddy_block_size(BuddyPool* pool, unsigned long offset)
+{
+  unsigned int block = offset >> pool->min_shift;
+  if(block >= pool->nr_blocks || pool->order[block] < 0 || pool->is_free[block]){
+    return(0);
+  }
+  return(1UL << (pool->order[block] + pool->min_shift));
+}
+
+unsigned long buddy_free_bytes(BuddyPool* pool)
+{
+  return((unsigned long)pool->free_count << pool->min_shift);
+}
+
+unsigned long buddy_largest_free(BuddyPool* pool)
+{
+  int k;
+  for(k = pool->nr_orders - 1; k >= 0; k--){
+    if(pool->free_head[k] >= 0){
+      return(1UL << (k + pool->min_shift));
+    }
+  }
+  return(0);
+}
@@ -0,0 +1,61 @@
+/* buddy.h
+ * Power-of-two (buddy) allocator used to carve image buffers out of the
+ * contiguous CMA region.  The allocator only deals in offsets from the start
+ * of the region, so it knows nothing about physical or virtual addresses and
+ * can be built and tested in user space (see drivers/test).
+ *
+ * Blocks are multiples of the minimum block size (normally one page), and
+ * every block is naturally aligned to its own size.
+ */
+
+#ifndef _BUDDY_H_
+#define _BUDDY_H_
+
+#define BUDDY_MAX_ORDERS 24 // 4kB pages up to 32GB, which is plenty
+
+typedef struct BuddyPool
+{
+  unsigned int min_shift; // log2 of the smallest block size, in bytes
+  unsigned int nr_orders; // Valid orders are 0 through nr_orders-1
+  unsigned int nr_blocks; // Number of minimum-size blocks in the pool
+
+  int free_head[BUDDY_MAX_ORDERS]; // Head of the free list for each order, -1 if empty
+  int* next; // Free list links, indexed by block number
+  int* prev;
+  signed char* order; // Order of the block starting here, or -1 if this isn't the head of a block
+  unsigned char* is_free; // Whether the block starting here is free
+
+  unsigned int free_count; // Number of minimum-size blocks which are free
+} BuddyPool;
+
+/* Sets up the allocator to manage `size` bytes, split into blocks of at least
+ * 1 << min_shift bytes.  Any tail which isn't a multiple of the minimum block
+ * size is ignored.
+ * Returns 0 on success, or -1 if the bookkeeping memory couldn't be allocated.
+ */
+int buddy_init(BuddyPool* pool, unsigned long size, unsigned int min_shift);
+void buddy_destroy(BuddyPool* pool);
+
+/* Order of the smallest block which holds `size` bytes, or -1 if the request
+ * is larger than the pool could ever satisfy. */
+int buddy_order(BuddyPool* pool, unsigned long size);
+
+/* Allocates a block of at least `size` bytes.
+ * Returns the offset of the block from the start of the pool, or -1 if there
+ * is no free block large enough.
+ */
+long buddy_alloc(BuddyPool* pool, unsigned long size);
+
+/* Returns a block obtained from buddy_alloc() to the pool, merging it with its
+ * buddy (recursively) when the buddy is also free. */
+void buddy_free(BuddyPool* pool, unsigned long offset);
+
+/* Size in bytes of the allocated block at `offset` (0 if there isn't one) */
+unsigned long buddy_block_size(BuddyPool* pool, unsigned long offset);
+
+/* Total free bytes, and the size of the largest block that could currently be
+ * allocated.  The ratio between these is a rough measure of fragmentation. */
+unsigned long buddy_free_bytes(BuddyPool* pool);
+unsigned long buddy_largest_free(BuddyPool* pool);
+
+#endif
@@ -10,28 +10,85 @@
 #include <linux/device.h>
 #include <linux/dma-mapping.h>
 #include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/bitops.h>
+#include <linux/atomic.h>
 #include <linux/of_device.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
 
 #include "common.h"
 #include "buffer.h"
+#include "buddy.h"
+#include "stats.h"
 
-extern const int debug_level; // This is defined in the including driver
+// The logging keys are defined in the including driver
 
-// For now, the implementation assumes a fixed number of large buffers.
-// Asking for smaller images just returns a whole large buffer, and asking
-// for a larger image fails.  A better solution would be to use a buddy
-// allocator and give out pieces that are only as large as necessary.
-#define N_BUFFERS 4
-#define BUFFER_SIZE (2048*1080*4) // This number must be a multiple of 4k pages so mmap works
+// The pool is one large contiguous CMA allocation, which is carved up with a
+// buddy allocator so that small tiles only use as much memory as they need
+// and full-sensor frames can still be allocated from the same region.
+// The pool geometry is chosen by the module at load time (see cmabuf.c).
+#define MIN_BLOCK_SHIFT PAGE_SHIFT // Smallest block is one page so mmap works
 
-unsigned char free_flag[N_BUFFERS];
-Buffer buffers[N_BUFFERS];
+// Acquire and release are called concurrently from several modules and
+// threads (the cmabuffer ioctls, VDMA frame grabs, ...), so none of the fast
+// paths take a lock:
+//  - Buffer slots are claimed with an atomic bitmap.  A second bitmap marks
+//    slots which are fully set up, so that exactly one caller wins a release.
+//  - Freed blocks are parked in small per-order caches, which are claimed and
+//    filled with cmpxchg.  Streaming the same sizes over and over is then just
+//    a couple of atomic operations.
+// Only a cache miss goes to the buddy allocator itself, under a spinlock.
+#define BLOCK_CACHE_DEPTH 8 // Cached blocks per order
+
+unsigned long pool_size; // Total bytes in the CMA region
+unsigned int max_buffers; // Maximum number of buffers handed out at once
+unsigned long* slot_map; // Bit set when a buffer slot is claimed
+unsigned long* live_map; // Bit set when a buffer is fully set up (and not being released)
+atomic_t* refs; // References to each buffer: one for the owner, plus any exports
+void** owner; // Who to reclaim each buffer from, NULL for kernel users
+pid_t* handed_to; // Process a kernel buffer was handed to with set_buffer_owner(), else 0
+#define NO_PARENT (-1)
+int* parent; // For slices, the buffer whose memory they use (and hold a reference on); else NO_PARENT
+Buffer* buffers;
+BuddyPool pool;
+DEFINE_SPINLOCK(pool_lock); // Protects the buddy allocator only
+atomic_long_t block_cache[BUDDY_MAX_ORDERS][BLOCK_CACHE_DEPTH]; // offset + 1, or 0 if empty
 unsigned long base_phys_addr; // Physical base address of buffer
 void* base_kern_addr = NULL; // Kernel virtual base address of buffer
 
-int init_buffers(struct device* dev)
+// Per-CPU statistics (see stats.h)
+struct buffer_stats {
+  u64 allocs;
+  u64 alloc_failures;
+  u64 alloc_bytes; // Block sizes, so including what the buddy allocator rounds up
+  u64 slices;
+  u64 frees; // Last reference gone, so the slot (and any memory) is back
+  u64 cache_hits; // Blocks from the per-order caches
+  u64 cache_misses; // ...and from the buddy allocator itself
+  struct stat_hist lat_held; // Acquired -> last reference gone
+};
+
+static const struct stat_field buffer_stat_fields[] = {
+  STAT_COUNTER(struct buffer_stats, allocs),
+  STAT_COUNTER(struct buffer_stats, alloc_failures),
+  STAT_COUNTER(struct buffer_stats, alloc_bytes),
+  STAT_COUNTER(struct buffer_stats, slices),
+  STAT_COUNTER(struct buffer_stats, frees),
+  STAT_COUNTER(struct buffer_stats, cache_hits),
+  STAT_COUNTER(struct buffer_stats, cache_misses),
+  STAT_HIST(struct buffer_stats, lat_held),
+};
+
+static struct buffer_stats __percpu* stats;
+static struct stats_debugfs stats_debugfs;
+static ktime_t* acquired; // When each buffer was handed out
+
+int init_buffers(struct device* dev, unsigned long size, unsigned int nbuffers)
 {
-  int i;
+  unsigned int i;
+
   // Configure the DMA masks
   // Anything within actual DRAM (up to 2GB) is fair game
   // This returns zero on success (contrary to LDD3)
@@ -52,10 +109,18 @@ int init_buffers(struct device* dev)
   // For now, let's try and do this with the new-ish Linux Contiguous Memory
   // Allocator (CMA).
   // Boot-time parameter should be set in the devicetree: cma=100MB
-  DEBUG("Allocating %d (%dMB) for CMA.\n", N_BUFFERS*BUFFER_SIZE, N_BUFFERS*BUFFER_SIZE/(1024*1024));
-  base_kern_addr = dma_alloc_coherent(dev, N_BUFFERS*BUFFER_SIZE,
+  // kcalloc(0) and an empty buddy pool would both "succeed"
+  if(size < PAGE_SIZE || nbuffers == 0){
+    ERROR("Buffer pool of %lu bytes for %u buffers is no use\n", size, nbuffers);
+    return(-1);
+  }
+
+  pool_size = PAGE_ALIGN(size);
+  max_buffers = nbuffers;
+  DEBUG("Allocating %lu (%luMB) for CMA.\n", pool_size, pool_size/(1024*1024));
+  base_kern_addr = dma_alloc_coherent(dev, pool_size,
                          (dma_addr_t*)&base_phys_addr, GFP_KERNEL);
-  // TODO: make sure this is page-aligned so mmap works later
+  // dma_alloc_coherent returns whole pages, so every block is page-aligned
   if(base_kern_addr == NULL){
     ERROR("Failed to allocate memory! Check CMA size.\n");
     return(-1);
@@ -63,33 +128,65 @@ int init_buffers(struct device* dev)
 
   DEBUG("memory allocated at %lx / %lx\n", (unsigned long)base_kern_addr, base_phys_addr);
 
-  // Create some buffers to fill with data as the camera streams.
-  for(i = 0; i < N_BUFFERS; i++){
-    buffers[i].id = i;
-    buffers[i].phys_addr = base_phys_addr + (i * BUFFER_SIZE);
-    buffers[i].kern_addr = base_kern_addr + (i * BUFFER_SIZE);
-    buffers[i].mmap_offset = i * BUFFER_SIZE;
-    //buffers[i].cvals = kmalloc(sizeof(struct mMap), GFP_KERNEL);
-    free_flag[i] = 1;
-DEBUG("Buffer %d  phys: %lx  kern: %lx\n", i, (unsigned long)buffers[i].phys_addr, (unsigned long)buffers[i].kern_addr);
+  slot_map = kcalloc(BITS_TO_LONGS(max_buffers), sizeof(unsigned long), GFP_KERNEL);
+  live_map = kcalloc(BITS_TO_LONGS(max_buffers), sizeof(unsigned long), GFP_KERNEL);
+  owner = kcalloc(max_buffers, sizeof(void*), GFP_KERNEL);
+  handed_to = kcalloc(max_buffers, sizeof(pid_t), GFP_KERNEL);
+  refs = kcalloc(max_buffers, sizeof(atomic_t), GFP_KERNEL);
+  parent = kcalloc(max_buffers, sizeof(int), GFP_KERNEL);
+  buffers = kcalloc(max_buffers, sizeof(Buffer), GFP_KERNEL);
+  acquired = kcalloc(max_buffers, sizeof(ktime_t), GFP_KERNEL);
+  stats = alloc_percpu(struct buffer_stats);
+  memset(block_cache, 0, sizeof(block_cache));
+  if(slot_map == NULL || live_map == NULL || owner == NULL || handed_to == NULL || refs == NULL || parent == NULL ||
+     buffers == NULL || acquired == NULL || stats == NULL ||
+     buddy_init(&pool, pool_size, MIN_BLOCK_SHIFT) < 0){
+    ERROR("Failed to allocate buffer bookkeeping\n");
+    cleanup_buffers(dev);
+    return(-1);
+  }
+
+  // kcalloc's zeroes would make every unused id look like a slice of buffer 0
+  for(i = 0; i < max_buffers; i++){
+    parent[i] = NO_PARENT;
   }
 
+  DEBUG("Pool holds up to %u buffers, largest block %lu bytes\n",
+        max_buffers, buddy_largest_free(&pool));
   return(0); // Success
 }
 
 /* "Destructor" which frees memory */
 void cleanup_buffers(struct device* dev)
 {
-  dma_free_coherent(dev, N_BUFFERS*BUFFER_SIZE, base_kern_addr, base_phys_addr);
+  buddy_destroy(&pool);
+  kfree(slot_map);
+  kfree(live_map);
+  kfree(owner);
+  kfree(handed_to);
+  kfree(refs);
+  kfree(parent);
+  kfree(buffers);
+  kfree(acquired);
+  free_percpu(stats);
+  slot_map = NULL;
+  live_map = NULL;
+  refs = NULL;
+  parent = NULL;
+  owner = NULL;
+  handed_to = NULL;
+  buffers = NULL;
+  acquired = NULL;
+  stats = NULL;
+
+  dma_free_coherent(dev, pool_size, base_kern_addr, base_phys_addr);
   DEBUG("Freed CMA memory\n");
   base_kern_addr = NULL;
+}
 
-/*
-  int i;
-  for(i = 0; i < N_BUFFERS; i++){
-    kfree(buffers[i].cvals);
-  }
-*/
+bool offset_in_range(unsigned long offset, unsigned long length)
+{
+  return(base_kern_addr != NULL && offset < pool_size && length <= pool_size - offset);
 }
 
 void* get_base_addr(void)
@@ -103,16 +200,111 @@ unsigned long get_phys_addr(void)
 }
 
 
+/* Takes a block of the given order out of the cache, or returns -1 */
+static long cache_pop(int order)
+{
+  int j;
+  long val;
+  for(j = 0; j < BLOCK_CACHE_DEPTH; j++){
+    val = atomic_long_read(&block_cache[order][j]);
+    if(val != 0 && atomic_long_cmpxchg(&block_cache[order][j], val, 0) == val){
+      return(val - 1);
+    }
+  }
+  return(-1);
+}
+
+/* Parks a block in the cache; returns false if the cache for its order is full */
+static bool cache_push(int order, long offset)
+{
+  int j;
+  for(j = 0; j < BLOCK_CACHE_DEPTH; j++){
+    if(atomic_long_cmpxchg(&block_cache[order][j], 0, offset + 1) == 0){
+      return(true);
+    }
+  }
+  return(false);
+}
+
+/* Gets a block of memory for `size` bytes, trying the lock-free cache first.
+ * If the buddy allocator is out of space, the cached blocks are handed back
+ * so they can merge, and the allocation is retried once.
+ */
+static long alloc_block(unsigned long size)
+{
+  int order, k;
+  long offset;
+  unsigned long flags;
+
+  order = buddy_order(&pool, size);
+  if(order < 0){
+    return(-1);
+  }
+
+  offset = cache_pop(order);
+  if(offset >= 0){
+    stat_inc(stats, cache_hits);
+    return(offset);
+  }
+  stat_inc(stats, cache_misses);
+
+  spin_lock_irqsave(&pool_lock, flags);
+  offset = buddy_alloc(&pool, size);
+  if(offset < 0){
+    for(k = 0; k < pool.nr_orders; k++){
+      while((offset = cache_pop(k)) >= 0){
+        buddy_free(&pool, offset);
+      }
+    }
+    offset = buddy_alloc(&pool, size);
+  }
+  spin_unlock_irqrestore(&pool_lock, flags);
+  return(offset);
+}
+
+static void free_block(unsigned long offset)
+{
+  unsigned long flags;
+  unsigned long size = buddy_block_size(&pool, offset); // Fixed while we own it
+
+  if(cache_push(buddy_order(&pool, size), offset)){
+    return;
+  }
+
+  spin_lock_irqsave(&pool_lock, flags);
+  buddy_free(&pool, offset);
+  spin_unlock_irqrestore(&pool_lock, flags);
+}
+
+/* Claims the first free buffer slot, or returns -1 if they're all in use.
+ * If someone else beats us to a slot, look again; each pass either wins or
+ * sees a fuller map.
+ */
+static int claim_slot(void)
+{
+  unsigned int i;
+
+  do{
+    i = find_first_zero_bit(slot_map, max_buffers);
+    if(i >= max_buffers){
+      ERROR("acquire_buffer failed: all %u buffers are in use\n", max_buffers);
+      return(-1);
+    }
+  } while(test_and_set_bit(i, slot_map));
+  return(i);
+}
+
 /* depth is in bytes
  * stride is in pixels (i.e., multiply by depth to get stride in bytes)
  */
-// TODO: mutex access to the free flag
-Buffer* acquire_buffer(unsigned int width, unsigned int height, unsigned int depth, unsigned int stride)
+Buffer* acquire_owned_buffer(unsigned int width, unsigned int height, unsigned int depth,
+                             unsigned int stride, void* buf_owner)
 {
-  int i = 0;
+  int i;
+  long offset;
 
   if(base_kern_addr == NULL){
-    WARNING("Device not yet opened; can't acquire buffer\n");
+    WARNING("Buffer pool not allocated; can't acquire buffer\n");
     return NULL;
   }
 
@@ -120,40 +312,122 @@ Buffer* acquire_buffer(unsigned int width, unsigned int height, unsigned int dep
     ERROR("acquire_buffer failed: width (%d) must be <= to stride (%d)\n", width, stride);
     return NULL;
   }
-  if((stride * height * depth) > BUFFER_SIZE){
-    ERROR("acquire_buffer failed: requested bytes (%d) exceeds maximum (%d)\n", (stride*height*depth), BUFFER_SIZE);
-    return NULL;
+
+  i = claim_slot();
+  if(i < 0){
+    stat_inc(stats, alloc_failures);
+    return(NULL);
   }
 
-  // Scan through the list and grab the first free one
-  while(i < N_BUFFERS && free_flag[i] == 0){
-    //printk("acquire_bufffer: %d is already taken, counting to %d\n", i, N_BUFFERS);
-    i++;
+  // And a block of memory to go with it
+  offset = alloc_block((unsigned long)stride * height * depth);
+  if(offset < 0){
+    ERROR("acquire_buffer failed: no free block for %d bytes\n", (stride*height*depth));
+    clear_bit_unlock(i, slot_map);
+    stat_inc(stats, alloc_failures);
+    return(NULL);
   }
-  if(i < N_BUFFERS){
-    free_flag[i] = 0; // Mark as used
+  stat_inc(stats, allocs);
+  stat_add(stats, alloc_bytes, buddy_block_size(&pool, offset));
+  acquired[i] = ktime_get();
 
-    // Set the dimensions and return it to the user
-    buffers[i].width = width;
-    buffers[i].height = height;
-    buffers[i].depth = depth;
-    buffers[i].stride = stride;
+  owner[i] = buf_owner;
+  parent[i] = NO_PARENT;
+  atomic_set(&refs[i], 1); // The owner's reference
 
-    /*
-printk("clearing buffer %d at %lx\n", i, buffers[i].kern_addr);
-  data = (unsigned long*) buffers[i].kern_addr;
-  for(j = 0; j < width*height*depth / sizeof(unsigned long); j++){
-    data[j] = 0xee;
+  // Set the dimensions and return it to the user
+  buffers[i].id = i;
+  buffers[i].width = width;
+  buffers[i].height = height;
+  buffers[i].depth = depth;
+  buffers[i].stride = stride;
+  buffers[i].phys_addr = base_phys_addr + offset;
+  buffers[i].kern_addr = base_kern_addr + offset;
+  buffers[i].mmap_offset = offset;
+
+  // Publish the slot only once everything above is visible
+  smp_mb__before_atomic();
+  set_bit(i, live_map);
+
+  DEBUG("acquire_buffer: Returning buffer %d (%lu bytes at offset %lx)\n",
+        i, buddy_block_size(&pool, offset), offset);
+  return(buffers + i);
+}
+
+Buffer* acquire_buffer(unsigned int width, unsigned int height, unsigned int depth, unsigned int stride)
+{
+  return(acquire_owned_buffer(width, height, depth, stride, NULL));
+}
+
+Buffer* slice_owned_buffer(Buffer* orig, unsigned int x, unsigned int y,
+                           unsigned int width, unsigned int height, void* buf_owner)
+{
+  Buffer* src;
+  unsigned long offset;
+  int i;
+
+  // Keeps the parent's memory around for as long as the slice lives
+  src = get_buffer(orig->id);
+  if(src == NULL){
+    ERROR("slice_buffer failed: buffer %d is not allocated\n", orig->id);
+    return(NULL);
   }
-*/
-    DEBUG("acquire_buffer: Returning buffer %d\n", i);
-    return(buffers + i);
+  // Only the buffer's owner gets to carve it up, as with freeing it
+  if(buf_owner != NULL && !buffer_owned_by(src->id, buf_owner)){
+    ERROR("slice_buffer failed: buffer %d isn't the caller's\n", src->id);
+    put_buffer(src);
+    return(NULL);
   }
-  else{
-    // We ran off the end without finding a free buffer
-    ERROR("acquire_buffer failed: no free buffers\n");
+
+  // Check against our own copy, since the caller's may have come from user space
+  if(width == 0 || height == 0 || x >= src->width || y >= src->height ||
+     width > src->width - x || height > src->height - y){
+    ERROR("slice_buffer failed: %ux%u at (%u, %u) is outside %ux%u buffer %d\n",
+          width, height, x, y, src->width, src->height, src->id);
+    put_buffer(src);
     return(NULL);
   }
+
+  i = claim_slot();
+  if(i < 0){
+    put_buffer(src);
+    stat_inc(stats, alloc_failures);
+    return(NULL);
+  }
+  stat_inc(stats, slices);
+  acquired[i] = ktime_get();
+
+  owner[i] = buf_owner;
+  parent[i] = src->id;
+  atomic_set(&refs[i], 1);
+
+  // Same memory and stride, starting at (x, y)
+  offset = ((unsigned long)y * src->stride + x) * src->depth;
+  buffers[i].id = i;
+  buffers[i].width = width;
+  buffers[i].height = height;
+  buffers[i].depth = src->depth;
+  buffers[i].stride = src->stride;
+  buffers[i].phys_addr = src->phys_addr + offset;
+  buffers[i].kern_addr = src->kern_addr + offset;
+  buffers[i].mmap_offset = src->mmap_offset + offset;
+
+  smp_mb__before_atomic();
+  set_bit(i, live_map);
+
+  DEBUG("slice_buffer: buffer %d is %ux%u at (%u, %u) in buffer %d\n",
+        i, width, height, x, y, src->id);
+  return(buffers + i);
+}
+
+Buffer* slice_buffer(Buffer* orig, unsigned int x, unsigned int y, unsigned int width, unsigned int height)
+{
+  return(slice_owned_buffer(orig, x, y, width, height, NULL));
+}
+
+bool is_slice(unsigned int id)
+{
+  return(id < max_buffers && parent[id] != NO_PARENT);
 }
 
 void zero_buffer(Buffer* buf)
@@ -161,14 +435,147 @@ void zero_buffer(Buffer* buf)
   memset(buf, 0, sizeof(Buffer));
 }
 
+Buffer* get_buffer(unsigned int id)
+{
+  if(id >= max_buffers || !test_bit(id, live_map) || !atomic_inc_not_zero(&refs[id])){
+    return(NULL);
+  }
+  return(buffers + id);
+}
+
+void put_buffer(Buffer* buf)
+{
+  unsigned int id = buf->id;
+  int up;
+
+  if(atomic_dec_and_test(&refs[id])){
+    stat_inc(stats, frees);
+    stat_hist_record(stats, lat_held, ktime_us_delta(ktime_get(), acquired[id]));
+    up = parent[id];
+    if(up != NO_PARENT){
+      // A slice has no memory of its own, just its hold on the parent
+      parent[id] = NO_PARENT;
+      clear_bit_unlock(id, slot_map);
+      put_buffer(buffers + up);
+    }
+    else{
+      // Use our own copy, since the caller's may have come from user space
+      free_block(buffers[id].mmap_offset);
+      clear_bit_unlock(id, slot_map); // Mark as free
+    }
+    DEBUG("put_buffer: free buffer %d\n", id);
+  }
+}
+
 void release_buffer(Buffer* buf)
 {
-  // TODO: error/bounds checking
-  free_flag[buf->id] = 1; // Mark as free
+  unsigned int id = buf->id;
+
+  // Only one caller can clear the live bit, so a double release (or two
+  // racing ones) can't drop the owner's reference twice.
+  if(id >= max_buffers || !test_and_clear_bit(id, live_map)){
+    ERROR("release_buffer: buffer %d is not allocated\n", id);
+    return;
+  }
+
+  owner[id] = NULL;
+  handed_to[id] = 0;
+  // The memory goes back to the pool once any exports are also gone
+  put_buffer(buffers + id);
   // Trust the user to quit using the pointer
-  DEBUG("release_buffer: free buffer %d\n", buf->id);
+  DEBUG("release_buffer: released buffer %d\n", id);
+}
+
+int release_owned_buffer(unsigned int id, void* buf_owner)
+{
+  void* o;
+
+  if(id >= max_buffers || !test_bit(id, live_map)){
+    ERROR("release_buffer: buffer %d is not allocated\n", id);
+    return(-EINVAL);
+  }
+  // A camera frame can be freed on either device by the process which
+  // grabbed it, since it came from the shared pool like any other
+  o = READ_ONCE(owner[id]);
+  smp_rmb(); // Pairs with set_buffer_owner()
+  if(o != buf_owner && (o == NULL || READ_ONCE(handed_to[id]) != task_tgid_nr(current))){
+    o = NULL;
+  }
+  // Taking the owner field first means nobody else can get to the release,
+  // and the slot can't be reused until the release clears the live bit
+  if(o == NULL || cmpxchg(&owner[id], o, NULL) != o){
+    WARNING("release_buffer: buffer %d belongs to someone else\n", id);
+    return(-EPERM);
+  }
+  release_buffer(buffers + id);
+  return(0);
+}
+
+bool buffer_owned_by(unsigned int id, void* buf_owner)
+{
+  return(buf_owner != NULL && id < max_buffers && test_bit(id, live_map) &&
+         READ_ONCE(owner[id]) == buf_owner);
+}
+
+void set_buffer_owner(Buffer* buf, void* buf_owner)
+{
+  WRITE_ONCE(handed_to[buf->id], task_tgid_nr(current));
+  smp_wmb(); // A release which sees the new owner sees who it was handed to
+  WRITE_ONCE(owner[buf->id], buf_owner);
+}
+
+int release_owned_buffers(void* buf_owner)
+{
+  int i, count = 0;
+  for(i = 0; i < max_buffers; i++){
+    if(test_bit(i, live_map) && owner[i] == buf_owner){
+      release_buffer(buffers + i);
+      count++;
+    }
+  }
+  return(count);
+}
+
+/* The debugfs gauges: buffers in use, and the pool's free space.  Blocks
+ * parked in the caches count as in use, since the buddy allocator can't see
+ * them.
+ */
+static void buffer_show_gauges(struct seq_file* s, void* data)
+{
+  unsigned long flags, free_bytes, largest;
+
+  spin_lock_irqsave(&pool_lock, flags);
+  free_bytes = buddy_free_bytes(&pool);
+  largest = buddy_largest_free(&pool);
+  spin_unlock_irqrestore(&pool_lock, flags);
+
+  seq_printf(s, "buffers_live %d\n", bitmap_weight(slot_map, max_buffers));
+  seq_printf(s, "buffers_max %u\n", max_buffers);
+  seq_printf(s, "pool_bytes %lu\n", pool_size);
+  seq_printf(s, "pool_free_bytes %lu\n", free_bytes);
+  seq_printf(s, "pool_largest_free %lu\n", largest);
+}
+
+struct dentry* buffer_stats_debugfs(const char* name, struct dentry* parent)
+{
+  stats_debugfs.stats = stats;
+  stats_debugfs.size = sizeof(struct buffer_stats);
+  stats_debugfs.fields = buffer_stat_fields;
+  stats_debugfs.nr_fields = ARRAY_SIZE(buffer_stat_fields);
+  stats_debugfs.show_gauges = buffer_show_gauges;
+  stats_debugfs.data = NULL;
+  return(stats_debugfs_create(name, parent, &stats_debugfs));
 }
 
 EXPORT_SYMBOL(acquire_buffer);
 EXPORT_SYMBOL(release_buffer);
+EXPORT_SYMBOL(acquire_owned_buffer);
+EXPORT_SYMBOL(slice_buffer);
+EXPORT_SYMBOL(slice_owned_buffer);
+EXPORT_SYMBOL(release_owned_buffer);
+EXPORT_SYMBOL(release_owned_buffers);
+EXPORT_SYMBOL(set_buffer_owner);
+EXPORT_SYMBOL(buffer_owned_by);
+EXPORT_SYMBOL(get_buffer);
+EXPORT_SYMBOL(put_buffer);
 
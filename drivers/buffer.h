@@ -12,6 +12,7 @@
 // TODO: extract this buffer struct so the user code doesn't see the kernel methods
 // TODO: should stride be in bytes, rather than pixels?  Probably doesn't matter much...
 struct device;
+struct dentry;
 
 typedef struct 
 {
@@ -27,10 +28,13 @@ typedef struct
 } Buffer;
 
 /* Performs any global initialization of the buffer code, such as allocating
- * pools of memory and filling out buffer structs. */
-int init_buffers(struct device* dev);
+ * pools of memory and filling out buffer structs.  This is called once when
+ * the module loads, and the pool lives until cleanup_buffers() at unload.
+ * pool_size is the total bytes to take from CMA, and max_buffers is the most
+ * buffers which can be handed out at once. */
+int init_buffers(struct device* dev, unsigned long pool_size, unsigned int max_buffers);
 void cleanup_buffers(struct device* dev);
-bool offset_in_range(unsigned long offset);
+bool offset_in_range(unsigned long offset, unsigned long length); // Whether [offset, offset+length) is inside the pool
 void* get_base_addr(void); // TODO remove this in favor of a better mmap solution?
 unsigned long get_phys_addr(void);
 
@@ -39,15 +43,76 @@ unsigned long get_phys_addr(void);
  */
 Buffer* acquire_buffer(unsigned int width, unsigned int height, unsigned int depth, unsigned int stride);
 
+/* Same as acquire_buffer, but tags the buffer with an owner (normally the
+ * struct file that asked for it) so it can be reclaimed when the owner goes
+ * away without freeing it.
+ */
+Buffer* acquire_owned_buffer(unsigned int width, unsigned int height, unsigned int depth,
+                             unsigned int stride, void* owner);
+
 /* Returns a new buffer object which points to the same memory, but which has
- * a smaller shape.  The base pointers and width/height are adjusted to match.
+ * a smaller shape.  The base pointers and width/height are adjusted to match,
+ * and the stride stays the same.  The slice holds a reference on orig, so the
+ * memory stays valid until the slice is released too.  Its mmap_offset is
+ * where its first pixel is in the pool, which generally isn't page-aligned;
+ * map the original buffer to get at it from user space.
+ * Returns NULL if orig isn't allocated or the region doesn't fit inside it.
+ * slice_owned_buffer() also returns NULL unless owner (if not NULL) owns orig.
  */
 Buffer* slice_buffer(Buffer* orig, unsigned int x, unsigned int y, unsigned int width, unsigned int height);
+Buffer* slice_owned_buffer(Buffer* orig, unsigned int x, unsigned int y,
+                           unsigned int width, unsigned int height, void* owner);
+bool is_slice(unsigned int id); // Whether buffer id was made by slice_buffer()
+
+/* Argument for the cmabuffer SLICE_BUFFER ioctl.  buf goes in as the buffer
+ * to slice, and comes back as the slice, which is freed with FREE_IMAGE like
+ * any other buffer.
+ */
+typedef struct BufferSlice
+{
+  Buffer buf;
+  unsigned int x;
+  unsigned int y;
+  unsigned int width;
+  unsigned int height;
+} BufferSlice;
 
 void zero_buffer(Buffer* buf);
 
-/* Releases the buffer back into the "free" pool to be acquired again. */
+/* Releases the owner's hold on the buffer.  Unless it has been exported, it
+ * goes back into the "free" pool to be acquired again. */
 void release_buffer(Buffer* buf);
 
+/* Takes an extra reference on a live buffer, so that its memory stays valid
+ * even after the owner releases it (e.g., while it is exported as a dma-buf).
+ * Returns NULL if there is no live buffer with that id.
+ */
+Buffer* get_buffer(unsigned int id);
+
+/* Drops a reference taken with get_buffer().  The memory goes back to the
+ * pool when the last reference (including the owner's) is gone. */
+void put_buffer(Buffer* buf);
+
+/* Releases buffer id for FREE_IMAGE, but only if it is tagged with `owner`,
+ * or was handed with set_buffer_owner() to the calling process (so a camera
+ * frame can be freed on /dev/vdma or /dev/cmabuffer0 alike).
+ * Returns -EINVAL if there's no such buffer and -EPERM if it belongs to
+ * someone else (another process, or a kernel user like the VDMA ring). */
+int release_owned_buffer(unsigned int id, void* owner);
+
+/* Whether buffer id is live and tagged with `owner` (never true for NULL) */
+bool buffer_owned_by(unsigned int id, void* owner);
+
+/* Hands a kernel buffer over to `owner`, e.g., a camera frame given to the
+ * process which grabbed it.  It is reclaimed when `owner` closes, but the
+ * calling process may free it through any device. */
+void set_buffer_owner(Buffer* buf, void* owner);
+
+/* Releases every buffer tagged with `owner`, returning how many there were. */
+int release_owned_buffers(void* owner);
+
+/* Makes a debugfs directory with the pool's statistics (see stats.h) */
+struct dentry* buffer_stats_debugfs(const char* name, struct dentry* parent);
+
 #endif
 
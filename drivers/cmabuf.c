@@ -4,6 +4,11 @@
 #include <asm/uaccess.h> // Copy to/from userspace pointers
 #include <linux/mm.h>
 #include <linux/pagemap.h>
+#include <linux/of.h>
+#include <linux/dma-buf.h>
+#include <linux/scatterlist.h>
+#include <linux/slab.h>
+#include <linux/debugfs.h>
 
 MODULE_LICENSE("GPL");
 
@@ -18,40 +23,199 @@ dev_t device_num;
 struct cdev *chardev;
 struct device *cmabuf_dev;
 struct class *cmabuf_class;
+struct dentry *cmabuf_debugfs; // Pool statistics, in /sys/kernel/debug/cmabuffer
 
-const int debug_level = 1; // 0 is errors only, increasing numbers print more stuff
+DEFINE_DEBUG_LEVEL(1);
 
-// TODO: allow the file handle to be opened multiple times, and access
-// the same pool of memory?
+// Pool geometry.  The defaults can be overridden by a "cmabuffer" node in the
+// device tree (generated by dtconfig.py), and module parameters override both.
+#define DEFAULT_POOL_SIZE (4*2048*1080*4)
+#define DEFAULT_MAX_BUFFERS 64
+#define MAX_MAX_BUFFERS 4096 // Far more than the pool could ever hold
+
+static unsigned int pool_mb = 0;
+module_param(pool_mb, uint, 0444);
+MODULE_PARM_DESC(pool_mb, "size of the CMA buffer pool in MB (0 uses the device tree or default)");
+
+static unsigned int max_buffers = 0;
+module_param(max_buffers, uint, 0444);
+MODULE_PARM_DESC(max_buffers, "maximum number of live buffers (0 uses the device tree or default)");
+
+// The buffer pool is allocated once when the module loads, so opening the
+// device is cheap and any number of processes can share the pool.  Buffers
+// are tagged with the file that allocated them and reclaimed on close.
 static int dev_open(struct inode *inode, struct file *file)
 {
   TRACE("cmabuffer: dev_open\n");
-  // Set up the image buffers; fail if it fails.
-  if(init_buffers(cmabuf_dev) < 0){
-    return(-ENOMEM);
-  }
-
   return(0);
 }
 
 static int dev_close(struct inode *inode, struct file *file)
 {
+  int count;
   TRACE("cmabuffer: dev_close\n");
-  cleanup_buffers(cmabuf_dev); // Release all the buffer memory
+  count = release_owned_buffers(file); // Anything the process didn't free
+  if(count > 0){
+    WARNING("cmabuffer: reclaimed %d buffers left allocated at close\n", count);
+  }
 
   return(0);
 }
 
-void free_image(Buffer* buf)
+// Only the file which allocated a buffer can free it, or for a camera frame,
+// the process which grabbed it
+int free_image(Buffer* buf, struct file* filp)
 {
-  release_buffer(buf);
   DEBUG("Releasing image\n");
+  return(release_owned_buffer(buf->id, filp));
+}
+
+
+/* dma-buf export
+ * Each exported dma-buf holds a reference on its Buffer, so the memory stays
+ * put until the last importer (or mapping) lets go, even if the process that
+ * allocated it frees it or exits.
+ */
+static unsigned long export_size(Buffer* buf)
+{
+  return(PAGE_ALIGN((unsigned long)buf->stride * buf->height * buf->depth));
+}
+
+static struct sg_table* cmabuf_map_dma_buf(struct dma_buf_attachment* attach,
+                                           enum dma_data_direction dir)
+{
+  Buffer* buf = attach->dmabuf->priv;
+  struct sg_table* sgt;
+
+  // The pool is physically contiguous, so one entry covers the whole buffer
+  sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+  if(sgt == NULL || sg_alloc_table(sgt, 1, GFP_KERNEL)){
+    kfree(sgt);
+    return(ERR_PTR(-ENOMEM));
+  }
+  sg_set_page(sgt->sgl, pfn_to_page(buf->phys_addr >> PAGE_SHIFT), export_size(buf), 0);
+
+  if(dma_map_sg(attach->dev, sgt->sgl, sgt->orig_nents, dir) == 0){
+    sg_free_table(sgt);
+    kfree(sgt);
+    return(ERR_PTR(-ENOMEM));
+  }
+  return(sgt);
+}
+
+static void cmabuf_unmap_dma_buf(struct dma_buf_attachment* attach,
+                                 struct sg_table* sgt, enum dma_data_direction dir)
+{
+  dma_unmap_sg(attach->dev, sgt->sgl, sgt->orig_nents, dir);
+  sg_free_table(sgt);
+  kfree(sgt);
+}
+
+static void cmabuf_release_dma_buf(struct dma_buf* dmabuf)
+{
+  Buffer* buf = dmabuf->priv;
+  DEBUG("cmabuffer: dma-buf for buffer %d released\n", buf->id);
+  put_buffer(buf);
+}
+
+// User mappings of the pool are cacheable, so CPU access through the dma-buf
+// has to be bracketed with cache maintenance unless the device is coherent.
+static int cmabuf_begin_cpu_access(struct dma_buf* dmabuf, enum dma_data_direction dir)
+{
+  Buffer* buf = dmabuf->priv;
+  dma_sync_single_for_cpu(cmabuf_dev, buf->phys_addr, export_size(buf), dir);
+  return(0);
+}
+
+static int cmabuf_end_cpu_access(struct dma_buf* dmabuf, enum dma_data_direction dir)
+{
+  Buffer* buf = dmabuf->priv;
+  dma_sync_single_for_device(cmabuf_dev, buf->phys_addr, export_size(buf), dir);
+  return(0);
+}
+
+static void* cmabuf_kmap(struct dma_buf* dmabuf, unsigned long page_num)
+{
+  Buffer* buf = dmabuf->priv;
+  return(buf->kern_addr + (page_num << PAGE_SHIFT));
+}
+
+static void cmabuf_kunmap(struct dma_buf* dmabuf, unsigned long page_num, void* addr)
+{
+  // Nothing to do; the pool is permanently mapped in the kernel
 }
 
+static int cmabuf_mmap_dma_buf(struct dma_buf* dmabuf, struct vm_area_struct* vma)
+{
+  Buffer* buf = dmabuf->priv;
+  unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
+  unsigned long vsize = vma->vm_end - vma->vm_start;
+
+  if(offset >= export_size(buf) || vsize > export_size(buf) - offset){
+    return(-EINVAL);
+  }
+  return(remap_pfn_range(vma, vma->vm_start, (buf->phys_addr + offset) >> PAGE_SHIFT,
+                         vsize, vma->vm_page_prot));
+}
+
+static const struct dma_buf_ops cmabuf_dma_buf_ops = {
+  .map_dma_buf = cmabuf_map_dma_buf,
+  .unmap_dma_buf = cmabuf_unmap_dma_buf,
+  .release = cmabuf_release_dma_buf,
+  .begin_cpu_access = cmabuf_begin_cpu_access,
+  .end_cpu_access = cmabuf_end_cpu_access,
+  .kmap_atomic = cmabuf_kmap,
+  .kunmap_atomic = cmabuf_kunmap,
+  .kmap = cmabuf_kmap,
+  .kunmap = cmabuf_kunmap,
+  .mmap = cmabuf_mmap_dma_buf,
+};
+
+/* Wraps a live buffer in a dma-buf and returns a file descriptor for it.
+ * Only the file which allocated the buffer can export it. */
+int export_dmabuf(unsigned int id, struct file* filp)
+{
+  DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+  struct dma_buf* dmabuf;
+  Buffer* buf;
+  int fd;
+
+  // A slice generally doesn't start on a page, which the export assumes
+  if(is_slice(id)){
+    return(-EINVAL);
+  }
+  buf = get_buffer(id);
+  if(buf == NULL){
+    return(-EINVAL);
+  }
+  // Checked with our reference held, so the id can't be reused meanwhile
+  if(!buffer_owned_by(id, filp)){
+    put_buffer(buf);
+    return(-EPERM);
+  }
+
+  exp_info.ops = &cmabuf_dma_buf_ops;
+  exp_info.size = export_size(buf);
+  exp_info.flags = O_RDWR;
+  exp_info.priv = buf;
+
+  dmabuf = dma_buf_export(&exp_info);
+  if(IS_ERR(dmabuf)){
+    put_buffer(buf);
+    return(PTR_ERR(dmabuf));
+  }
+
+  fd = dma_buf_fd(dmabuf, O_CLOEXEC);
+  if(fd < 0){
+    dma_buf_put(dmabuf); // Calls release, which drops our reference
+  }
+  return(fd);
+}
 
 long dev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
   Buffer tmp, *tmpptr;
+  BufferSlice slice;
   DEBUG("ioctl cmd %d | %lu (%lx) \n", cmd, arg, arg);
   switch(cmd){
     case GET_BUFFER:
@@ -59,7 +223,8 @@ long dev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
       // Get the desired buffer parameters from the object passed to us
       if(access_ok(VERIFY_READ, (void*)arg, sizeof(Buffer)) &&
          copy_from_user(&tmp, (void*)arg, sizeof(Buffer)) == 0){
-        tmpptr = acquire_buffer(tmp.width, tmp.height, tmp.depth, tmp.stride);
+        tmpptr = acquire_owned_buffer(tmp.width, tmp.height, tmp.depth,
+                                      tmp.stride, filp);
         if(tmpptr == NULL){
           return(-ENOBUFS);
         }
@@ -81,7 +246,34 @@ long dev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
       // Copy the object into our tmp copy
       if(access_ok(VERIFY_READ, (void*)arg, sizeof(Buffer)) &&
          copy_from_user(&tmp, (void*)arg, sizeof(Buffer)) == 0){
-          free_image(&tmp);
+          return(free_image(&tmp, filp));
+      }
+      else{
+        return(-EACCES);
+      }
+      break;
+
+    case SLICE_BUFFER:
+      TRACE("ioctl: SLICE_BUFFER\n");
+      if(copy_from_user(&slice, (void*)arg, sizeof(BufferSlice)) != 0){
+        return(-EIO);
+      }
+      tmpptr = slice_owned_buffer(&slice.buf, slice.x, slice.y,
+                                  slice.width, slice.height, filp);
+      if(tmpptr == NULL){
+        return(-EINVAL);
+      }
+      if(copy_to_user((void*)arg, tmpptr, sizeof(Buffer)) != 0){
+        release_buffer(tmpptr);
+        return(-EIO);
+      }
+      break;
+
+    case EXPORT_DMABUF:
+      TRACE("ioctl: EXPORT_DMABUF\n");
+      if(access_ok(VERIFY_READ, (void*)arg, sizeof(Buffer)) &&
+         copy_from_user(&tmp, (void*)arg, sizeof(Buffer)) == 0){
+        return(export_dmabuf(tmp.id, filp));
       }
       else{
         return(-EACCES);
@@ -95,40 +287,33 @@ long dev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
   return(0); // Success
 }
 
-int vma_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+/* Maps a range of the buffer pool into user space.  The offset is the
+ * mmap_offset of a buffer (or anything else within the pool).
+ * All of the page table entries are filled in here rather than on demand, so
+ * touching a freshly-mapped frame costs no page faults.  The pool is one
+ * physically contiguous region, so this is a single remap.
+ */
+int dev_mmap(struct file *filp, struct vm_area_struct *vma)
 {
-  struct page* pageptr;
-
-  // Calculate with physical address, ala udmabuf/LDD3
-  uint64_t offset             = vmf->pgoff << PAGE_SHIFT;
-  uint64_t phys_addr          = get_phys_addr() + offset;
-  unsigned long pageframe     = phys_addr >> PAGE_SHIFT;
+  unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
+  unsigned long vsize = vma->vm_end - vma->vm_start;
 
-  DEBUG("vma_fault() offset: %llx  phys_addr: %llx pageframe: %lx\n",
-          offset, phys_addr, pageframe);
+  if(!offset_in_range(offset, vsize)){
+    ERROR("dev_mmap: offset %lx + %lx is outside the buffer pool\n", offset, vsize);
+    return(-EINVAL);
+  }
 
-  if(!pfn_valid(pageframe)) {
-    return(-1);
+  // remap_pfn_range marks the vma VM_IO | VM_PFNMAP, so the kernel won't try
+  // to treat these as normal pages (no refcounting, no core dumps).
+  if(remap_pfn_range(vma, vma->vm_start, (get_phys_addr() + offset) >> PAGE_SHIFT,
+                     vsize, vma->vm_page_prot)){
+    return(-EAGAIN);
   }
-  pageptr = pfn_to_page(pageframe);
-  get_page(pageptr);
-  vmf->page = pageptr;
 
+  TRACE("dev_mmap virt: %lx, offset: %lx, size: %lx\n", vma->vm_start, offset, vsize);
   return(0);
 }
 
-static struct vm_operations_struct vma_operations = {
-  .fault = vma_fault,
-};
-
-int dev_mmap(struct file *filp, struct vm_area_struct *vma)
-{
-  TRACE("dev_mmap\n");
-  // Just set up the operations; fault operation does all the hard work
-  vma->vm_ops = &vma_operations;
-  return 0;
-}
-
 struct file_operations fops = {
   // No read/write; everything is handled by ioctl and mmap
   .open = dev_open,
@@ -144,8 +329,60 @@ static int uevent(struct device *dev, struct kobj_uevent_env *env)
         return 0;
 }
 
+/* Works out the pool geometry from the defaults, the device tree, and the
+ * module parameters, in increasing order of precedence.
+ * Returns -EINVAL if the result makes no sense. */
+static int get_pool_geometry(unsigned long* size, unsigned int* nbuffers)
+{
+  struct device_node* node;
+  u32 val;
+
+  *size = DEFAULT_POOL_SIZE;
+  *nbuffers = DEFAULT_MAX_BUFFERS;
+
+  node = of_find_compatible_node(NULL, NULL, "cmabuffer");
+  if(node != NULL){
+    if(of_property_read_u32(node, "pool-size", &val) == 0){
+      *size = val;
+    }
+    if(of_property_read_u32(node, "max-buffers", &val) == 0){
+      *nbuffers = val;
+    }
+    of_node_put(node);
+  }
+
+  if(pool_mb > 0){
+    *size = (unsigned long)pool_mb << 20;
+  }
+  if(max_buffers > 0){
+    *nbuffers = max_buffers;
+  }
+
+  if(*size < PAGE_SIZE){
+    ERROR("cmabuffer: pool size %lu is less than a page\n", *size);
+    return(-EINVAL);
+  }
+  if(*nbuffers == 0 || *nbuffers > MAX_MAX_BUFFERS){
+    ERROR("cmabuffer: max-buffers %u must be 1 to %d\n", *nbuffers, MAX_MAX_BUFFERS);
+    return(-EINVAL);
+  }
+  return(0);
+}
+
 static int cmabuf_driver_init(void)
 {
+  unsigned long size;
+  unsigned int nbuffers;
+  int retval;
+
+  debug_level_init();
+
+  // Check the pool geometry before setting anything up
+  retval = get_pool_geometry(&size, &nbuffers);
+  if(retval < 0){
+    return(retval);
+  }
+
   // Get a single character device number
   alloc_chrdev_region(&device_num, 0, 1, DEVNAME);
   DEBUG("Device registered with major %d, minor: %d\n", MAJOR(device_num), MINOR(device_num));
@@ -160,6 +397,16 @@ static int cmabuf_driver_init(void)
   // MKDEV(MAJOR(device_num), minor_num)
   cmabuf_dev = device_create(cmabuf_class, NULL, device_num, 0, DEVNAME);
 
+  // Set up the image buffers once, for the lifetime of the module
+  if(init_buffers(cmabuf_dev, size, nbuffers) < 0){
+    device_unregister(cmabuf_dev);
+    class_destroy(cmabuf_class);
+    unregister_chrdev_region(device_num, 1);
+    return(-ENOMEM);
+  }
+
+  cmabuf_debugfs = buffer_stats_debugfs(CLASSNAME, NULL);
+
   // Register the driver with the kernel
   chardev = cdev_alloc();
   chardev->ops = &fops;
@@ -172,9 +419,11 @@ static int cmabuf_driver_init(void)
 
 static void cmabuf_driver_exit(void)
 {
+  cdev_del(chardev); // No new users past this point
+  debugfs_remove_recursive(cmabuf_debugfs);
+  cleanup_buffers(cmabuf_dev); // Release all the buffer memory
   device_unregister(cmabuf_dev);
   class_destroy(cmabuf_class);
-  cdev_del(chardev);
   unregister_chrdev_region(device_num, 1);
 
 }
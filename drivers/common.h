@@ -1,9 +1,77 @@
 #ifndef _COMMON_H_
 #define _COMMON_H_
 
+#include <linux/printk.h>
+#include <linux/jump_label.h>
+#include <linux/moduleparam.h>
+
+/* Logging, by debug_level:
+ *   0 - ERROR only
+ *   1 - WARNING too
+ *   2 - TRACE, a few lines for every frame
+ *   3 - DEBUG, everything
+ * Each level past ERROR is switched by a static key, so a disabled level is a
+ * patched-out jump instead of a load and compare; TRACE and DEBUG sit in the
+ * IRQ and submit paths.  Building with HWACC_NO_TRACE=1 (see the Makefile)
+ * compiles TRACE and DEBUG out altogether.
+ *
+ * Each module using these needs DEFINE_DEBUG_LEVEL() once, and must call
+ * debug_level_init() when it loads so the default level takes effect.
+ */
+DECLARE_STATIC_KEY_FALSE(log_warning);
+DECLARE_STATIC_KEY_FALSE(log_trace);
+DECLARE_STATIC_KEY_FALSE(log_debug);
+
 #define ERROR(...)   printk(__VA_ARGS__)
-#define WARNING(...) if(debug_level > 0) printk(__VA_ARGS__)
-#define TRACE(...)   if(debug_level > 1) printk(__VA_ARGS__)
-#define DEBUG(...)   if(debug_level > 2) printk(__VA_ARGS__)
+#define WARNING(...) do{ if(static_branch_unlikely(&log_warning)) printk(__VA_ARGS__); } while(0)
+#ifdef HWACC_NO_TRACE
+#define TRACE(...)   no_printk(__VA_ARGS__)
+#define DEBUG(...)   no_printk(__VA_ARGS__)
+#else
+#define TRACE(...)   do{ if(static_branch_unlikely(&log_trace)) printk(__VA_ARGS__); } while(0)
+#define DEBUG(...)   do{ if(static_branch_unlikely(&log_debug)) printk(__VA_ARGS__); } while(0)
+#endif
+
+static inline void log_key_set(struct static_key_false* key, bool on)
+{
+  if(on){
+    static_branch_enable(key);
+  }
+  else{
+    static_branch_disable(key);
+  }
+}
+
+static inline void debug_level_apply(int level)
+{
+  log_key_set(&log_warning, level > 0);
+  log_key_set(&log_trace, level > 1);
+  log_key_set(&log_debug, level > 2);
+}
+
+/* The keys, plus a debug_level module parameter which flips them */
+#define DEFINE_DEBUG_LEVEL(default_level) \
+  DEFINE_STATIC_KEY_FALSE(log_warning); \
+  DEFINE_STATIC_KEY_FALSE(log_trace); \
+  DEFINE_STATIC_KEY_FALSE(log_debug); \
+  static int debug_level = (default_level); \
+  static int debug_level_set(const char* val, const struct kernel_param* kp) \
+  { \
+    int retval = param_set_int(val, kp); \
+    if(retval == 0){ \
+      debug_level_apply(debug_level); \
+    } \
+    return(retval); \
+  } \
+  static const struct kernel_param_ops debug_level_ops = { \
+    .set = debug_level_set, \
+    .get = param_get_int, \
+  }; \
+  module_param_cb(debug_level, &debug_level_ops, &debug_level, 0644); \
+  MODULE_PARM_DESC(debug_level, "0 is errors only, increasing numbers print more stuff"); \
+  static void debug_level_init(void) \
+  { \
+    debug_level_apply(debug_level); \
+  }
 
 #endif
@@ -1,121 +1,122 @@
+#include <linux/bug.h>
+#include <linux/irqflags.h>
+
+#include "common.h"
 #include "dma_bufferset.h"
 
 /* Initializes an empty buffer list */
 void buffer_initlist(BufferList *list)
 {
-  list->head = NULL;
-  list->tail = NULL;
-  sema_init(&list->mutex, 1);
+  int i;
+
+  atomic_set(&list->head, 0);
+  atomic_set(&list->tail, 0);
+  for(i = 0; i < BUFFERLIST_SIZE; i++){
+    // Slot i is free to be filled by the push at position i
+    atomic_set(&list->slot[i].seq, i);
+    list->slot[i].set = NULL;
+  }
 }
 
-/* Attaches a buffer at the tail of the list */
+/* Attaches a buffer at the tail of the list.
+ * A set is only ever on one list, and each list has room for twice the pool
+ * (see reset_buffer_list()), so this can't fill up; if it does, that's a
+ * bug, and the set is dropped with a warning. */
 void buffer_enqueue(BufferList* list, BufferSet* buf)
 {
-  while(down_interruptible(&(list->mutex)) != 0) {}
-
-  // If there's nothing in the list, then the item we add will be both head
-  // and tail, and we need to set that.
-  if(list->head == NULL){
-    list->head = buf;
-  }
-  // If there is something in the list, point it to the new node
-  // If tail is NULL, the head is also NULL, and we won't take this branch.
-  else{
-    list->tail->next = buf;
+  struct bufferlist_slot* s;
+  unsigned long flags;
+  int pos, diff;
+
+  local_irq_save(flags);
+  pos = atomic_read(&list->tail);
+  while(1){
+    s = &list->slot[pos & (BUFFERLIST_SIZE - 1)];
+    diff = atomic_read_acquire(&s->seq) - pos;
+    if(diff == 0){
+      // The slot is empty; claim it, unless another pusher beat us to it
+      if(atomic_cmpxchg(&list->tail, pos, pos + 1) == pos){
+        break;
+      }
+      pos = atomic_read(&list->tail);
+    }
+    else if(diff < 0){
+      // Still holding the entry from the last lap, so we're full
+      local_irq_restore(flags);
+      WARN_ON_ONCE(1);
+      ERROR("BufferList full, dropping buffer set %d!\n", buf->id);
+      return;
+    }
+    else{
+      pos = atomic_read(&list->tail);
+    }
   }
 
-  buf->next = NULL; // This is the new end of the list
-  list->tail = buf; // Update the tail pointer
-  up(&(list->mutex));
+  s->set = buf;
+  atomic_set_release(&s->seq, pos + 1); // Publish to the poppers
+  local_irq_restore(flags);
 }
 
-/* Removes a buffer from the head of the list*/
+/* Removes a buffer from the head of the list.
+ * Returns NULL if the list is empty. */
 BufferSet* buffer_dequeue(BufferList* list)
 {
+  struct bufferlist_slot* s;
   BufferSet* result;
-  while(down_interruptible(&(list->mutex)) != 0) {}
-  result = list->head;
-
-  if(result != NULL){
-   // We've picked off the front item, so update the head pointer
-   list->head = result->next;
-  }
-  else{
-    // If there isn't anything in the list, this method is pointless
-    printk("Attempted to dequeue from empty list!\n");
-  }
-
-  // If the list is now empty (i.e, the head was also the tail), then we need
-  // to also update the tail to reflect that.
-  if(list->head == NULL){
-    list->tail = NULL;
-  }
-  up(&(list->mutex));
-  return result;
-}
-
-/* Removes the buffer with the corresponding id
- * Will return NULL if not found */
-BufferSet* buffer_dequeueid(BufferList* list, int id)
-{
-  BufferSet* s;
-  BufferSet* prev = NULL;
-  while(down_interruptible(&(list->mutex)) != 0) {}
-
-  // Find the matching BufferSet
-  for(s = list->head; s != NULL; s = s->next){
-    if(s->id == id){
-      // Move the upstream pointer that was pointing to s
-      if(prev != NULL){
-        // There was a previous item; make it point to the next
-        prev->next = s->next;
-      }
-      else{
-        // This was the head, so change the head pointer
-        list->head = s->next;
+  unsigned long flags;
+  int pos, diff;
+
+  local_irq_save(flags);
+  pos = atomic_read(&list->head);
+  while(1){
+    s = &list->slot[pos & (BUFFERLIST_SIZE - 1)];
+    diff = atomic_read_acquire(&s->seq) - (pos + 1);
+    if(diff == 0){
+      if(atomic_cmpxchg(&list->head, pos, pos + 1) == pos){
+        break;
       }
-      // Move the tail pointer if this was the last item
-      // If there was only one item, this will make the tail NULL
-      if(list->tail == s){
-        list->tail = prev;
-      }
-      break; // We've found it, so quit now
+      pos = atomic_read(&list->head);
+    }
+    else if(diff < 0){
+      local_irq_restore(flags);
+      return NULL; // Nothing has been pushed here yet
     }
     else{
-      // This isn't it; move to the next item
-      prev = s;
+      pos = atomic_read(&list->head);
     }
-  } // END iterating through the linked list
+  }
 
-  up(&(list->mutex));
-  return s;
+  result = s->set;
+  // Hand the slot back to the pushers for the next lap
+  atomic_set_release(&s->seq, pos + BUFFERLIST_SIZE);
+  local_irq_restore(flags);
+  return result;
 }
 
+/* Returns the buffer at the head of the list without removing it, or NULL
+ * if there isn't one.  This only makes sense when there's a single consumer,
+ * since otherwise someone else could pop it in the meantime. */
+BufferSet* buffer_peek(BufferList* list)
+{
+  int pos = atomic_read(&list->head);
+  struct bufferlist_slot* s = &list->slot[pos & (BUFFERLIST_SIZE - 1)];
 
+  if(atomic_read_acquire(&s->seq) != pos + 1){
+    return NULL;
+  }
+  return s->set;
+}
 
-/* Checks whether a buffer list is empty, returns true if so. */
+/* Checks whether a buffer list is empty, returns true if so.
+ * This is only a snapshot if others are pushing or popping. */
 bool buffer_listempty(BufferList* list)
 {
-  bool empty;
-  while(down_interruptible(&(list->mutex)) != 0) {}
-  empty = (list->head == NULL);
-  up(&(list->mutex));
-  return empty; 
+  return atomic_read(&list->head) == atomic_read(&list->tail);
 }
 
-bool buffer_hasid(BufferList* list, int id)
+/* How many buffers are in the list.  Like buffer_listempty(), this is only
+ * a snapshot if others are pushing or popping. */
+int buffer_listcount(BufferList* list)
 {
-  bool found = false;
-  BufferSet* s;
-
-  while(down_interruptible(&(list->mutex)) != 0) {}
-  for(s = list->head; s != NULL; s = s->next){
-    if(s->id == id){
-      found = true;
-      break; // Found it; we can quit now
-    }
-  }
-  up(&(list->mutex));
-  return found;
+  return atomic_read(&list->tail) - atomic_read(&list->head);
 }
-
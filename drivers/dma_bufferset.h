@@ -4,47 +4,119 @@
 #ifndef _DMA_BUFFERPAIR_H_
 #define _DMA_BUFFERPAIR_H_
 
-#include <linux/semaphore.h>
+#include <linux/atomic.h>
 #include <linux/device.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/scatterlist.h>
+#include <linux/dma-buf.h>
 
 #include "buffer.h"
+#include "hwacc.h"
+#include "sg_chain.h"
 
 struct chan_buf {
-        unsigned long *sg;          /* memory for SG table */
-        unsigned long sg_phys;     /* physical address of SG table */
+        SGChain chain;             /* SG table, cached between frames */
         Buffer buf;
 
         int chan_id;
+        int ring_slot;             /* where the chain went in the DMA ring */
+
+        /*
+         * Only used for data which doesn't live in the cmabuffer pool
+         * (PROCESS_IMPORT).  sgt holds the DMA-mapped pieces of the image,
+         * starting sg_offset bytes before the first pixel.
+         */
+        struct sg_table *sgt;
+        unsigned long sg_offset;
+        enum dma_data_direction dir;
+        struct dma_buf *dmabuf;
+        struct dma_buf_attachment *attach;
+        struct sg_table user_sgt;  /* backing for sgt for user memory */
+        struct page **pages;       /* pinned user pages */
+        int nr_pages;
 };
 
+/*
+ * Where a BufferSet is in its life.  The free, queued and processing states
+ * also have a BufferList, which keeps them in order; complete sets are only
+ * ever looked up by id, so they're found through the state alone.
+ */
+enum bufferset_state {
+        BUFSET_FREE,
+        BUFSET_QUEUED,      /* waiting for room in the DMA rings */
+        BUFSET_PROCESSING,  /* handed to the DMA engines */
+        BUFSET_COMPLETE,    /* done, waiting for PEND_PROCESSED */
+};
+
+struct tile_job;
+
 typedef struct BufferSet {
   int id;
+  atomic_t state; /* enum bufferset_state */
+  wait_queue_head_t wait; /* PEND_PROCESSED for this id sleeps here */
+  /* a PEND_PROCESSED has claimed this id, so PEND_PROCESSED_ANY leaves it
+   * alone; under the driver's claim_lock */
+  bool pended;
   /* each input/output stream is allocated separately and shuffled around.
    * we have full copies since pointers we're handed may not persist.
    */
   struct chan_buf *chan_buf_list;
 
   unsigned long output_sg_phys; // Physical address of SG table
-  // TODO: what if the tap width is zero?
-  //unsigned char tap_vals[$//{tapwidth}]; // Data that describes the tap state
-  struct BufferSet* next; // Next buffer set in chain, if any
+  /* accelerator register writes made just before launch, for PROCESS_REGS */
+  HwaccRegWrite reg_writes[HWACC_MAX_REG_WRITES];
+  unsigned int nr_reg_writes;
+  /* submitted through the shared rings, so completion goes to the CQ */
+  bool from_ring;
+  unsigned int user_data;
+  /* one tile of a PROCESS_TILED image; recycled as soon as it finishes */
+  struct tile_job *job;
+  /* when the frame reached each stage, for the latency histograms */
+  ktime_t t_submit;
+  ktime_t t_launch;
+  ktime_t t_irq;  // the interrupt (or poll) which found it finished
+  ktime_t t_done;
+  /* the same on the TTC, for READ_TIMER */
+  u64 ttc_kick;
+  u64 ttc_done;
   /* length of chan_buf_list, i.e., number of channels */
   int nr_channels;
+  /* 0, or why the frame never finished (-EIO if a DMA error lost it) */
+  int error;
 } BufferSet;
 
 
+/*
+ * Fixed-size FIFO of BufferSets which any number of threads (or interrupt
+ * handlers) can push and pop without a lock.  Each slot carries a sequence
+ * number saying whether it is ready to be filled or emptied on this lap
+ * around the ring, as in Vyukov's bounded MPMC queue.
+ *
+ * A slot only comes free once the pop that claimed it has finished, so a
+ * pop which stalls partway through holds up pushes a full lap later.  Pushes
+ * and pops run with local interrupts off, which limits that to a couple per
+ * CPU, and the ring has room for that many on top of every BufferSet.
+ */
+#define BUFFERLIST_SIZE 32 // Must be a power of two
+
+struct bufferlist_slot {
+  atomic_t seq;
+  BufferSet* set;
+};
+
 typedef struct BufferList{
-  BufferSet* head;
-  BufferSet* tail;
-  struct semaphore mutex;
+  atomic_t head; // Next position to pop
+  atomic_t tail; // Next position to push
+  struct bufferlist_slot slot[BUFFERLIST_SIZE];
 } BufferList;
 
 
 void buffer_initlist(BufferList *list);
 void buffer_enqueue(BufferList* list, BufferSet* buf);
 BufferSet* buffer_dequeue(BufferList* list);
-BufferSet* buffer_dequeueid(BufferList* list, int id);
+BufferSet* buffer_peek(BufferList* list);
 bool buffer_listempty(BufferList* list);
-bool buffer_hasid(BufferList* list, int id);
+int buffer_listcount(BufferList* list);
 
 #endif
@@ -0,0 +1,126 @@
+/* dma_ring.c
+ * Descriptor ring for continuous AXI DMA streaming; see dma_ring.h.
+ */
+
+#ifdef __KERNEL__
+#include <linux/string.h>
+#include <linux/io.h>
+#else
+#include <string.h>
+unsigned int ioread32(void* addr);
+void iowrite32(unsigned int value, void* addr);
+#endif
+
+#include "dma_ring.h"
+
+static unsigned long slot_phys(const DMARing* ring, unsigned int slot)
+{
+  return(ring->desc_phys + slot * SG_DESC_BYTES);
+}
+
+void dma_ring_init(DMARing* ring, unsigned int* desc, unsigned long desc_phys, unsigned int size)
+{
+  unsigned int i;
+
+  ring->desc = desc;
+  ring->desc_phys = desc_phys;
+  ring->size = size;
+  ring->head = 0;
+  ring->used = 0;
+  ring->running = false;
+  ring->restarts = 0;
+  ring->irq_ctrl = 0x00000002 | DMA_CR_IOC_IRQ | DMA_CR_ERR_IRQ | (1 << DMA_CR_THRESHOLD_SHIFT);
+
+  memset(desc, 0, size * SG_DESC_BYTES);
+  for(i = 0; i < size; i++){
+    desc[i * SG_DESC_SIZE] = slot_phys(ring, (i + 1) % size);
+  }
+}
+
+unsigned int dma_ring_space(const DMARing* ring)
+{
+  return(ring->size - ring->used);
+}
+
+void dma_ring_halt(DMARing* ring, void __iomem* regs)
+{
+  // Just the run bit, so the coalescing settings stay as they were
+  iowrite32(ring->irq_ctrl, regs + DMA_CR);
+  ring->running = false;
+}
+
+void dma_ring_reset(DMARing* ring)
+{
+  unsigned int i;
+
+  ring->head = 0;
+  ring->used = 0;
+  ring->running = false;
+  for(i = 0; i < ring->size; i++){
+    memset(&ring->desc[i * SG_DESC_SIZE + 2], 0, 6 * sizeof(unsigned int));
+  }
+}
+
+int dma_ring_submit(DMARing* ring, void __iomem* regs, const SGChain* chain)
+{
+  unsigned int first = ring->head;
+  unsigned int slot = first;
+  int i;
+
+  if(chain->nr_desc <= 0 || chain->nr_desc > dma_ring_space(ring)){
+    return(DMA_RING_NO_ROOM);
+  }
+  // Stopped on an error.  Whatever was in flight is lost, and restarting
+  // from here would skip it, so leave that to the caller.
+  if(ring->running && (ioread32(regs + DMA_SR) & DMA_SR_HALTED)){
+    return(DMA_RING_STOPPED);
+  }
+
+  // Everything except the next pointer, which belongs to the ring
+  for(i = 0; i < chain->nr_desc; i++){
+    memcpy(&ring->desc[slot * SG_DESC_SIZE + 2], &chain->desc[i * SG_DESC_SIZE + 2],
+           6 * sizeof(unsigned int));
+    slot = (slot + 1) % ring->size;
+  }
+  ring->head = slot;
+  ring->used += chain->nr_desc;
+
+  // CURDESC can only be written while the channel is halted, which it is
+  // before the first frame and after dma_ring_halt().  A running engine that
+  // has caught up with the tail just sits idle until the tail moves.
+  if(!ring->running){
+    iowrite32(slot_phys(ring, first), regs + DMA_CURDESC);
+    iowrite32(ring->irq_ctrl | DMA_CR_RUN, regs + DMA_CR);
+    ring->running = true;
+    ring->restarts++;
+  }
+
+  // iowrite32 orders the descriptor writes above before the engine sees this
+  iowrite32(slot_phys(ring, (slot + ring->size - 1) % ring->size), regs + DMA_TAILDESC);
+  return(first);
+}
+
+void dma_ring_retire(DMARing* ring, unsigned int count)
+{
+  ring->used -= (count < ring->used) ? count : ring->used;
+}
+
+bool dma_ring_complete(const DMARing* ring, unsigned int first, unsigned int count)
+{
+  unsigned int last = (first + count - 1) % ring->size;
+
+  // The engine writes the status word behind our back
+  return((((volatile unsigned int*)ring->desc)[last * SG_DESC_SIZE + 7] & DMA_DESC_CMPLT) != 0);
+}
+
+void dma_ring_set_irq(DMARing* ring, void __iomem* regs, unsigned int threshold, unsigned int delay)
+{
+  threshold = (threshold < 1) ? 1 : (threshold > 255) ? 255 : threshold;
+  delay = (delay > 255) ? 255 : delay;
+
+  ring->irq_ctrl = 0x00000002 | DMA_CR_IOC_IRQ | DMA_CR_ERR_IRQ | (threshold << DMA_CR_THRESHOLD_SHIFT) |
+                   (delay ? DMA_CR_DLY_IRQ | (delay << DMA_CR_DELAY_SHIFT) : 0);
+  if(ring->running){
+    iowrite32(ring->irq_ctrl | DMA_CR_RUN, regs + DMA_CR);
+  }
+}
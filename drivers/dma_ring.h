@@ -0,0 +1,117 @@
+/* dma_ring.h
+ * Circular descriptor ring which keeps an AXI DMA channel running across
+ * frames.
+ *
+ * The ring's next pointers are written once and never change, so the engine
+ * can't pick up a stale link no matter when it fetches a descriptor.  Frames
+ * are copied into the slots after the last one queued, and the engine is
+ * told about them by moving TAILDESC forward.  The channel only gets halted
+ * and pointed at a new CURDESC the first time, or after dma_ring_halt().  If
+ * it stops on an error, the frames it had are lost; the caller fails them,
+ * resets the engine, and starts the ring over with dma_ring_reset().
+ *
+ * Like sg_chain.c, this is shared with the tests in drivers/test, which
+ * supply their own ioread32/iowrite32 to emulate the DMA registers.
+ */
+
+#ifndef _DMA_RING_H_
+#define _DMA_RING_H_
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdbool.h>
+#define __iomem
+#endif
+
+#include "sg_chain.h"
+
+/* AXI DMA channel registers (PG021), relative to the MM2S or S2MM base */
+#define DMA_CR 0x00 // Control
+#define DMA_SR 0x04 // Status
+#define DMA_CURDESC 0x08
+#define DMA_TAILDESC 0x10
+
+#define DMA_CR_RUN 0x00000001
+#define DMA_CR_IOC_IRQ 0x00001000 // Interrupt when the threshold count is reached
+#define DMA_CR_DLY_IRQ 0x00002000 // ...or when the delay timer runs out
+#define DMA_CR_ERR_IRQ 0x00004000 // ...or on an error
+#define DMA_CR_RESET 0x00000004 // Resets both channels of the engine
+#define DMA_CR_THRESHOLD_SHIFT 16
+#define DMA_CR_DELAY_SHIFT 24
+
+#define DMA_SR_HALTED 0x00000001
+#define DMA_SR_IDLE 0x00000002
+#define DMA_SR_IRQS 0x00007000 // Completion, delay and error interrupts; write 1 to clear
+#define DMA_SR_ERR_IRQ 0x00004000
+#define DMA_SR_DONE_IRQS 0x00003000 // Just completion and delay
+// Error bits, which stay set until the engine is reset
+#define DMA_SR_DMA_INT_ERR 0x00000010
+#define DMA_SR_DMA_SLV_ERR 0x00000020
+#define DMA_SR_DMA_DEC_ERR 0x00000040
+#define DMA_SR_SG_INT_ERR 0x00000100
+#define DMA_SR_SG_SLV_ERR 0x00000200
+#define DMA_SR_SG_DEC_ERR 0x00000400
+
+#define DMA_DESC_CMPLT 0x80000000 // Status word: the engine is done with this descriptor
+
+typedef struct DMARing
+{
+  unsigned int* desc; // Ring memory, size descriptors long
+  unsigned long desc_phys;
+  unsigned int size;
+
+  unsigned int head; // Slot where the next frame goes
+  unsigned int used; // Slots holding frames which haven't been retired yet
+  bool running; // Whether the engine has been started on this ring
+  unsigned int restarts; // Times the engine had to be (re)started from CURDESC
+  unsigned int irq_ctrl; // Interrupt bits of the control register
+} DMARing;
+
+/* Links the descriptors into a circle and resets the ring to empty */
+void dma_ring_init(DMARing* ring, unsigned int* desc, unsigned long desc_phys, unsigned int size);
+
+/* Number of free slots */
+unsigned int dma_ring_space(const DMARing* ring);
+
+/* Copies a frame's chain into the ring and hands it to the engine at regs.
+ * Returns the first slot used, DMA_RING_NO_ROOM if there isn't enough room
+ * (or the chain is empty), or DMA_RING_STOPPED if the engine has stopped by
+ * itself since it was started, i.e., on an error.
+ */
+#define DMA_RING_NO_ROOM (-1)
+#define DMA_RING_STOPPED (-2)
+
+int dma_ring_submit(DMARing* ring, void __iomem* regs, const SGChain* chain);
+
+/* Frees the slots for the oldest `count` descriptors, once the engine is
+ * finished with them.  Frames must be retired in the order they were
+ * submitted. */
+void dma_ring_retire(DMARing* ring, unsigned int count);
+
+/* Whether the engine has finished the `count` descriptors starting at slot
+ * `first`, i.e., a frame that dma_ring_submit() put there.
+ */
+bool dma_ring_complete(const DMARing* ring, unsigned int first, unsigned int count);
+
+/* Sets the interrupt coalescing: the engine interrupts once `threshold`
+ * packets have completed (counting descriptors with EOF set, so one per
+ * frame's chain), or when it has been idle for `delay` ticks of its delay
+ * timer with some completed (delay 0 turns the timer off).  Takes effect
+ * immediately if the engine is running.  dma_ring_init() resets it to an
+ * interrupt for every packet.
+ */
+void dma_ring_set_irq(DMARing* ring, void __iomem* regs, unsigned int threshold, unsigned int delay);
+
+/* Asks the engine to stop, keeping the interrupt settings.  It takes a
+ * moment, so poll for DMA_SR_HALTED before submitting again; the next submit
+ * restarts it from CURDESC.  Anything in flight is abandoned.
+ */
+void dma_ring_halt(DMARing* ring, void __iomem* regs);
+
+/* Empties the ring, once the engine has been halted or reset and the frames
+ * that were in it have been dealt with.  The interrupt settings are kept.
+ */
+void dma_ring_reset(DMARing* ring);
+
+#endif
@@ -28,12 +28,31 @@
 #include <linux/pagemap.h>
 #include <linux/of_platform.h>
 #include <linux/of_irq.h>
+#include <linux/scatterlist.h>
+#include <linux/dma-buf.h>
+#include <linux/poll.h>
+#include <linux/vmalloc.h>
+#include <linux/kthread.h>
+#include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/cpumask.h>
+#include <linux/completion.h>
+#include <linux/iopoll.h>
 
 #include "common.h"
 #include "buffer.h"
 #include "dma_bufferset.h"
+#include "hwacc.h"
+#include "sg_chain.h"
+#include "dma_ring.h"
+#include "tiling.h"
+#include "stats.h"
 #include "ioctl_cmds.h"
 
+#define CREATE_TRACE_POINTS
+#include "hwacc_trace.h"
+
 // The Linux kernel keeps track of whether it has been "tainted" with non-GPL
 // kernel modules.  GPL may not be the right thing to put here.
 MODULE_LICENSE("GPL");
@@ -48,11 +67,18 @@ MODULE_LICENSE("GPL");
 
 #define N_DMA_BUFFERSETS 16 // Number of "buffer set" objects for passing through the queues
 
-#define SG_DESC_SIZE 16 // Size of each SG descriptor, in 32-byte words
-#define SG_DESC_BYTES (SG_DESC_SIZE * 4)  // Size of each descriptor in bytes
-
 #define DMA_MAX_CHANS_PER_DEVICE	0x20
 
+/*
+ * The triple-timer clock (TTC1) which the R5 sets up as the system-wide
+ * timebase; see f4runtime/r5/ttc_clock.c.  Counter 1 is coarse (100MHz /
+ * 2^16) and counter 2 fine (100MHz), both 32 bits.  Linux only reads them.
+ */
+#define TTC_REG_BASE 0xFF110000
+#define TTC_REG_SIZE 0x20
+#define TTC_COUNT1 0x18
+#define TTC_COUNT2 0x1c
+
 /* these values are copied from the official implementation */
 #define XILINX_DMA_MM2S_CTRL_OFFSET 0x0000
 #define XILINX_DMA_S2MM_CTRL_OFFSET 0x0030
@@ -66,18 +92,32 @@ MODULE_LICENSE("GPL");
 // a little over 64kb. The output might be stripped, so we should do the same.
 // So page order has to be over 64kb/4kb = 16, -> page order 5.
 #define SG_PAGEORDER 5
-
-// Forward declarations of the work functions
-void dma_launch_work(struct work_struct*);
-void dma_finished_work(struct work_struct*);
+#define SG_MAX_DESC ((PAGE_SIZE << SG_PAGEORDER) / SG_DESC_BYTES)
+
+// Each channel streams frames through a descriptor ring, which has to hold at
+// least one full-size chain plus whatever is still in flight ahead of it.
+#define RING_PAGEORDER (SG_PAGEORDER + 1)
+#define RING_SLOTS ((PAGE_SIZE << RING_PAGEORDER) / SG_DESC_BYTES)
+
+// How long a channel gets to stop or reset before we give up on it
+#define DMA_HALT_TIMEOUT_US 1000
+
+struct hwacc_drvdata;
+static void ring_post_cqe(struct hwacc_drvdata *drvdata, int result,
+                          unsigned int user_data);
+static void ring_teardown(struct hwacc_drvdata *drvdata);
+static int start_launch_thread(struct hwacc_drvdata *drvdata);
+static void recover_dma(struct hwacc_drvdata *drvdata);
+static bool drain_frames(struct hwacc_drvdata *drvdata, bool polled,
+                         ktime_t seen);
+static void fail_set(struct hwacc_drvdata *drvdata, BufferSet* buf, int err);
+static void apply_irq_coalescing(struct hwacc_drvdata *drvdata);
 
 struct class *pipe_class;
 int device_usage[MAX_HWACC_MODULE]; /* controls the char dev creation */
 
-static int debug_level = 4;
-module_param(debug_level, int, 0644);
-MODULE_PARM_DESC(debug_level,
-                 "0 is errors only, increasing numbers print more stuff");
+/* errors and warnings only; TRACE prints several lines for every frame */
+DEFINE_DEBUG_LEVEL(1);
 
 // If the DMAs are configured in the multichannel mode,
 // // use this flag to enable 2D transfer mode
@@ -92,6 +132,124 @@ module_param(use_acp, bool, 0644);
 MODULE_PARM_DESC(use_acp,
                  "enforce cache coherency, if the device uses ACP");
 
+// How long the shared-ring polling thread spins on an empty ring before it
+// goes to sleep and asks for a RING_ENTER wakeup
+static unsigned int ring_idle_ms = 10;
+module_param(ring_idle_ms, uint, 0644);
+MODULE_PARM_DESC(ring_idle_ms,
+                 "milliseconds the SQ polling thread spins before sleeping");
+
+// Launching and completing frames happens in SCHED_FIFO threads (the launch
+// thread, and the output channel's threaded IRQ), optionally on one CPU
+static int rt_priority = 50;
+module_param(rt_priority, int, 0644);
+MODULE_PARM_DESC(rt_priority,
+                 "SCHED_FIFO priority of the launch thread, 0 for normal");
+
+static int rt_cpu = -1;
+module_param(rt_cpu, int, 0444);
+MODULE_PARM_DESC(rt_cpu,
+                 "CPU for the launch thread and completion IRQ, -1 for any");
+
+/*
+ * Per-CPU statistics (see stats.h), in /sys/kernel/debug/hwacc/hwacc<n>.
+ * The latency histograms cover each state a BufferSet waits in: lat_queue
+ * is QUEUED, lat_hw and lat_irq together are PROCESSING, and lat_wake is
+ * COMPLETE.
+ */
+struct hwacc_stats {
+        u64 frames_submitted;
+        u64 frames_completed;
+        u64 submit_errors;         /* PROCESS_IMAGE failed after taking a set */
+        u64 frames_failed;         /* lost to a DMA error, or to close */
+        u64 free_waits;            /* PROCESS_IMAGE had to sleep for a free set */
+        u64 reg_frames;            /* frames with PROCESS_REGS writes */
+        u64 start_waits;           /* launches waiting for the HLS core */
+        u64 bytes_in;              /* read by the input channels */
+        u64 bytes_out;             /* written by the output channels */
+        u64 irq_in;
+        u64 irq_out;
+        u64 irq_unclaimed;         /* output IRQs a poller got to first */
+        u64 completions_irq;       /* frames completed by the IRQ thread */
+        u64 completions_polled;    /* ...and by a polling PEND_PROCESSED */
+        u64 pend_wakeups;          /* PEND_PROCESSED sleepers woken */
+        u64 pend_spurious_wakeups; /* ...whose frame wasn't done yet */
+        u64 dma_err_irq;           /* error interrupts, any channel */
+        u64 dma_err_internal;      /* ...by the error bits they had set */
+        u64 dma_err_slave;
+        u64 dma_err_decode;
+        u64 sg_err_internal;
+        u64 sg_err_slave;
+        u64 sg_err_decode;
+        struct stat_hist lat_queue; /* submitted -> on the hardware */
+        struct stat_hist lat_hw;    /* on the hardware -> interrupt */
+        struct stat_hist lat_irq;   /* interrupt -> frame completed */
+        struct stat_hist lat_wake;  /* completed -> PEND_PROCESSED returns */
+};
+
+static const struct stat_field hwacc_stat_fields[] = {
+        STAT_COUNTER(struct hwacc_stats, frames_submitted),
+        STAT_COUNTER(struct hwacc_stats, frames_completed),
+        STAT_COUNTER(struct hwacc_stats, submit_errors),
+        STAT_COUNTER(struct hwacc_stats, frames_failed),
+        STAT_COUNTER(struct hwacc_stats, free_waits),
+        STAT_COUNTER(struct hwacc_stats, reg_frames),
+        STAT_COUNTER(struct hwacc_stats, start_waits),
+        STAT_COUNTER(struct hwacc_stats, bytes_in),
+        STAT_COUNTER(struct hwacc_stats, bytes_out),
+        STAT_COUNTER(struct hwacc_stats, irq_in),
+        STAT_COUNTER(struct hwacc_stats, irq_out),
+        STAT_COUNTER(struct hwacc_stats, irq_unclaimed),
+        STAT_COUNTER(struct hwacc_stats, completions_irq),
+        STAT_COUNTER(struct hwacc_stats, completions_polled),
+        STAT_COUNTER(struct hwacc_stats, pend_wakeups),
+        STAT_COUNTER(struct hwacc_stats, pend_spurious_wakeups),
+        STAT_COUNTER(struct hwacc_stats, dma_err_irq),
+        STAT_COUNTER(struct hwacc_stats, dma_err_internal),
+        STAT_COUNTER(struct hwacc_stats, dma_err_slave),
+        STAT_COUNTER(struct hwacc_stats, dma_err_decode),
+        STAT_COUNTER(struct hwacc_stats, sg_err_internal),
+        STAT_COUNTER(struct hwacc_stats, sg_err_slave),
+        STAT_COUNTER(struct hwacc_stats, sg_err_decode),
+        STAT_HIST(struct hwacc_stats, lat_queue),
+        STAT_HIST(struct hwacc_stats, lat_hw),
+        STAT_HIST(struct hwacc_stats, lat_irq),
+        STAT_HIST(struct hwacc_stats, lat_wake),
+};
+
+/* Where the debugfs directories go; NULL without debugfs */
+static struct dentry *hwacc_debugfs_root;
+
+/* TTC registers, NULL if they couldn't be mapped */
+static void __iomem *ttc_regs;
+
+/* An image going through PROCESS_TILED.  Every tile in flight counts in
+ * remaining, plus one for the submitter while it's still submitting.  The
+ * job is freed once both the waiter and the last tile have let go of it, so
+ * a waiter that's killed can leave the tiles to finish by themselves.
+ */
+struct tile_job {
+        atomic_t remaining;
+        atomic_t refs;          /* the waiter, and the tiles as a whole */
+        struct completion done;
+        int error;              /* set if any tile was lost */
+};
+
+static void tile_job_put(struct tile_job *job)
+{
+        if (atomic_dec_and_test(&job->refs))
+                kfree(job);
+}
+
+/* Drops one count from remaining; the last one wakes the waiter */
+static void tile_job_finish(struct tile_job *job)
+{
+        if (atomic_dec_and_test(&job->remaining)) {
+                complete(&job->done);
+                tile_job_put(job);
+        }
+}
+
 struct dma_chan {
         struct hwacc_drvdata *drvdata;
         struct device *dev;
@@ -102,6 +260,19 @@ struct dma_chan {
         int id;
         bool input_chan;
         wait_queue_head_t wq;
+
+        /* descriptor ring which keeps the engine running between frames */
+        DMARing ring;
+        spinlock_t ring_lock;
+
+        /* the IRQ handler and polling PEND_PROCESSED both claim interrupts */
+        spinlock_t irq_lock;
+        ktime_t irq_time;       /* when the IRQ thread's last one was claimed */
+
+        /* stream geometry from the device tree, all 0 if it wasn't given */
+        u32 width;
+        u32 height;
+        u32 depth;
 };
 
 struct hwacc_drvdata {
@@ -118,10 +289,28 @@ struct hwacc_drvdata {
         /* only allow one process accessing hwacc at a time */
         atomic_t usage_count;
 
-        /* work queue */
-        struct work_struct launch_work;
-        struct work_struct finished_work;
-        atomic_t finished_count; /* won't be used for inputs */
+        /* the accelerator's own registers, from the device tree */
+        HwaccTap taps[HWACC_MAX_TAPS];
+        unsigned int nr_taps;
+
+        /* queued frames are put on the hardware by this thread */
+        struct task_struct *launch_thread;
+        wait_queue_head_t launch_wait;
+        /* woken as frames complete, which is when the core starts another */
+        wait_queue_head_t hls_wait;
+        /* set on a DMA error; the launch thread fails what was in flight */
+        atomic_t dma_error;
+
+        /* PEND_PROCESSED spins this long before sleeping; set per open */
+        unsigned int poll_budget_us;
+
+        /* interrupt coalescing for all the DMA channels, set in sysfs */
+        struct mutex coalesce_mutex; /* both of these, checked together */
+        unsigned int irq_threshold;  /* packets (frames) per interrupt */
+        unsigned int irq_delay;      /* delay timer ticks, 0 for none */
+
+        /* only one reaper takes frames off the processing list at a time */
+        struct mutex reap_mutex;
 
         /*
          * Wait queues to pend on the various DMA operations.
@@ -131,8 +320,10 @@ struct hwacc_drvdata {
         /* Writes waiting for a free buffer */
         wait_queue_head_t buffer_free_queue;
         /*
-         * A BufferSet is attached to one of the following lists, which
-         * determines its state All of the lists maintain order (i.e, FIFO).
+         * Every BufferSet has a state (enum bufferset_state), and except when
+         * complete it sits in the matching list below.  The lists are
+         * lock-free FIFOs, so the interrupt handler can move sets between
+         * them directly.
          * FREE - Input buffer is ready to be filled with data
          */
         BufferList free_list;
@@ -140,19 +331,36 @@ struct hwacc_drvdata {
          * QUEUED - Has data (flushed to RAM) and is ready to be streamed
          */
         BufferList queued_list;
-        /*  PROCESSING - Input DMA has started, and output DMA has not yet
-         *  finished. This implies that some part of the buffer's contents
-         *  are in the stencil path. If more than one buffer is in this state,
-         *  something is probably very wrong.
+        /*  PROCESSING - The frame's chains are on the DMA rings, and its
+         *  output DMA has not yet finished.  Several frames are normally in
+         *  flight at once; they sit here in the order they were submitted,
+         *  which is also the order the engines finish them in.
          */
         BufferList processing_list;
         /*
          * COMPLETE - DMA has finished, and output data is ready to be handed
-         * back to the user
+         * back to the user.  These are looked up by id in buffer_pool, so
+         * there's only a count.
          */
-        BufferList complete_list;
+        atomic_t nr_complete;
+        unsigned int reap_next;    /* where PEND_PROCESSED_ANY looks first */
+        spinlock_t claim_lock;     /* BufferSet.pended, and taking sets off it */
         BufferSet buffer_pool[N_DMA_BUFFERSETS];
 
+        /* statistics, in debugfs; some are under stats/ in sysfs too */
+        struct hwacc_stats __percpu *stats;
+        struct stats_debugfs stats_debugfs;
+        struct dentry *debugfs;
+        u32 last_dma_error;          /* status register at the last error */
+
+        /* shared submission/completion rings, NULL until RING_SETUP */
+        HwaccRings *rings;
+        struct mutex ring_mutex;     /* one consumer of the SQ at a time */
+        spinlock_t cq_lock;          /* posting to the CQ */
+        atomic_t ring_inflight;      /* taken off the SQ, not yet in the CQ */
+        struct task_struct *ring_thread;
+        wait_queue_head_t ring_wait; /* polling thread sleeps here */
+
         /* char dev */
         struct device *pipe_dev;
         dev_t device_num;
@@ -193,9 +401,71 @@ int check_dma_engine(unsigned char* dma_controller)
   return(0);
 }
 
+/* Empties all the lists and puts every buffer set on the free list.  Only
+ * safe while the DMA engines are stopped.
+ */
+static void reset_buffer_list(struct hwacc_drvdata *drvdata)
+{
+        int i;
+
+        /* every set has to fit in one list, with room for pops in progress */
+        BUILD_BUG_ON(2 * N_DMA_BUFFERSETS > BUFFERLIST_SIZE);
+
+        buffer_initlist(&drvdata->free_list);
+        buffer_initlist(&drvdata->queued_list);
+        buffer_initlist(&drvdata->processing_list);
+        atomic_set(&drvdata->nr_complete, 0);
+        drvdata->reap_next = 0;
+
+        for (i = 0; i < N_DMA_BUFFERSETS; i++) {
+                DEBUG("enqueing buffer set %d\n", i);
+                atomic_set(&drvdata->buffer_pool[i].state, BUFSET_FREE);
+                drvdata->buffer_pool[i].pended = false;
+                buffer_enqueue(&drvdata->free_list, &drvdata->buffer_pool[i]);
+        }
+}
+
+/* Stops every channel and resets the engine, which clears any error it
+ * stopped on.  Whatever was in flight is abandoned.  This polls the status
+ * registers with the ring locks dropped, so it needs process context.
+ */
+static void halt_engines(struct hwacc_drvdata *drvdata)
+{
+        int i;
+        u32 reg;
+        unsigned long flags;
+        struct dma_chan *chan;
+
+        for (i = 0; i < drvdata->nr_channels; i++) {
+                chan = drvdata->chan[i];
+                spin_lock_irqsave(&chan->ring_lock, flags);
+                dma_ring_halt(&chan->ring, chan->controller);
+                spin_unlock_irqrestore(&chan->ring_lock, flags);
+        }
+        for (i = 0; i < drvdata->nr_channels; i++) {
+                chan = drvdata->chan[i];
+                if (readl_poll_timeout(chan->controller + DMA_SR, reg,
+                                       reg & DMA_SR_HALTED, 10,
+                                       DMA_HALT_TIMEOUT_US))
+                        ERROR("DMA channel %d didn't halt\n", chan->id);
+        }
+        /* a reset hits both directions, so only once everything has stopped */
+        for (i = 0; i < drvdata->nr_channels; i++) {
+                chan = drvdata->chan[i];
+                iowrite32(DMA_CR_RESET, chan->controller + DMA_CR);
+                if (readl_poll_timeout(chan->controller + DMA_CR, reg,
+                                       !(reg & DMA_CR_RESET), 10,
+                                       DMA_HALT_TIMEOUT_US))
+                        ERROR("DMA channel %d didn't reset\n", chan->id);
+                /* the reset clears SG_CTL too; see check_dma_engine() */
+                iowrite32(0x00000f0f, chan->controller + 0x2c);
+        }
+}
+
 static int dev_open(struct inode *inode, struct file *file)
 {
-        int i, j;
+        int i, j, retval;
+        unsigned int *sg;
         struct dma_chan *chan;
         struct hwacc_drvdata *drvdata = container_of(inode->i_cdev,
                                                      struct hwacc_drvdata,
@@ -204,33 +474,64 @@ static int dev_open(struct inode *inode, struct file *file)
         BufferSet *buffer_pool = drvdata->buffer_pool;
         file->private_data = drvdata;
 
+        /*
+         * make sure the device is not busy before touching anything, since
+         * the rings and SG tables of a running session are live
+         */
+        if (atomic_cmpxchg(&drvdata->usage_count, 0, 1) != 0)
+                return -EBUSY;
+
         /* allocate pages */
         for (i = 0; i < N_DMA_BUFFERSETS; i++) {
                 for (j = 0; j < drvdata->nr_channels; j++) {
                         chan = drvdata->chan[j];
-                        buffer_pool[i].chan_buf_list[j].sg = (unsigned long*) \
+                        sg = (unsigned int*) \
                                   __get_free_pages(GFP_KERNEL, SG_PAGEORDER);
-                        if (!buffer_pool[i].chan_buf_list[j].sg) {
+                        if (!sg) {
                                 ERROR("failed to allocate memory for SG table"
                                       "chan %d\n", chan->id);
+                                atomic_set(&drvdata->usage_count, 0);
                                 return -ENOMEM;
                         }
+                        sg_chain_init(&buffer_pool[i].chan_buf_list[j].chain,
+                                      sg, virt_to_phys(sg), SG_MAX_DESC);
                         // TODO: add fail case
                 }
         }
 
+        for (j = 0; j < drvdata->nr_channels; j++) {
+                chan = drvdata->chan[j];
+                sg = (unsigned int*)__get_free_pages(GFP_KERNEL, RING_PAGEORDER);
+                if (!sg) {
+                        ERROR("failed to allocate descriptor ring for "
+                              "chan %d\n", chan->id);
+                        atomic_set(&drvdata->usage_count, 0);
+                        return -ENOMEM;
+                }
+                dma_ring_init(&chan->ring, sg, virt_to_phys(sg), RING_SLOTS);
+        }
+        mutex_lock(&drvdata->coalesce_mutex);
+        apply_irq_coalescing(drvdata);
+        mutex_unlock(&drvdata->coalesce_mutex);
+        atomic_set(&drvdata->dma_error, 0);
 
-        /* make sure the device is not busy */
-        if (atomic_read(&drvdata->usage_count))
-                return -EBUSY;
-        atomic_set(&drvdata->finished_count, 0); // No buffers finished yet
-        atomic_set(&drvdata->usage_count, 1);
+        /* whatever the last user left behind, every set starts out free */
+        reset_buffer_list(drvdata);
+        drvdata->poll_budget_us = 0;
+
+        retval = start_launch_thread(drvdata);
+        if (retval < 0) {
+                atomic_set(&drvdata->usage_count, 0);
+                return retval;
+        }
   return(0);
 }
 
 static int dev_close(struct inode *inode, struct file *file)
 {
         int i, j;
+        BufferSet *buf;
+        struct dma_chan *chan;
         struct hwacc_drvdata *drvdata = file->private_data;
 
         /* make sure the queue is empty */
@@ -240,18 +541,40 @@ static int dev_close(struct inode *inode, struct file *file)
                 "closing device before clearing out wait queue!\n");
         }
 
-        /* free all the pages */
+        /* no more submissions from the shared rings, or anywhere else */
+        ring_teardown(drvdata);
+        kthread_stop(drvdata->launch_thread);
+        drvdata->launch_thread = NULL;
+
+        /* stop the engines and the HLS core */
+        halt_engines(drvdata);
+        iowrite32(0x00000000, drvdata->hls_controller + 0);
+
+        /* let any interrupt handler still looking at the rings finish */
+        for (j = 0; j < drvdata->nr_channels; j++)
+                synchronize_irq(drvdata->chan[j]->irq);
+
         /*
-         * TODO: Wait until the DMA engine is done,
-         * so we don't write to memory after freeing it
+         * complete whatever did finish, and fail the rest, so that the
+         * buffers they imported are released
          */
+        drain_frames(drvdata, false, ktime_get());
+        mutex_lock(&drvdata->reap_mutex);
+        while ((buf = buffer_dequeue(&drvdata->processing_list)) != NULL)
+                fail_set(drvdata, buf, -EIO);
+        while ((buf = buffer_dequeue(&drvdata->queued_list)) != NULL)
+                fail_set(drvdata, buf, -ECANCELED);
+        mutex_unlock(&drvdata->reap_mutex);
+
+        /* nothing can touch the descriptors now, so free all the pages */
+        for (j = 0; j < drvdata->nr_channels; j++) {
+                chan = drvdata->chan[j];
+                free_pages((unsigned long)chan->ring.desc, RING_PAGEORDER);
+        }
         for (i = 0; i < N_DMA_BUFFERSETS; i++) {
-                /* becase no consumers are deleting nodes,
-                 * we are safe to traverse without deleting the nodes
-                */
                 for (j = 0; j < drvdata->buffer_pool[i].nr_channels; j++) {
                         free_pages((unsigned long) drvdata->buffer_pool[i]
-                                   .chan_buf_list[j].sg,
+                                   .chan_buf_list[j].chain.desc,
                                    SG_PAGEORDER);
                 }
         }
@@ -265,16 +588,9 @@ static int setup_buffer_list(struct hwacc_drvdata *drvdata)
         int i;
         BufferSet *buffer_pool = drvdata->buffer_pool;
 
-        /* set up the image buffer set */
-        buffer_initlist(&drvdata->free_list);
-        buffer_initlist(&drvdata->queued_list);
-        buffer_initlist(&drvdata->processing_list);
-        buffer_initlist(&drvdata->complete_list);
-
         /**
-         * Allocate memory for the scatter-gather tables in the buffer set and
-         * put them on the free list.
-         * The actual data will be attached when needed.
+         * Allocate the per-channel state for each buffer set.  The SG tables
+         * are allocated on open, and the actual data is attached when needed.
          */
         for (i = 0; i < N_DMA_BUFFERSETS; i++) {
                 buffer_pool[i].id = i;
@@ -284,301 +600,1589 @@ static int setup_buffer_list(struct hwacc_drvdata *drvdata)
                         devm_kzalloc(&drvdata->pdev->dev,
                         sizeof (struct chan_buf) * drvdata->nr_channels,
                         GFP_KERNEL);
-
-                DEBUG("enqueing buffer set %d\n", i);
-                buffer_enqueue(&drvdata->free_list, buffer_pool + i);
+                if (!buffer_pool[i].chan_buf_list)
+                        return -ENOMEM;
+                init_waitqueue_head(&buffer_pool[i].wait);
         }
+        reset_buffer_list(drvdata);
         return 0;
 }
 
-/* Builds a scatter-gather descriptor chain for a buffer.
- * SG is particularly useful for automatically handling strided images, such as
- * blocks of a larger image.
- * Each image row is a new sg slice, and starts on a new memory location,
- * which may not be adjacent to the last one.
+/* Value for the AxCACHE/AxUSER word of 2D descriptors */
+static unsigned int sg_axcache(void)
+{
+  if (use_acp) {
+    // AxCACHE: 0011 defines memory type as 'normal non-cacheable bufferable'
+    // AxCACHE: 1111 defines memory type as 'write-back read and write-allocate'
+    // AxUSER: tie off high to enable coherency when allowed by AxCACHE
+    return(0xff000000); // values for AxCACHE (1111) and AxUSER (1111)
+  } else {
+    // for some reason, AxCACHE (1111) with dma_map/unmap doesn't
+    // work correctly on Linux 4.0 kernel, so we use 0011 for AxCACHE field
+    return(0x03000000); // values for AxCACHE (0011) and AxUSER (0000)
+  }
+}
+
+/* Builds a descriptor chain for an imported buffer, whose memory may be
+ * scattered all over the place.  Each row gets one descriptor per contiguous
+ * piece of memory it touches, so a row which straddles a page boundary in
+ * user memory takes two or more.  In 2D mode these are just 1-line blocks.
+ * Returns the number of descriptors, or a negative error code.
+ */
+int build_sg_chain_sgt(SGChain *chain, const Buffer buf, struct sg_table *sgt,
+                       unsigned long offset)
+{
+  struct scatterlist *seg = sgt->sgl;
+  int segs_left = sgt->nents;
+  unsigned long seg_start = 0; // Offset of seg from the start of the memory
+  unsigned long pos, chunk, remaining, row_bytes = buf.width * buf.depth;
+  dma_addr_t addr;
+  unsigned int* sg_ptr = chain->desc;
+  int row, n = 0;
+
+  // This overwrites whatever chain was cached here
+  sg_chain_invalidate(chain);
+
+  for(row = 0; row < buf.height; row++){
+    pos = offset + (unsigned long)row * buf.stride * buf.depth;
+    remaining = row_bytes;
+    while(remaining > 0){
+      // Rows only move forward, so pick up where the last piece left off
+      while(seg != NULL && pos >= seg_start + sg_dma_len(seg)){
+        seg_start += sg_dma_len(seg);
+        seg = (--segs_left > 0) ? sg_next(seg) : NULL;
+      }
+      if(seg == NULL){
+        ERROR("build_sg_chain_sgt: image runs off the end of the buffer\n");
+        return(-EINVAL);
+      }
+      if(n >= chain->max_desc){
+        ERROR("build_sg_chain_sgt: image is too fragmented for the SG table\n");
+        return(-E2BIG);
+      }
+
+      chunk = min(remaining, seg_start + sg_dma_len(seg) - pos);
+      addr = sg_dma_address(seg) + (pos - seg_start);
+
+      sg_ptr[0] = chain->desc_phys + (n + 1) * SG_DESC_BYTES; // Pointer to next descriptor
+      sg_ptr[1] = 0;
+      sg_ptr[2] = lower_32_bits(addr);
+      sg_ptr[3] = upper_32_bits(addr);
+      if(use_2D_mode){
+        sg_ptr[4] = sg_axcache();
+        sg_ptr[5] = chunk | (1 << 19); // One line, so the stride doesn't matter
+      }
+      sg_ptr[6] = chunk;
+      if(row == 0 && remaining == row_bytes){
+        sg_ptr[6] |= SG_SOF;
+      }
+      if(row == buf.height-1 && chunk == remaining){
+        sg_ptr[6] |= SG_EOF;
+      }
+      sg_ptr[7] = 0;
+
+      sg_ptr += SG_DESC_SIZE;
+      pos += chunk;
+      remaining -= chunk;
+      n++;
+    }
+  }
+
+  chain->nr_desc = n;
+  TRACE("build_sg_chain_sgt: %d descriptors for %d rows\n", n, buf.height);
+  return(n);
+}
+
+/* Undoes import_chan_buf(): unmaps the memory and drops the references to the
+ * dma-buf or user pages.  Safe to call on a partially imported chan_buf.
+ */
+static void release_chan_buf(struct hwacc_drvdata *drvdata,
+                             struct chan_buf *chan_buf)
+{
+  int i;
+
+  if(chan_buf->dmabuf){
+    if(chan_buf->sgt){
+      dma_buf_unmap_attachment(chan_buf->attach, chan_buf->sgt, chan_buf->dir);
+    }
+    if(chan_buf->attach){
+      dma_buf_detach(chan_buf->dmabuf, chan_buf->attach);
+    }
+    dma_buf_put(chan_buf->dmabuf);
+  }
+
+  if(chan_buf->pages){
+    if(chan_buf->sgt){
+      dma_unmap_sg(&drvdata->pdev->dev, chan_buf->user_sgt.sgl,
+                   chan_buf->user_sgt.orig_nents, chan_buf->dir);
+      sg_free_table(&chan_buf->user_sgt);
+    }
+    for(i = 0; i < chan_buf->nr_pages; i++){
+      if(chan_buf->dir == DMA_FROM_DEVICE){
+        set_page_dirty_lock(chan_buf->pages[i]);
+      }
+      put_page(chan_buf->pages[i]);
+    }
+    kfree(chan_buf->pages);
+  }
+
+  chan_buf->sgt = NULL;
+  chan_buf->dmabuf = NULL;
+  chan_buf->attach = NULL;
+  chan_buf->pages = NULL;
+  chan_buf->nr_pages = 0;
+}
+
+/* Makes the memory behind an ImportBuffer reachable by the DMA engine: either
+ * attaches to the dma-buf, or pins the user pages and maps them.  Buffers
+ * from the cmabuffer pool don't need anything.
+ */
+static int import_chan_buf(struct hwacc_drvdata *drvdata,
+                           struct chan_buf *chan_buf,
+                           const ImportBuffer *imp, bool input)
+{
+  struct device *dev = &drvdata->pdev->dev; // pipe_dev has no DMA configuration
+  const Buffer *buf = &imp->buf;
+  unsigned long len, first;
+  int pinned, nents, retval;
+
+  chan_buf->buf = imp->buf;
+  chan_buf->sgt = NULL;
+  chan_buf->sg_offset = 0;
+  chan_buf->dir = input ? DMA_TO_DEVICE : DMA_FROM_DEVICE;
+
+  if(imp->type == IMPORT_CMA){
+    return(0);
+  }
+
+  if(buf->width == 0 || buf->height == 0 || buf->depth == 0 ||
+     buf->stride < buf->width){
+    return(-EINVAL);
+  }
+  // Bytes from the first pixel to the last
+  len = ((unsigned long)(buf->height - 1) * buf->stride + buf->width) * buf->depth;
+
+  if(imp->type == IMPORT_DMABUF){
+    chan_buf->dmabuf = dma_buf_get(imp->fd);
+    if(IS_ERR(chan_buf->dmabuf)){
+      retval = PTR_ERR(chan_buf->dmabuf);
+      chan_buf->dmabuf = NULL;
+      return(retval);
+    }
+    if(imp->offset + len > chan_buf->dmabuf->size){
+      ERROR("import: image doesn't fit in the %zu-byte dma-buf\n", chan_buf->dmabuf->size);
+      retval = -EINVAL;
+      goto failed;
+    }
+
+    chan_buf->attach = dma_buf_attach(chan_buf->dmabuf, dev);
+    if(IS_ERR(chan_buf->attach)){
+      retval = PTR_ERR(chan_buf->attach);
+      chan_buf->attach = NULL;
+      goto failed;
+    }
+    chan_buf->sgt = dma_buf_map_attachment(chan_buf->attach, chan_buf->dir);
+    if(IS_ERR(chan_buf->sgt)){
+      retval = PTR_ERR(chan_buf->sgt);
+      chan_buf->sgt = NULL;
+      goto failed;
+    }
+    chan_buf->sg_offset = imp->offset;
+  }
+  else if(imp->type == IMPORT_USERPTR){
+    first = imp->user_addr & PAGE_MASK;
+    chan_buf->nr_pages = (PAGE_ALIGN(imp->user_addr + len) - first) >> PAGE_SHIFT;
+    chan_buf->pages = kmalloc_array(chan_buf->nr_pages, sizeof(struct page*),
+                                    GFP_KERNEL);
+    if(chan_buf->pages == NULL){
+      chan_buf->nr_pages = 0;
+      return(-ENOMEM);
+    }
+
+    // The accelerator writes into output buffers, so those must be writable
+    pinned = get_user_pages_fast(first, chan_buf->nr_pages, !input, chan_buf->pages);
+    if(pinned < chan_buf->nr_pages){
+      chan_buf->nr_pages = pinned > 0 ? pinned : 0;
+      retval = -EFAULT;
+      goto failed;
+    }
+
+    retval = sg_alloc_table_from_pages(&chan_buf->user_sgt, chan_buf->pages,
+                                       chan_buf->nr_pages,
+                                       offset_in_page(imp->user_addr), len,
+                                       GFP_KERNEL);
+    if(retval){
+      goto failed;
+    }
+    nents = dma_map_sg(dev, chan_buf->user_sgt.sgl,
+                       chan_buf->user_sgt.orig_nents, chan_buf->dir);
+    if(nents == 0){
+      sg_free_table(&chan_buf->user_sgt);
+      retval = -ENOMEM;
+      goto failed;
+    }
+    chan_buf->user_sgt.nents = nents;
+    chan_buf->sgt = &chan_buf->user_sgt;
+  }
+  else{
+    return(-EINVAL);
+  }
+
+  TRACE("import: type %d, %d pieces\n", imp->type, chan_buf->sgt->nents);
+  return(0);
+
+failed:
+  release_chan_buf(drvdata, chan_buf);
+  return(retval);
+}
+
+/* Sets up a buffer for processing through the stencil path.  This drops the
+ * image buffers into a BufferSet object, builds the scatter-gather tables,
+ * and flushes the cache. Then it drops the BufferSet into the
+ * queue to be pushed to the stencil path DMA engine as soon as it's free.
+ * Buffers which aren't from the cmabuffer pool (dma-bufs and user memory)
+ * are imported here and released when the processing finishes.
+ * Frames from the shared submission ring pass their sqe, so the completion
+ * goes to the completion ring instead of the complete list, tiles of a
+ * PROCESS_TILED image pass their job, and PROCESS_REGS frames pass the
+ * register writes to make when they're launched.
+ * Ring frames get -EAGAIN instead of waiting when no BufferSet is free.
+ */
+int process_image(struct hwacc_drvdata *drvdata, ImportBuffer *imp_list,
+                  const HwaccSqe *sqe, struct tile_job *job,
+                  const HwaccFrameRegs *regs)
+{
+  BufferSet* src;
+  int i, flag, nr_desc = 0;
+  Buffer *buf;
+  struct dma_chan *chan;
+  struct chan_buf *chan_buf;
+  int retval;
+
+  for (i = 0; i < drvdata->nr_channels; i++) {
+    chan = drvdata->chan[i];
+    buf = &imp_list[i].buf;
+    if (chan->width && (buf->width != chan->width ||
+                        buf->height != chan->height || buf->depth != chan->depth)) {
+      ERROR("Buffer size %ux%ux%u for channel %d doesn't match hardware (%ux%ux%u)!\n",
+            buf->width, buf->height, buf->depth, i,
+            chan->width, chan->height, chan->depth);
+    }
+  }
+
+  TRACE("process_image: begin\n");
+  // Acquire a bufferset to pass through the processing chain.  Ring frames
+  // are consumed under ring_mutex, so they don't wait for one.
+  src = buffer_dequeue(&drvdata->free_list);
+  if (!src) {
+    if (sqe) {
+      return(-EAGAIN);
+    }
+    stat_inc(drvdata->stats, free_waits);
+    if (wait_event_interruptible(drvdata->buffer_free_queue,
+                                 (src = buffer_dequeue(&drvdata->free_list)))) {
+      return(-ERESTARTSYS);
+    }
+  }
+  trace_hwacc_set_dequeue(src->id);
+  TRACE("src id is %d\n", src->id);
+  TRACE("process_image: got BufferSet\n");
+  /* copy buffer address, and pin/attach anything imported */
+  for (i = 0; i < drvdata->nr_channels; i++) {
+    retval = import_chan_buf(drvdata, &src->chan_buf_list[i], &imp_list[i],
+                             drvdata->chan[i]->input_chan);
+    if (retval < 0) {
+      ERROR("process_image: failed to import buffer for channel %d\n", i);
+      goto failed;
+    }
+  }
+
+  // Set up the scatter-gather descriptor chains.  When the set was last used
+  // for the same size of image, this just patches in the new addresses.
+  for (i = 0; i < drvdata->nr_channels; i++) {
+    chan_buf = &src->chan_buf_list[i];
+    if (chan_buf->sgt) {
+      retval = build_sg_chain_sgt(&chan_buf->chain, chan_buf->buf,
+                                  chan_buf->sgt, chan_buf->sg_offset);
+    } else {
+      retval = sg_chain_update(&chan_buf->chain, &chan_buf->buf,
+                               use_2D_mode ? SG_CHAIN_2D : SG_CHAIN_ROWS,
+                               sg_axcache());
+    }
+    if (retval < 0) {
+      ERROR("process_image: SG chain for channel %d doesn't fit\n", i);
+      retval = -E2BIG;
+      goto failed;
+    }
+    nr_desc += retval;
+  }
+  trace_hwacc_sg_build(src->id, nr_desc);
+
+  // Map the buffers for DMA
+  // This causes cache flushes for the source buffer(s)
+  // The invalidate for the result happens on the unmap
+  // Imported buffers were already mapped when they were imported
+  if (!use_acp) {
+    for (i = 0; i < drvdata->nr_channels; i++) {
+    chan_buf = &src->chan_buf_list[i];
+    if (chan_buf->sgt)
+      continue;
+    flag = drvdata->chan[i]->input_chan ? DMA_TO_DEVICE : DMA_FROM_DEVICE;
+    // Only up to the last pixel, since a tile's last row stops short
+    dma_map_single(drvdata->pipe_dev, chan_buf->buf.kern_addr,
+                   ((chan_buf->buf.height - 1) * chan_buf->buf.stride
+                    + chan_buf->buf.width) * chan_buf->buf.depth,
+                   flag);
+    }
+
+    //flush_cache_all(); // flush l1 cache
+    //outer_flush_all(); // flush l2 cache, kernel dump "bus error"
+    TRACE("process_image: dma_map_single() finished.\n");
+  }
+
+  src->from_ring = (sqe != NULL);
+  src->user_data = sqe ? sqe->user_data : 0;
+  src->job = job;
+  src->nr_reg_writes = regs ? regs->nr_writes : 0;
+  if (src->nr_reg_writes) {
+    memcpy(src->reg_writes, regs->writes,
+           src->nr_reg_writes * sizeof(HwaccRegWrite));
+    stat_inc(drvdata->stats, reg_frames);
+  }
+
+  // Now throw this whole thing into the queue.
+  // When the DMA engine is free, it will get pulled off and run.
+  src->t_submit = ktime_get();
+  src->ttc_kick = 0;
+  src->ttc_done = 0;
+  src->error = 0;
+  atomic_set(&src->state, BUFSET_QUEUED);
+  buffer_enqueue(&drvdata->queued_list, src);
+  trace_hwacc_set_queued(src->id);
+  stat_inc(drvdata->stats, frames_submitted);
+
+  // Have the launch thread write this to the DMA
+  wake_up_interruptible(&drvdata->launch_wait);
+
+  TRACE("process_image: return\n");
+  return(src->id);
+
+failed:
+  stat_inc(drvdata->stats, submit_errors);
+  // Channels which weren't imported have nothing to release
+  for (i = 0; i < drvdata->nr_channels; i++) {
+    release_chan_buf(drvdata, &src->chan_buf_list[i]);
+  }
+  buffer_enqueue(&drvdata->free_list, src);
+  wake_up_interruptible(&drvdata->buffer_free_queue);
+  return(retval);
+}
+
+
+/* Reads the TTC as one 100MHz count, like ttc_clock_now() on the R5 (which
+ * then divides it down to microseconds).  The coarse counter's top half is
+ * bits 32-47 of the count and the fine counter is bits 0-31.  They can't be
+ * read together, but they share bit 31, so if it went from 1 to 0 between
+ * the two reads the carry has already reached the coarse counter.
+ */
+static u64 ttc_now(void)
+{
+  u32 fine, coarse;
+  u64 t;
+
+  if (!ttc_regs) {
+    return(0);
+  }
+  fine = ioread32(ttc_regs + TTC_COUNT2);
+  coarse = ioread32(ttc_regs + TTC_COUNT1);
+
+  t = ((u64)(coarse >> 16) << 32) + fine;
+  if ((fine >> 31 & 1) && !(coarse >> 15 & 1)) {
+    t -= 1ULL << 32;
+  }
+  return(t);
+}
+
+/* The HLS core's control register:
+ * [7: auto_restart, --- 3: ap_ready, 2: ap_idle, 1: ap_done, 0: ap_start]
+ * ap_start stays set until the core starts the frame, and it latches its
+ * other registers as it does.
+ */
+#define HLS_CTRL 0x00
+#define HLS_AP_START 0x00000001
+#define HLS_START_POLL_MS 1
+#define HLS_START_TIMEOUT_MS 1000
+
+static bool hls_started(struct hwacc_drvdata *drvdata)
+{
+  return(!(ioread32(drvdata->hls_controller + HLS_CTRL) & HLS_AP_START));
+}
+
+/* Waits for the core to start on the last frame it was given, so that it
+ * has latched that frame's registers and writes from here on only reach the
+ * next one.  With the core one frame ahead of the DMA this is normally
+ * already so; otherwise it's at most a frame away, so this sleeps until a
+ * frame completes, since the core then moves on to the next.  The core
+ * samples ap_start a little after its output is done, so the wait also
+ * times out every HLS_START_POLL_MS to look again.
+ * Returns 0, -ETIMEDOUT if the core never started (after a DMA error it may
+ * never see the rest of its frame), or -EINTR if the thread is stopping or
+ * a DMA error needs recovery.
+ */
+static int wait_hls_start(struct hwacc_drvdata *drvdata)
+{
+  unsigned long timeout = jiffies + msecs_to_jiffies(HLS_START_TIMEOUT_MS);
+
+  if (hls_started(drvdata)) {
+    return(0);
+  }
+  stat_inc(drvdata->stats, start_waits);
+  while (!hls_started(drvdata)) {
+    if (kthread_should_stop() || atomic_read(&drvdata->dma_error)) {
+      return(-EINTR);
+    }
+    if (time_after(jiffies, timeout)) {
+      return(-ETIMEDOUT);
+    }
+    wait_event_interruptible_timeout(drvdata->hls_wait,
+                                     hls_started(drvdata) ||
+                                     kthread_should_stop() ||
+                                     atomic_read(&drvdata->dma_error),
+                                     msecs_to_jiffies(HLS_START_POLL_MS));
+  }
+  return(0);
+}
+
+/* Makes a frame's PROCESS_REGS writes, between wait_hls_start() and the
+ * frame's own ap_start.
+ */
+static void write_frame_regs(struct hwacc_drvdata *drvdata, BufferSet *buf)
+{
+  unsigned int i;
+
+  for (i = 0; i < buf->nr_reg_writes; i++) {
+    iowrite32(buf->reg_writes[i].value,
+              drvdata->hls_controller + buf->reg_writes[i].offset);
+  }
+  DEBUG("dma_launch: %u register writes for set %d\n",
+        buf->nr_reg_writes, buf->id);
+}
+
+/* Whether each of a frame's chains fits in its channel's ring at all */
+static bool chains_fit(struct hwacc_drvdata *drvdata, BufferSet *buf)
+{
+  int i, nr_desc;
+
+  for (i = 0; i < drvdata->nr_channels; i++) {
+    nr_desc = buf->chan_buf_list[i].chain.nr_desc;
+    if (nr_desc <= 0 || nr_desc > drvdata->chan[i]->ring.size) {
+      return(false);
+    }
+  }
+  return(true);
+}
+
+/* Hands queued frames to the DMA engines.  Each frame's chains are appended
+ * to the channels' descriptor rings, so the engines go straight from one
+ * frame to the next without stopping.  The HLS core gets an ap_start per
+ * frame, which it holds until it's done with the frame before, so it doesn't
+ * stop either.  This only has to wait when a ring is full, or when the core
+ * hasn't started on the frame before yet.
+ */
+static void dma_launch(struct hwacc_drvdata *drvdata)
+{
+  BufferSet* buf;
+  int i, retval;
+  unsigned long flags;
+  struct dma_chan *chan;
+  struct chan_buf *chan_buf;
+
+  TRACE("dma_launch: begin\n");
+  // This is the only consumer, so a frame can wait at the head of the list
+  while((buf = buffer_peek(&drvdata->queued_list)) != NULL){
+
+    // A chain which could never fit would wait for room forever
+    if (!chains_fit(drvdata, buf)) {
+      buffer_dequeue(&drvdata->queued_list);
+      ERROR("dma_launch: set %d has a chain longer than the ring\n", buf->id);
+      fail_set(drvdata, buf, -E2BIG);
+      continue;
+    }
+
+    // Wait for room in every ring; slots free up as earlier frames finish
+    for (i = 0; i < drvdata->nr_channels; i++) {
+      chan = drvdata->chan[i];
+      wait_event_interruptible(chan->wq,
+                               dma_ring_space(&chan->ring)
+                               >= buf->chan_buf_list[i].chain.nr_desc ||
+                               atomic_read(&drvdata->dma_error) ||
+                               kthread_should_stop());
+    }
+    if (kthread_should_stop()) {
+      return; // Closing; the sets get reset on the next open
+    }
+    if (atomic_read(&drvdata->dma_error)) {
+      return; // The rings won't drain until recover_dma() has run
+    }
+    // Only one ap_start can be pending, and the last frame's may still be
+    retval = wait_hls_start(drvdata);
+    if (retval == -ETIMEDOUT) {
+      // This frame's registers would reach whatever the core is stuck on,
+      // so it can't go; neither can anything the engines still have
+      buffer_dequeue(&drvdata->queued_list);
+      ERROR("dma_launch: HLS core hasn't started its last frame\n");
+      fail_set(drvdata, buf, -ETIMEDOUT);
+      recover_dma(drvdata);
+      return;
+    }
+    if (retval < 0) {
+      return;
+    }
+    buffer_dequeue(&drvdata->queued_list);
+
+    // The frame's own register values, which the core picks up when it
+    // starts this frame and no earlier
+    if (buf->nr_reg_writes) {
+      write_frame_regs(drvdata, buf);
+    }
+
+    // Not in any ring yet, in case a submit fails partway through
+    for (i = 0; i < drvdata->nr_channels; i++) {
+      buf->chan_buf_list[i].ring_slot = -1;
+    }
+
+    // On the processing list before the engines can possibly finish it
+    atomic_set(&buf->state, BUFSET_PROCESSING);
+    buffer_enqueue(&drvdata->processing_list, buf);
+
+    TRACE("dma_launch: writing DMA registers\n");
+    // Stamped first, so it's there before the frame can possibly finish
+    buf->ttc_kick = ttc_now();
+    for (i = 0; i < drvdata->nr_channels; i++) {
+      chan_buf = &(buf->chan_buf_list[i]);
+      chan = drvdata->chan[i];
+      spin_lock_irqsave(&chan->ring_lock, flags);
+      chan_buf->ring_slot = dma_ring_submit(&chan->ring, chan->controller,
+                                            &chan_buf->chain);
+      spin_unlock_irqrestore(&chan->ring_lock, flags);
+      if (chan_buf->ring_slot < 0) {
+        // The frame is already on the processing list, so it gets failed
+        // along with everything else the engines had.  No room can't
+        // happen after the wait above, but the rings are out of step if it
+        // does, so that gets the same recovery.
+        ERROR("dma_launch: chan %d %s\n", chan->id,
+              chan_buf->ring_slot == DMA_RING_STOPPED ?
+              "stopped on an error" : "had no room in its ring");
+        atomic_set(&drvdata->dma_error, 1);
+        return;
+      }
+      DEBUG("dma_launch: chan %d ring head %d, used %d\n",
+            chan->id, chan->ring.head, chan->ring.used);
+    }
+
+    // The core starts on this frame as soon as it's done with the last.
+    // auto_restart would start it early, before this frame's registers are
+    // written and with no data to process, so it's left off.
+    iowrite32(HLS_AP_START, drvdata->hls_controller + HLS_CTRL);
+    trace_hwacc_dma_kick(buf->id, buf->chan_buf_list[drvdata->nr_channels - 1].ring_slot);
+    buf->t_launch = ktime_get();
+    stat_hist_record(drvdata->stats, lat_queue,
+                     ktime_us_delta(buf->t_launch, buf->t_submit));
+    TRACE("dma_launch: Transfers started\n");
+  } // END while(buffers in QUEUED list)
+}
+
+/* Dedicated launcher, so getting frames onto the hardware doesn't wait
+ * behind whatever else is on the system workqueue.
+ */
+static int launch_thread_fn(void *data)
+{
+  struct hwacc_drvdata *drvdata = data;
+
+  while (!kthread_should_stop()) {
+    wait_event_interruptible(drvdata->launch_wait,
+                             !buffer_listempty(&drvdata->queued_list) ||
+                             atomic_read(&drvdata->dma_error) ||
+                             kthread_should_stop());
+    if (atomic_read(&drvdata->dma_error)) {
+      recover_dma(drvdata);
+    }
+    dma_launch(drvdata);
+  }
+  return(0);
+}
+
+static int start_launch_thread(struct hwacc_drvdata *drvdata)
+{
+  struct sched_param param = { .sched_priority = rt_priority };
+  struct task_struct *thread;
+
+  thread = kthread_create(launch_thread_fn, drvdata, "hwacc%d-launch",
+                          drvdata->dev_index);
+  if (IS_ERR(thread)) {
+    ERROR("failed to start the launch thread\n");
+    return(PTR_ERR(thread));
+  }
+  if (rt_cpu >= 0 && cpu_online(rt_cpu)) {
+    kthread_bind(thread, rt_cpu);
+  }
+  if (rt_priority > 0 &&
+      sched_setscheduler(thread, SCHED_FIFO, &param) < 0) {
+    ERROR("couldn't make the launch thread SCHED_FIFO %d\n", rt_priority);
+  }
+  drvdata->launch_thread = thread;
+  wake_up_process(thread);
+  return(0);
+}
+
+/* Last step for a finished frame: frames from the shared rings post a
+ * completion and go straight back on the free list, tiles count down their
+ * job, and everything else waits for PEND_PROCESSED.
+ */
+static void finish_set(struct hwacc_drvdata *drvdata, BufferSet* buf)
+{
+  struct tile_job *job = buf->job;
+
+  if (job) {
+    // The last tile can free the job, so it's last to be touched
+    buf->job = NULL;
+    if (buf->error) {
+      job->error = buf->error;
+    }
+    atomic_set(&buf->state, BUFSET_FREE);
+    buffer_enqueue(&drvdata->free_list, buf);
+    wake_up_interruptible(&drvdata->buffer_free_queue);
+    tile_job_finish(job);
+  } else if (buf->from_ring) {
+    // Nobody pends on these; post the completion and recycle the set now
+    ring_post_cqe(drvdata, buf->error ? buf->error : buf->id, buf->user_data);
+    atomic_dec(&drvdata->ring_inflight);
+    atomic_set(&buf->state, BUFSET_FREE);
+    buffer_enqueue(&drvdata->free_list, buf);
+    wake_up_interruptible(&drvdata->buffer_free_queue);
+    wake_up_interruptible(&drvdata->ring_wait);
+  } else {
+    atomic_set_release(&buf->state, BUFSET_COMPLETE);
+    atomic_inc(&drvdata->nr_complete);
+    // Only whoever is pending on this id, plus anyone waiting for any frame
+    // at all (PEND_PROCESSED_ANY and poll)
+    wake_up_interruptible(&buf->wait);
+    wake_up_interruptible_all(&drvdata->processing_finished);
+  }
+}
+
+/* Whether the engines have finished with a frame: every output channel
+ * has set Cmplt on the last descriptor of the frame's chain.
  */
-void build_sg_chain(const Buffer buf, unsigned long* sg_ptr_base, unsigned long* sg_phys)
-{
-  int sg; // Descriptor count
-  unsigned int* sg_ptr = (int*)sg_ptr_base; // Pointer which will be incremented along the chain
-  TRACE("build_sg_chain: sg_ptr 0x%lx, sg_phys 0x%lx\n", (unsigned long)sg_ptr, (unsigned long)sg_phys);
-
-  for(sg = 0; sg < buf.height; sg++){
-    sg_ptr[0] = virt_to_phys(sg_ptr + SG_DESC_SIZE); // Pointer to next descriptor
-    sg_ptr[1] = 0; // Upper 32 bits of descriptor pointer (unused)
-    sg_ptr[2] = buf.phys_addr + (sg * buf.stride * buf.depth); // Address where the data lives
-    sg_ptr[3] = 0; // Upper 32 bits of data address (unused)
-    // Next 2 words are reserved
-    sg_ptr[6] = (buf.width * buf.depth); // Width of data is width*depth of image
-    if(sg == 0){
-      sg_ptr[6] |= 0x08000000; // Start of frame flag
+static bool frame_finished(struct hwacc_drvdata *drvdata, BufferSet* buf)
+{
+  int i;
+  struct dma_chan *chan;
+  struct chan_buf *chan_buf;
+
+  for (i = 0; i < buf->nr_channels; i++) {
+    chan = drvdata->chan[i];
+    chan_buf = &buf->chan_buf_list[i];
+    if (!chan->input_chan &&
+        (chan_buf->ring_slot < 0 ||
+         !dma_ring_complete(&chan->ring, chan_buf->ring_slot,
+                            chan_buf->chain.nr_desc))) {
+      return(false);
     }
-    if(sg == buf.height-1){
-      sg_ptr[6] |= 0x04000000; // End of frame flag
+  }
+  return(true);
+}
+
+/* Called for each finished frame, from the output channel's IRQ thread or
+ * from a polling PEND_PROCESSED, once it's off the processing list.
+ */
+static void frame_done(struct hwacc_drvdata *drvdata, BufferSet* buf,
+                       bool polled)
+{
+  int i;
+  unsigned long flags;
+  struct dma_chan *chan;
+  Buffer *img;
+
+  DEBUG("frame_done: buf: %d\n", buf->id);
+  stat_inc(drvdata->stats, frames_completed);
+  if (polled) {
+    stat_inc(drvdata->stats, completions_polled);
+  } else {
+    stat_inc(drvdata->stats, completions_irq);
+  }
+  buf->t_done = ktime_get();
+  buf->ttc_done = ttc_now();
+  stat_hist_record(drvdata->stats, lat_hw,
+                   ktime_us_delta(buf->t_irq, buf->t_launch));
+  stat_hist_record(drvdata->stats, lat_irq,
+                   ktime_us_delta(buf->t_done, buf->t_irq));
+
+  // The output is done, so the inputs are too; give back the ring slots
+  for (i = 0; i < buf->nr_channels; i++) {
+    chan = drvdata->chan[i];
+    img = &buf->chan_buf_list[i].buf;
+    if (chan->input_chan) {
+      stat_add(drvdata->stats, bytes_in, img->width * img->height * img->depth);
+    } else {
+      stat_add(drvdata->stats, bytes_out, img->width * img->height * img->depth);
     }
-    sg_ptr[7] = 0; // Clear the status; the DMA engine will set this
+    spin_lock_irqsave(&chan->ring_lock, flags);
+    dma_ring_retire(&chan->ring, buf->chan_buf_list[i].chain.nr_desc);
+    spin_unlock_irqrestore(&chan->ring_lock, flags);
+    wake_up_interruptible(&chan->wq);
+  }
+
+  // Imported buffers get unmapped (and invalidated) here.  That can sleep,
+  // which is fine in the IRQ thread.
+  for (i = 0; i < buf->nr_channels; i++) {
+    release_chan_buf(drvdata, &buf->chan_buf_list[i]);
+  }
+  trace_hwacc_set_complete(buf->id, polled);
+  finish_set(drvdata, buf);
+  wake_up_interruptible(&drvdata->hls_wait);
+}
+
+/* Counts an error interrupt by the error bits the engine has set.  The bits
+ * stay set until the engine is reset, so they're only looked at when there's
+ * an error interrupt to go with them.
+ */
+static void count_dma_errors(struct hwacc_drvdata *drvdata, u32 sr)
+{
+  drvdata->last_dma_error = sr;
+  stat_inc(drvdata->stats, dma_err_irq);
+  // The channel has stopped; the launch thread cleans up after it
+  atomic_set(&drvdata->dma_error, 1);
+  wake_up_interruptible(&drvdata->launch_wait);
+  wake_up_interruptible(&drvdata->hls_wait);
+  if (sr & DMA_SR_DMA_INT_ERR) {
+    stat_inc(drvdata->stats, dma_err_internal);
+  }
+  if (sr & DMA_SR_DMA_SLV_ERR) {
+    stat_inc(drvdata->stats, dma_err_slave);
+  }
+  if (sr & DMA_SR_DMA_DEC_ERR) {
+    stat_inc(drvdata->stats, dma_err_decode);
+  }
+  if (sr & DMA_SR_SG_INT_ERR) {
+    stat_inc(drvdata->stats, sg_err_internal);
+  }
+  if (sr & DMA_SR_SG_SLV_ERR) {
+    stat_inc(drvdata->stats, sg_err_slave);
+  }
+  if (sr & DMA_SR_SG_DEC_ERR) {
+    stat_inc(drvdata->stats, sg_err_decode);
+  }
+}
+
+/* Claims an output channel's pending interrupt, if it has one, by clearing
+ * it in the status register.  Both the IRQ handler and polling
+ * PEND_PROCESSED call this, and the lock makes sure only one of them gets
+ * each interrupt.  An error interrupt is cleared and counted here too, but
+ * it isn't a completion, so on its own it doesn't count as a claim.
+ * Returns true if there was a completion (or delay) interrupt.
+ */
+static bool claim_output_irq(struct dma_chan *chan)
+{
+  struct hwacc_drvdata *drvdata = chan->drvdata;
+  unsigned long flags;
+  u32 sr;
+
+  spin_lock_irqsave(&chan->irq_lock, flags);
+  sr = ioread32(chan->controller + DMA_SR);
+  if (sr & DMA_SR_IRQS) {
+    iowrite32(sr & DMA_SR_IRQS, chan->controller + DMA_SR);
+  }
+  spin_unlock_irqrestore(&chan->irq_lock, flags);
+  if (sr & DMA_SR_ERR_IRQ) {
+    count_dma_errors(drvdata, sr);
+  }
+  return((sr & DMA_SR_DONE_IRQS) != 0);
+}
+
+/* Completes every frame the engines have finished.  With interrupt
+ * coalescing one interrupt can cover several frames (and a frame can span
+ * several interrupts), so rather than counting interrupts this looks at the
+ * Cmplt bits, oldest frame first, and stops at the first one still going.
+ * Pollers don't wait if someone else is already at it.  seen is when the
+ * interrupt (or poll) that led here found the engines done.
+ * Returns false if a poller gave up because the mutex was taken.
+ */
+static bool drain_frames(struct hwacc_drvdata *drvdata, bool polled,
+                         ktime_t seen)
+{
+  BufferSet* buf;
+
+  if (polled) {
+    if (!mutex_trylock(&drvdata->reap_mutex)) {
+      return(false);
+    }
+  } else {
+    mutex_lock(&drvdata->reap_mutex);
+  }
+
+  // The mutex makes us the only consumer, so peeking is safe
+  while ((buf = buffer_peek(&drvdata->processing_list)) != NULL &&
+         frame_finished(drvdata, buf)) {
+    buffer_dequeue(&drvdata->processing_list);
+    buf->t_irq = seen;
+    frame_done(drvdata, buf, polled);
+  }
+  mutex_unlock(&drvdata->reap_mutex);
+  return(true);
+}
+
+/* Finishes a frame which the engines lost, so whoever is waiting for it
+ * gets err instead of hanging.  Its ring slots are reclaimed when the rings
+ * are reset.
+ */
+static void fail_set(struct hwacc_drvdata *drvdata, BufferSet* buf, int err)
+{
+  int i;
 
-    sg_ptr += SG_DESC_SIZE; // Move to next descriptor
+  stat_inc(drvdata->stats, frames_failed);
+  buf->error = err;
+  buf->t_done = ktime_get();
+  for (i = 0; i < buf->nr_channels; i++) {
+    release_chan_buf(drvdata, &buf->chan_buf_list[i]);
+  }
+  trace_hwacc_set_complete(buf->id, false);
+  finish_set(drvdata, buf);
+}
+
+/* After a DMA error the channel stops, and the frames it had will never
+ * finish.  Rather than restarting past them, this stops and resets all the
+ * engines, completes whatever did finish, fails the rest, and starts the
+ * rings over empty.  Runs in the launch thread, which is the only submitter;
+ * it also runs when the HLS core stops taking new frames.
+ * The HLS core isn't reset; if the error left it partway through a frame, it
+ * stays out of step until the device is reopened.
+ */
+static void recover_dma(struct hwacc_drvdata *drvdata)
+{
+  BufferSet* buf;
+  struct dma_chan *chan;
+  unsigned long flags;
+  int i, n = 0;
+
+  atomic_set(&drvdata->dma_error, 0);
+  halt_engines(drvdata);
+  drain_frames(drvdata, false, ktime_get());
+
+  mutex_lock(&drvdata->reap_mutex);
+  while ((buf = buffer_dequeue(&drvdata->processing_list)) != NULL) {
+    fail_set(drvdata, buf, -EIO);
+    n++;
+  }
+  for (i = 0; i < drvdata->nr_channels; i++) {
+    chan = drvdata->chan[i];
+    spin_lock_irqsave(&chan->ring_lock, flags);
+    dma_ring_reset(&chan->ring);
+    spin_unlock_irqrestore(&chan->ring_lock, flags);
+    wake_up_interruptible(&chan->wq);
+  }
+  mutex_unlock(&drvdata->reap_mutex);
+  ERROR("DMA error (status %08x); %d frames in flight were lost\n",
+        drvdata->last_dma_error, n);
+}
+
+/* Spins for up to poll_budget_us, completing frames here rather than waiting
+ * for the IRQ thread.  Pending output interrupts are cleared along the way,
+ * since they're for frames this is about to complete anyway.  For small
+ * frames this saves the interrupt and the wakeup.
+ * An interrupt claimed here which no drain of ours followed (because the IRQ
+ * thread had the mutex, and may already have looked) is handed back to the
+ * IRQ thread on the way out, or its frames would never be completed.
+ * Returns true if the set completed within the budget.
+ */
+static bool poll_for_set(struct hwacc_drvdata *drvdata, BufferSet* set)
+{
+  ktime_t deadline;
+  unsigned long owed = 0;
+  bool done = true;
+  int i;
+
+  if (drvdata->poll_budget_us == 0) {
+    return(false);
+  }
+
+  deadline = ktime_add_us(ktime_get(), drvdata->poll_budget_us);
+  while (atomic_read_acquire(&set->state) != BUFSET_COMPLETE) {
+    if (ktime_after(ktime_get(), deadline) || need_resched() ||
+        signal_pending(current)) {
+      done = false;
+      break;
+    }
+    for (i = 0; i < drvdata->nr_channels; i++) {
+      if (!drvdata->chan[i]->input_chan &&
+          claim_output_irq(drvdata->chan[i])) {
+        owed |= BIT(i);
+      }
+    }
+    if (drain_frames(drvdata, true, ktime_get())) {
+      owed = 0;
+    }
+    cpu_relax();
+  }
+
+  for (i = 0; i < drvdata->nr_channels; i++) {
+    if (owed & BIT(i)) {
+      WRITE_ONCE(drvdata->chan[i]->irq_time, ktime_get());
+      irq_wake_thread(drvdata->chan[i]->irq, drvdata->chan[i]);
+    }
+  }
+  return(done);
+}
+
+/* Sleeps on the set's own wait queue until it's complete.  Every wakeup is
+ * counted, along with the ones that find the frame still isn't done, so the
+ * statistics show whether waiters are being woken for nothing.
+ */
+static int wait_for_set(struct hwacc_drvdata *drvdata, BufferSet* set)
+{
+  DEFINE_WAIT(wait);
+  int retval = 0;
+
+  while (1) {
+    prepare_to_wait(&set->wait, &wait, TASK_INTERRUPTIBLE);
+    if (atomic_read_acquire(&set->state) == BUFSET_COMPLETE) {
+      break;
+    }
+    if (signal_pending(current)) {
+      retval = -ERESTARTSYS;
+      break;
+    }
+    schedule();
+
+    stat_inc(drvdata->stats, pend_wakeups);
+    if (atomic_read_acquire(&set->state) != BUFSET_COMPLETE &&
+        !signal_pending(current)) {
+      stat_inc(drvdata->stats, pend_spurious_wakeups);
+    }
+  }
+  finish_wait(&set->wait, &wait);
+  return(retval);
+}
+
+/* Whether PEND_PROCESSED_ANY has anything to collect: a complete frame
+ * which no PEND_PROCESSED has claimed
+ */
+static bool any_collectable(struct hwacc_drvdata *drvdata)
+{
+  BufferSet *set;
+  int i;
+
+  for (i = 0; i < N_DMA_BUFFERSETS; i++) {
+    set = &drvdata->buffer_pool[i];
+    if (atomic_read(&set->state) == BUFSET_COMPLETE && !READ_ONCE(set->pended)) {
+      return(true);
+    }
+  }
+  return(false);
+}
+
+/* Blocks until a result is complete, and puts the buffer set back on the
+ * free list.  This should be called once for each process_image call.
+ * The id is claimed for as long as this waits, so PEND_PROCESSED_ANY can't
+ * take the frame out from under it.
+ * Returns 0, -EIO if a DMA error lost the frame, -EINVAL if id isn't a
+ * frame that's been submitted (or PEND_PROCESSED_ANY already collected it),
+ * or -EBUSY if another PEND_PROCESSED is already waiting for it.
+ */
+int pend_processed(struct hwacc_drvdata *drvdata, int id)
+{
+  BufferSet* resultSet;
+  int retval, state;
+
+  TRACE("pend_processed: begin for bufferset %d\n", id);
+  if (id < 0 || id >= N_DMA_BUFFERSETS) {
+    return(-EINVAL);
+  }
+  resultSet = &drvdata->buffer_pool[id];
+
+  spin_lock(&drvdata->claim_lock);
+  state = atomic_read(&resultSet->state);
+  if (state == BUFSET_FREE || resultSet->pended) {
+    spin_unlock(&drvdata->claim_lock);
+    ERROR("pend_processed: bufferset %d is %s\n", id,
+          state == BUFSET_FREE ? "not in use" : "already pended on");
+    return(state == BUFSET_FREE ? -EINVAL : -EBUSY);
+  }
+  resultSet->pended = true;
+  spin_unlock(&drvdata->claim_lock);
+
+  // Nobody else can collect it now, so it stays ours until we free it
+  if (!poll_for_set(drvdata, resultSet) &&
+      wait_for_set(drvdata, resultSet)) {
+    spin_lock(&drvdata->claim_lock);
+    resultSet->pended = false;
+    spin_unlock(&drvdata->claim_lock);
+    // It may have finished meanwhile; PEND_PROCESSED_ANY can have it now
+    wake_up_interruptible_all(&drvdata->processing_finished);
+    return(-ERESTARTSYS);
+  }
+
+  spin_lock(&drvdata->claim_lock);
+  atomic_set(&resultSet->state, BUFSET_FREE);
+  resultSet->pended = false;
+  spin_unlock(&drvdata->claim_lock);
+  atomic_dec(&drvdata->nr_complete);
+  stat_hist_record(drvdata->stats, lat_wake,
+                   ktime_us_delta(ktime_get(), resultSet->t_done));
+  retval = resultSet->error; // Before the set can be reused
+
+  // Put the buffer set back on the free list
+  buffer_enqueue(&drvdata->free_list, resultSet);
+  wake_up_interruptible(&drvdata->buffer_free_queue);
+
+  trace_hwacc_pend_return(id);
+  TRACE("pend_processed: return for bufferset %d\n", id);
+  return(retval);
+}
+
+/* Whether a PROCESS_REGS write can go to offset: a word inside the
+ * accelerator's registers but past the control block, and inside one of the
+ * taps if the device tree says where they are.
+ */
+static bool reg_write_ok(struct hwacc_drvdata *drvdata, unsigned int offset)
+{
+  HwaccTap *tap;
+  int i;
+
+  if ((offset & 3) || offset < 0x10 ||
+      offset >= (ACC_CONTROLLER_PAGES << PAGE_SHIFT)) {
+    return(false);
+  }
+  if (drvdata->nr_taps == 0) {
+    return(true);
+  }
+  for (i = 0; i < drvdata->nr_taps; i++) {
+    tap = &drvdata->taps[i];
+    if (offset >= tap->offset &&
+        offset < tap->offset + 4 * DIV_ROUND_UP(tap->width, 32)) {
+      return(true);
+    }
+  }
+  return(false);
+}
+
+/* Submits one frame with its register writes, for PROCESS_REGS.
+ * Returns the BufferSet id like PROCESS_IMAGE.
+ */
+static int process_regs(struct hwacc_drvdata *drvdata, unsigned long arg)
+{
+  HwaccFrameRegs regs;
+  ImportBuffer *imps;
+  int i, retval;
+
+  if (copy_from_user(&regs, (void*)arg, sizeof(HwaccFrameRegs))) {
+    return(-EFAULT);
+  }
+  if (regs.flags != 0 || regs.nr_writes > HWACC_MAX_REG_WRITES) {
+    return(-EINVAL);
+  }
+  for (i = 0; i < regs.nr_writes; i++) {
+    if (!reg_write_ok(drvdata, regs.writes[i].offset)) {
+      ERROR("process_regs: can't write register 0x%x\n",
+            regs.writes[i].offset);
+      return(-EINVAL);
+    }
+  }
+
+  imps = kmalloc_array(drvdata->nr_channels, sizeof(ImportBuffer), GFP_KERNEL);
+  if (imps == NULL) {
+    return(-ENOMEM);
+  }
+  for (i = 0; i < drvdata->nr_channels; i++) {
+    imps[i].type = IMPORT_CMA;
+    if (copy_from_user(&imps[i].buf, &regs.bufs[i], sizeof(Buffer))) {
+      retval = -EFAULT;
+      goto done;
+    }
+  }
+  retval = process_image(drvdata, imps, NULL, NULL, &regs);
+
+done:
+  kfree(imps);
+  return(retval);
+}
+
+/* Submits a batch of frames for PROCESS_IMAGE_BATCH, with one copy from user
+ * space for the whole lot.  If a frame fails partway through, the ones before
+ * it stay submitted and the count says how many that was.
+ * Returns the number of frames submitted, or an error if none were.
+ */
+int process_batch(struct hwacc_drvdata *drvdata, unsigned long arg)
+{
+  HwaccBatch batch;
+  Buffer *bufs;
+  ImportBuffer *imps;
+  int ids[N_DMA_BUFFERSETS];
+  int i, j, n, nr = drvdata->nr_channels;
+  int retval = 0;
+
+  if (copy_from_user(&batch, (void*)arg, sizeof(HwaccBatch))) {
+    return(-EFAULT);
+  }
+  n = min(batch.count, (unsigned int)N_DMA_BUFFERSETS);
+  if (n == 0) {
+    return(0);
+  }
+
+  bufs = kmalloc_array(n * nr, sizeof(Buffer), GFP_KERNEL);
+  imps = kmalloc_array(nr, sizeof(ImportBuffer), GFP_KERNEL);
+  if (bufs == NULL || imps == NULL) {
+    retval = -ENOMEM;
+    goto done;
+  }
+  if (copy_from_user(bufs, batch.bufs, n * nr * sizeof(Buffer))) {
+    retval = -EFAULT;
+    goto done;
+  }
+
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < nr; j++) {
+      imps[j].type = IMPORT_CMA;
+      imps[j].buf = bufs[i * nr + j];
+    }
+    retval = process_image(drvdata, imps, NULL, NULL, NULL);
+    if (retval < 0) {
+      break;
+    }
+    ids[i] = retval;
+  }
+  TRACE("process_batch: submitted %d of %d frames\n", i, n);
+
+  if (i > 0) {
+    batch.count = i;
+    retval = i;
+    if (copy_to_user(batch.ids, ids, i * sizeof(int)) ||
+        copy_to_user((void*)arg, &batch, sizeof(HwaccBatch))) {
+      retval = -EFAULT;
+    }
+  }
+
+done:
+  kfree(bufs);
+  kfree(imps);
+  return(retval);
+}
+
+/* Runs a whole image through the accelerator in tiles for PROCESS_TILED.
+ * The tiles stream back to back through the free BufferSets, and each one
+ * goes straight back to the free list once it's done, so nothing needs
+ * PEND_PROCESSED.  If a tile fails to submit, the ones already submitted
+ * still run to completion before this returns, unless the caller is killed.
+ * Returns the number of tiles.
+ */
+int process_tiled(struct hwacc_drvdata *drvdata, unsigned long arg)
+{
+  HwaccTiled req;
+  ImportBuffer imps[2];
+  struct tile_job *job;
+  TileGrid grid;
+  int in, i, n, retval = 0;
+
+  // The tiles are cut from one image and written to one image
+  if (drvdata->nr_channels != 2 ||
+      drvdata->chan[0]->input_chan == drvdata->chan[1]->input_chan) {
+    return(-EINVAL);
+  }
+  in = drvdata->chan[0]->input_chan ? 0 : 1;
+
+  if (copy_from_user(&req, (void*)arg, sizeof(HwaccTiled))) {
+    return(-EFAULT);
+  }
+  if (req.in.depth != req.out.depth ||
+      req.in.stride < req.in.width || req.out.stride < req.out.width) {
+    return(-EINVAL);
+  }
+  n = tile_grid_init(&grid, &req.in, &req.out,
+                     req.tile_width, req.tile_height, req.halo);
+  if (n < 0) {
+    ERROR("process_tiled: %ux%u tiles with halo %u don't fit %ux%u -> %ux%u\n",
+          req.tile_width, req.tile_height, req.halo,
+          req.in.width, req.in.height, req.out.width, req.out.height);
+    return(-EINVAL);
+  }
+
+  job = kmalloc(sizeof(struct tile_job), GFP_KERNEL);
+  if (job == NULL) {
+    return(-ENOMEM);
+  }
+  atomic_set(&job->remaining, 1);
+  atomic_set(&job->refs, 2);
+  init_completion(&job->done);
+  job->error = 0;
+  imps[in].type = IMPORT_CMA;
+  imps[1 - in].type = IMPORT_CMA;
+  for (i = 0; i < n; i++) {
+    tile_grid_get(&grid, &req.in, &req.out, i, &imps[in].buf, &imps[1 - in].buf);
+    atomic_inc(&job->remaining);
+    retval = process_image(drvdata, imps, NULL, job, NULL);
+    if (retval < 0) {
+      atomic_dec(&job->remaining);
+      break;
+    }
+  }
+  TRACE("process_tiled: submitted %d of %d tiles\n", i, n);
+
+  // Only a fatal signal gets out early, since the tiles are still writing
+  // to the output image; they finish by themselves and free the job.
+  tile_job_finish(job);
+  if (wait_for_completion_killable(&job->done)) {
+    tile_job_put(job);
+    return(-ERESTARTSYS);
+  }
+  if (retval == 0) {
+    retval = job->error;
+  }
+  tile_job_put(job);
+  if (retval < 0) {
+    return(retval);
   }
-  TRACE("build_sg_chain: built SG table\n");
 
-  // This is always mapped DMA_TO_DEVICE, since the DMA engine is reading the SG table
-  // regardless of the data direction.
-  *sg_phys = virt_to_phys(sg_ptr_base);
-  //*sg_phys = dma_map_single(pipe_dev, sg_ptr_base, SG_DESC_BYTES * buf.height, DMA_TO_DEVICE);
+  req.tiles = n;
+  if (copy_to_user((void*)arg, &req, sizeof(HwaccTiled))) {
+    return(-EFAULT);
+  }
+  return(n);
 }
 
-// Use 2-D transfer feature in Xilinx AXI DMA.
-// To enable this feature, DMA IP needs to be configured with Multichannel mode enabled.
-// With this feature, a transfer of a sub-block of 2-D data requires only one descriptor.
-void build_sg_chain_2D(const Buffer buf, unsigned long* sg_ptr_base, unsigned long* sg_phys)
+/* Hands back a frame's TTC timestamps for READ_TIMER */
+static int read_timer(struct hwacc_drvdata *drvdata, unsigned long arg)
 {
-  unsigned int* sg_ptr = (int*)sg_ptr_base; // Pointer which will be incremented along the chain (2/18/18 WC updated from long to int)
+  HwaccTimer timer;
+  BufferSet *set;
+  int state;
 
-  // the sg chain only has one descriptor
-  sg_ptr[0] = virt_to_phys(sg_ptr + SG_DESC_SIZE); // Pointer to next descriptor
-  sg_ptr[1] = 0; // Upper 32 bits of descriptor pointer (unused)
-  sg_ptr[2] = buf.phys_addr; // Address where the data lives
-  sg_ptr[3] = 0; // Upper 32 bits of data address (unused)
-
-  // 0x10: AxUSER|AxCACHE|Rsvd|TUSER|Rsvd|TID|Rsvd|TDEST
-  if (use_acp) {
-    // AxCACHE: 0011 defines memory type as 'normal non-cacheable bufferable'
-    // AxCACHE: 1111 defines memory type as 'write-back read and write-allocate'
-    // AxUSER: tie off high to enable coherency when allowed by AxCACHE
-    sg_ptr[4] = 0xff000000; // values for AxCACHE (1111) and AxUSER (1111)
-  } else {
-    // for some reason, AxCACHE (1111) with dma_map/unmap doesn't
-    // work correctly on Linux 4.0 kernel, so we use 0011 for AxCACHE field
-    sg_ptr[4] = 0x03000000; // values for AxCACHE (0011) and AxUSER (0000)
+  if (copy_from_user(&timer, (void*)arg, sizeof(HwaccTimer))) {
+    return(-EFAULT);
+  }
+  if (timer.id < 0 || timer.id >= N_DMA_BUFFERSETS) {
+    return(-EINVAL);
+  }
+  set = &drvdata->buffer_pool[timer.id];
+  state = atomic_read_acquire(&set->state);
+  if (state == BUFSET_QUEUED || state == BUFSET_PROCESSING) {
+    return(-EBUSY);
   }
 
-  // 0x14: VSIZE|Rsvd|Stride
-  sg_ptr[5] = buf.stride * buf.depth;  // Stride of the 2D block
-  sg_ptr[5] |= (buf.height << 19);     // VSize, i.e. the height of the block
-
-  // 0x18: SOP|EOP|Rsvd|HSIZE
-  sg_ptr[6] = (buf.width * buf.depth); // Width of data is width*depth of image
-  sg_ptr[6] |= 0x08000000; // Start of frame flag
-  sg_ptr[6] |= 0x04000000; // End of frame flag
-
-  sg_ptr[7] = 0; // Clear the status; the DMA engine will set this
+  timer.kick = set->ttc_kick;
+  timer.done = set->ttc_done;
+  if (copy_to_user((void*)arg, &timer, sizeof(HwaccTimer))) {
+    return(-EFAULT);
+  }
+  return(0);
+}
 
+/* Hands the stream sizes and tap registers to user space for GET_GEOMETRY */
+static int get_geometry(struct hwacc_drvdata *drvdata, unsigned long arg)
+{
+  HwaccGeometry *geom;
+  int i, retval = 0;
 
-  // This is always mapped DMA_TO_DEVICE, since the DMA engine is reading the SG table
-  // regardless of the data direction.
-  *sg_phys = virt_to_phys(sg_ptr_base);
-  //TRACE("build_sg_chain_2D: call dma_map_single()\n");
-  //*sg_phys = dma_map_single(pipe_dev, sg_ptr_base, SG_DESC_BYTES * 1, DMA_TO_DEVICE);
+  // Too big for the stack
+  geom = kzalloc(sizeof(HwaccGeometry), GFP_KERNEL);
+  if (geom == NULL) {
+    return(-ENOMEM);
+  }
 
-  TRACE("build_sg_chain_2D: sg_ptr 0x%lx, sg_phys 0x%lx, *sg_ptr 0x%lx, *sg_phys 0x%lx\n", (unsigned long)sg_ptr, (unsigned long)sg_phys, (unsigned long)*sg_ptr, (unsigned long)*sg_phys);
+  geom->nr_channels = min(drvdata->nr_channels, (u32)HWACC_MAX_CHANNELS);
+  for (i = 0; i < geom->nr_channels; i++) {
+    geom->chan[i].input = drvdata->chan[i]->input_chan;
+    geom->chan[i].width = drvdata->chan[i]->width;
+    geom->chan[i].height = drvdata->chan[i]->height;
+    geom->chan[i].depth = drvdata->chan[i]->depth;
+  }
+  geom->nr_taps = drvdata->nr_taps;
+  memcpy(geom->taps, drvdata->taps, sizeof(drvdata->taps));
 
+  if (copy_to_user((void*)arg, geom, sizeof(HwaccGeometry))) {
+    retval = -EFAULT;
+  }
+  kfree(geom);
+  return(retval);
 }
 
-/* Sets up a buffer for processing through the stencil path.  This drops the
- * image buffers into a BufferSet object, builds the scatter-gather tables,
- * and flushes the cache. Then it drops the BufferSet into the
- * queue to be pushed to the stencil path DMA engine as soon as it's free.
+/* Collects however many frames are complete for PEND_PROCESSED_ANY, instead
+ * of waiting for one particular id.
+ * Returns the number of ids handed back.
  */
-int process_image(struct hwacc_drvdata *drvdata, Buffer *buf_list)
+int pend_processed_any(struct hwacc_drvdata *drvdata, struct file *filp,
+                       unsigned long arg)
 {
-  BufferSet* src;
-  int i, flag;
-  Buffer *buf;
-  struct dma_chan *chan;
-  struct chan_buf *chan_buf;
-  int retval;
+  HwaccReap reap;
+  BufferSet* resultSet;
+  int ids[N_DMA_BUFFERSETS];
+  int n = 0, max, i;
+  unsigned int start;
 
-  for (i = 0; i < drvdata->nr_channels; i++) {
-    chan = drvdata->chan[i];
-    buf = &buf_list[i];
-    if (chan->input_chan) {
-      if (buf->width != 170 || buf->height != 170 || buf->depth != 3) {
-        ERROR("Buffer size for input %d doesn't match hardware!", i);
-      }
-    }
+  if (copy_from_user(&reap, (void*)arg, sizeof(HwaccReap))) {
+    return(-EFAULT);
   }
-
-  TRACE("process_image: begin\n");
-  // Acquire a bufferset to pass through the processing chain
-  wait_event_interruptible(drvdata->buffer_free_queue,
-                           !buffer_listempty(&drvdata->free_list));
-  src = buffer_dequeue(&drvdata->free_list);
-  TRACE("src id is %d\n", src->id);
-  TRACE("process_image: got BufferSet\n");
-  /* copy buffer address */
-  for (i = 0; i < drvdata->nr_channels; i++) {
-    src->chan_buf_list[i].buf = buf_list[i];
+  max = min(reap.max, (unsigned int)N_DMA_BUFFERSETS);
+  if (max == 0) {
+    return(-EINVAL);
   }
 
-  // Set up the scatter-gather descriptor chains
-  for (i = 0; i < drvdata->nr_channels; i++) {
-    chan_buf = &src->chan_buf_list[i];
-    if (use_2D_mode) {
-      build_sg_chain_2D(chan_buf->buf, chan_buf->sg, &chan_buf->sg_phys);
-    } else {
-      build_sg_chain(chan_buf->buf, chan_buf->sg, &chan_buf->sg_phys);
+  while (n == 0) {
+    if (!any_collectable(drvdata)) {
+      if (filp->f_flags & O_NONBLOCK) {
+        return(-EAGAIN);
+      }
+      if (wait_event_interruptible(drvdata->processing_finished,
+                                   any_collectable(drvdata))) {
+        return(-ERESTARTSYS);
+      }
     }
-  }
 
-  // Map the buffers for DMA
-  // This causes cache flushes for the source buffer(s)
-  // The invalidate for the result happens on the unmap
-  if (!use_acp) {
-    for (i = 0; i < drvdata->nr_channels; i++) {
-    chan_buf = &src->chan_buf_list[i];
-    flag = drvdata->chan[i]->input_chan ? DMA_TO_DEVICE : DMA_FROM_DEVICE;
-    dma_map_single(drvdata->pipe_dev, chan_buf->buf.kern_addr,
-                   chan_buf->buf.height * chan_buf->buf.stride
-                                        * chan_buf->buf.depth,
-                   flag);
+    // Look at every set once, starting after where the last call stopped
+    // so that nothing gets starved when max is small.  Everything goes
+    // straight back on the free list, with one wakeup at the end.  Frames
+    // a PEND_PROCESSED has claimed are left for it.
+    start = drvdata->reap_next;
+    for (i = 0; i < N_DMA_BUFFERSETS && n < max; i++) {
+      resultSet = &drvdata->buffer_pool[(start + i) % N_DMA_BUFFERSETS];
+      spin_lock(&drvdata->claim_lock);
+      if (resultSet->pended ||
+          atomic_read(&resultSet->state) != BUFSET_COMPLETE) {
+        spin_unlock(&drvdata->claim_lock);
+        continue;
+      }
+      atomic_set(&resultSet->state, BUFSET_FREE);
+      spin_unlock(&drvdata->claim_lock);
+
+      atomic_dec(&drvdata->nr_complete);
+      stat_hist_record(drvdata->stats, lat_wake,
+                       ktime_us_delta(ktime_get(), resultSet->t_done));
+      ids[n++] = resultSet->id | (resultSet->error ? HWACC_FRAME_FAILED : 0);
+      buffer_enqueue(&drvdata->free_list, resultSet);
+      trace_hwacc_pend_return(resultSet->id);
     }
-
-    //flush_cache_all(); // flush l1 cache
-    //outer_flush_all(); // flush l2 cache, kernel dump "bus error"
-    TRACE("process_image: dma_map_single() finished.\n");
+    drvdata->reap_next = (start + i) % N_DMA_BUFFERSETS;
   }
+  wake_up_interruptible(&drvdata->buffer_free_queue);
+  TRACE("pend_processed_any: reaped %d frames\n", n);
 
-  // Now throw this whole thing into the queue.
-  // When the DMA engine is free, it will get pulled off and run.
-  buffer_enqueue(&drvdata->queued_list, src);
+  reap.count = n;
+  if (copy_to_user(reap.ids, ids, n * sizeof(int)) ||
+      copy_to_user((void*)arg, &reap, sizeof(HwaccReap))) {
+    return(-EFAULT);
+  }
+  return(n);
+}
 
-  // Launch a work queue task to write this to the DMA
-  retval = schedule_work(&drvdata->launch_work);
+/* Posts a completion to the shared ring.  There's always room, since
+ * ring_has_room() only lets in as many frames as the CQ has free entries.
+ */
+static void ring_post_cqe(struct hwacc_drvdata *drvdata, int result,
+                          unsigned int user_data)
+{
+  HwaccRings *rings;
+  HwaccCqe *cqe;
+  unsigned long flags;
+
+  spin_lock_irqsave(&drvdata->cq_lock, flags);
+  rings = drvdata->rings;
+  if (rings) {
+    cqe = &rings->cq[rings->cq_tail % HWACC_RING_ENTRIES];
+    cqe->result = result;
+    cqe->user_data = user_data;
+    smp_store_release(&rings->cq_tail, rings->cq_tail + 1);
+  }
+  spin_unlock_irqrestore(&drvdata->cq_lock, flags);
 
-  TRACE("process_image: return\n");
-  return(src->id);
+  wake_up_interruptible_all(&drvdata->processing_finished);
 }
 
+static unsigned int ring_cq_ready(HwaccRings *rings)
+{
+  return(smp_load_acquire(&rings->cq_tail) - smp_load_acquire(&rings->cq_head));
+}
 
-void dma_launch_work(struct work_struct* ws)
+/* Whether another frame can come off the submission ring: a BufferSet has to
+ * be free, and its completion needs somewhere to go.
+ */
+static bool ring_has_room(struct hwacc_drvdata *drvdata)
 {
-  BufferSet* buf;
-  int i;
-  struct dma_chan *chan;
-  struct chan_buf *chan_buf;
-  struct hwacc_drvdata *drvdata = container_of(ws, struct hwacc_drvdata,
-                                             launch_work);
+  return(!buffer_listempty(&drvdata->free_list) &&
+         ring_cq_ready(drvdata->rings) + atomic_read(&drvdata->ring_inflight)
+         < HWACC_RING_ENTRIES);
+}
 
-  TRACE("dma_launch_work: begin\n");
-  while(!buffer_listempty(&drvdata->queued_list)){
-    buf = buffer_dequeue(&drvdata->queued_list);
+static bool ring_sq_pending(struct hwacc_drvdata *drvdata)
+{
+  HwaccRings *rings = drvdata->rings;
+  return(smp_load_acquire(&rings->sq_tail) != rings->sq_head &&
+         ring_has_room(drvdata));
+}
 
-    // Sleep until all the DMA engines are idle or halted (bits 0 and 1)
-    // Write should always be idle first, but do all of them to be safe
+/* Feeds entries from the submission ring to process_image() for as long as
+ * there's room.  An entry which finds no free BufferSet is left on the ring
+ * for the next pass.  Returns the number of entries consumed.
+ */
+static int ring_consume_sq(struct hwacc_drvdata *drvdata)
+{
+  HwaccRings *rings = drvdata->rings;
+  ImportBuffer imps[HWACC_RING_MAX_CHANNELS];
+  HwaccSqe sqe;
+  unsigned int head, tail;
+  int i, n = 0, retval;
+
+  mutex_lock(&drvdata->ring_mutex);
+  head = rings->sq_head;
+  tail = smp_load_acquire(&rings->sq_tail);
+  while (head != tail && ring_has_room(drvdata)) {
+    // Take a copy, since user space can scribble on the ring at any time
+    sqe = rings->sq[head % HWACC_RING_ENTRIES];
     for (i = 0; i < drvdata->nr_channels; i++) {
-      chan = drvdata->chan[i];
-      wait_event_interruptible(chan->wq,
-                               (ioread32(chan->controller + 0x04) & 0x00000003)
-                               != 0);
+      imps[i].type = IMPORT_CMA;
+      imps[i].buf = sqe.bufs[i];
     }
 
-    // Kick off the DMA write operations
-    TRACE("dma_launch_work: writing DMA registers\n");
-    for (i = 0; i < drvdata->nr_channels; i++) {
-      chan_buf = &(buf->chan_buf_list[i]);
-      chan = drvdata->chan[i];
-      DEBUG("dma_launch_work: sg_phys 0x%lx\n",
-            (unsigned long)chan_buf->sg_phys);
-      /* stop, so we can set the head ptr */
-      iowrite32(0x00010002, chan->controller + 0x00);
-      /* pointer to the fisrt descriptor */
-      iowrite32(chan_buf->sg_phys, chan->controller + 0x08);
-      /* run and enable interrupts */
-      iowrite32(0x00011003, chan->controller + 0x00);
-
-      if (use_2D_mode)
-        /* 2D mode: last descriptor, starts transfer */
-        iowrite32(chan_buf->sg_phys, chan->controller + 0x10);
-      else
-        /* last descriptor, starts transfer */
-        iowrite32(chan_buf->sg_phys + (chan_buf->buf.height - 1) * SG_DESC_BYTES,
-                  chan->controller + 0x10);
+    atomic_inc(&drvdata->ring_inflight);
+    retval = process_image(drvdata, imps, &sqe, NULL, NULL);
+    if (retval < 0) {
+      atomic_dec(&drvdata->ring_inflight);
+      if (retval == -EAGAIN) {
+        break; // Another submitter took the last free set
+      }
+      ring_post_cqe(drvdata, retval, sqe.user_data);
     }
 
-    // Start the stencil engine running
-    // control register [7: auto_restart, --- 3: ap_ready, 2: ap_idle, 1: ap_done, 0: ap_start]
-    iowrite32(0x00000001, drvdata->hls_controller + 0);
-    TRACE("dma_launch_work: Transfers started\n");
+    head++;
+    n++;
+    smp_store_release(&rings->sq_head, head);
+  }
+  mutex_unlock(&drvdata->ring_mutex);
+  return(n);
+}
 
-    // Move the buffer to the processing list
-    buffer_enqueue(&drvdata->processing_list, buf);
-  } // END while(buffers in QUEUED list)
+/* Kernel-side submission thread for HWACC_RING_SQPOLL.  It spins on the
+ * submission ring while there's traffic, so streaming needs no syscalls, and
+ * sleeps once the ring has been quiet for ring_idle_ms.
+ */
+static int ring_thread_fn(void *data)
+{
+  struct hwacc_drvdata *drvdata = data;
+  HwaccRings *rings = drvdata->rings;
+  unsigned long idle_since = jiffies;
+
+  while (!kthread_should_stop()) {
+    if (ring_consume_sq(drvdata) > 0) {
+      idle_since = jiffies;
+      continue;
+    }
+    if (time_before(jiffies, idle_since + msecs_to_jiffies(ring_idle_ms))) {
+      cond_resched();
+      continue;
+    }
+
+    // From here on user space has to kick us.  Look at the ring once more
+    // after setting the flag, in case a submission raced with it.
+    WRITE_ONCE(rings->flags, rings->flags | HWACC_RING_NEED_WAKEUP);
+    smp_mb();
+    wait_event_interruptible(drvdata->ring_wait,
+                             kthread_should_stop() || ring_sq_pending(drvdata));
+    WRITE_ONCE(rings->flags, rings->flags & ~HWACC_RING_NEED_WAKEUP);
+    idle_since = jiffies;
+  }
+  return(0);
 }
 
-void dma_finished_work(struct work_struct* ws)
+/* Creates the shared rings for RING_SETUP, and the polling thread if asked.
+ * Both are published under ring_mutex, so nobody sees the rings without
+ * their thread.
+ */
+static int ring_setup(struct hwacc_drvdata *drvdata, unsigned long flags)
 {
-  BufferSet* buf;
-  struct hwacc_drvdata *drvdata = container_of(ws, struct hwacc_drvdata,
-                                             finished_work);
-
-  TRACE("dma_finished_work: begin\n");
-
-  // Check that all of the output DMAs have completed their work
-  // TODO: bugs may lurk here if there are multiple outputs and the primary
-  // finishes first.
-  TRACE("finished_count: %d memory address: %p\n",
-         atomic_read(&drvdata->finished_count), &drvdata->finished_count);
-
-  while(atomic_read(&drvdata->finished_count) > 0) {
-
-    // Decrement the completion count
-    // This is the only part of the driver that will decrement these counts,
-    // so we can be sure that if they're all >0, we have a frame.
-    atomic_dec(&drvdata->finished_count);
-
-    buf = buffer_dequeue(&drvdata->processing_list);
-    DEBUG("dma_finished_work: buf: %lx\n", (unsigned long)buf);
-
-    // Unmap each of the SG buffers
-    //dma_unmap_single(pipe_dev, buf->input0_sg_phys, SG_DESC_BYTES * buf->input0.height, DMA_TO_DEVICE);
-    //dma_unmap_single(pipe_dev, buf->output_sg_phys, SG_DESC_BYTES * buf->output.height, DMA_TO_DEVICE);
-
-    // Unmap all the input and output buffers (with appropriate direction)
-    // For the source buffers, this should do nothing.  For the result buffers,
-    // it should cause a cache invalidate.
-    if (!use_acp) {
-      //dma_unmap_single(pipe_dev, buf->input0.phys_addr,
-      //buf->input0.height * buf->input0.stride * buf->input0.depth, DMA_TO_DEVICE);
-      //dma_unmap_single(pipe_dev, buf->output.phys_addr,
-      //buf->output.height * buf->output.stride * buf->output.depth, DMA_FROM_DEVICE);
-    TRACE("dma_finished_work: dma_unmap_single() finished.\n");
+  HwaccRings *rings;
+  struct task_struct *thread = NULL;
+  int retval = 0;
+
+  if (drvdata->nr_channels > HWACC_RING_MAX_CHANNELS) {
+    return(-EINVAL);
+  }
+
+  mutex_lock(&drvdata->ring_mutex);
+  if (drvdata->rings) {
+    retval = -EBUSY;
+    goto done;
+  }
+  rings = vmalloc_user(sizeof(HwaccRings)); // Zeroed, and safe to mmap
+  if (rings == NULL) {
+    retval = -ENOMEM;
+    goto done;
+  }
+
+  // Created stopped; it doesn't run until the rings are in place
+  if (flags & HWACC_RING_SQPOLL) {
+    thread = kthread_create(ring_thread_fn, drvdata, "hwacc%d-sq",
+                            drvdata->dev_index);
+    if (IS_ERR(thread)) {
+      retval = PTR_ERR(thread);
+      vfree(rings);
+      goto done;
     }
-    TRACE("we got it? %d\n", buffer_hasid(&drvdata->complete_list, buf->id));
-    buffer_enqueue(&drvdata->complete_list, buf);
   }
 
-  // Both the DMA launcher (which starts new DMA transactions) and the read()
-  // operation (which waits for new data) want to know this is finished.
-  TRACE("dma_finished_work: DMA read finished\n");
-  wake_up_interruptible_all(&drvdata->processing_finished);
+  atomic_set(&drvdata->ring_inflight, 0);
+  drvdata->ring_thread = thread;
+  smp_store_release(&drvdata->rings, rings);
+  if (thread) {
+    wake_up_process(thread);
+  }
+
+done:
+  mutex_unlock(&drvdata->ring_mutex);
+  return(retval);
 }
 
-/* Blocks until a result is complete, and removes the buffer set from the queue.
- * This should be called once for each process_image call.
- */
-void pend_processed(struct hwacc_drvdata *drvdata, int id)
+static void ring_teardown(struct hwacc_drvdata *drvdata)
 {
-  BufferSet* resultSet;
+  HwaccRings *rings = drvdata->rings;
+  unsigned long flags;
 
-  TRACE("pend_processed: begin for bufferset %d\n", id);
+  if (drvdata->ring_thread) {
+    kthread_stop(drvdata->ring_thread);
+    drvdata->ring_thread = NULL;
+  }
+
+  // Frames still in flight will find the rings gone and drop their CQEs
+  spin_lock_irqsave(&drvdata->cq_lock, flags);
+  drvdata->rings = NULL;
+  spin_unlock_irqrestore(&drvdata->cq_lock, flags);
+  vfree(rings);
+}
 
-  // Block until a completed buffer becomes available
-  wait_event_interruptible(drvdata->processing_finished,
-                           buffer_hasid(&drvdata->complete_list, id));
+/* RING_ENTER: submits whatever is in the submission ring (or wakes the
+ * polling thread to do it), then optionally waits until there are at least
+ * min_complete entries in the completion ring.
+ * Returns the number of entries submitted by this call.
+ */
+static int ring_enter(struct hwacc_drvdata *drvdata, unsigned int min_complete)
+{
+  HwaccRings *rings = smp_load_acquire(&drvdata->rings);
+  int n = 0;
 
-  // Remove the buffer
-  resultSet = buffer_dequeueid(&drvdata->complete_list, id);
-  if(resultSet == NULL){
-    ERROR("buffer_dequeue for id %d failed!\n", id);
-    return;
+  if (rings == NULL) {
+    return(-EINVAL);
   }
 
-  // Put the buffer set back on the free list
-  buffer_enqueue(&drvdata->free_list, resultSet);
-  wake_up_interruptible(&drvdata->buffer_free_queue);
+  if (drvdata->ring_thread) {
+    wake_up_interruptible(&drvdata->ring_wait);
+  } else {
+    n = ring_consume_sq(drvdata);
+  }
 
-  TRACE("pend_processed: return for bufferset %d\n", id);
+  min_complete = min(min_complete, (unsigned int)HWACC_RING_ENTRIES);
+  if (min_complete > 0 &&
+      wait_event_interruptible(drvdata->processing_finished,
+                               ring_cq_ready(rings) >= min_complete)) {
+    return(-ERESTARTSYS);
+  }
+  return(n);
 }
 
 long dev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
@@ -586,8 +2190,9 @@ long dev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
         struct hwacc_drvdata *drvdata = filp->private_data;
         struct dma_chan *chan;
         size_t bsize = sizeof(Buffer);
+        size_t isize = sizeof(ImportBuffer);
         int retval, i;
-        Buffer tmp_buf[drvdata->nr_channels];
+        ImportBuffer tmp_buf[drvdata->nr_channels];
 
         DEBUG("ioctl cmd %d | %lu (%lx) \n", cmd, arg, arg);
         switch (cmd) {
@@ -601,22 +2206,59 @@ long dev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
                                         /* copy_from_user return non-zero
                                          * upon error
                                          */
-                                        if (copy_from_user(&tmp_buf[i],
+                                        if (copy_from_user(&tmp_buf[i].buf,
                                                            (void*)(arg +
                                                                    i * bsize),
                                                            bsize)) {
                                                 retval = -EIO;
                                                 goto failed;
                                         }
+                                        tmp_buf[i].type = IMPORT_CMA;
                                 }
-                                return process_image(drvdata, tmp_buf);
+                                return process_image(drvdata, tmp_buf, NULL, NULL, NULL);
                         }
                         /* cannot read or copy */
                         retval = -EIO;
                         goto failed;
+                case PROCESS_IMPORT:
+                        TRACE("ioctl: PROCESS_IMPORT\n");
+                        if (copy_from_user(tmp_buf, (void*)arg,
+                                           drvdata->nr_channels * isize)) {
+                                retval = -EIO;
+                                goto failed;
+                        }
+                        return process_image(drvdata, tmp_buf, NULL, NULL, NULL);
                 case PEND_PROCESSED:
                         TRACE("ioctl: PEND_PROCESSED\n");
-                        pend_processed(drvdata, arg);
+                        return pend_processed(drvdata, arg);
+                case PROCESS_REGS:
+                        TRACE("ioctl: PROCESS_REGS\n");
+                        return process_regs(drvdata, arg);
+                case PROCESS_IMAGE_BATCH:
+                        TRACE("ioctl: PROCESS_IMAGE_BATCH\n");
+                        return process_batch(drvdata, arg);
+                case PROCESS_TILED:
+                        TRACE("ioctl: PROCESS_TILED\n");
+                        return process_tiled(drvdata, arg);
+                case GET_GEOMETRY:
+                        TRACE("ioctl: GET_GEOMETRY\n");
+                        return get_geometry(drvdata, arg);
+                case READ_TIMER:
+                        TRACE("ioctl: READ_TIMER\n");
+                        return read_timer(drvdata, arg);
+                case PEND_PROCESSED_ANY:
+                        TRACE("ioctl: PEND_PROCESSED_ANY\n");
+                        return pend_processed_any(drvdata, filp, arg);
+                case RING_SETUP:
+                        TRACE("ioctl: RING_SETUP\n");
+                        return ring_setup(drvdata, arg);
+                case RING_ENTER:
+                        TRACE("ioctl: RING_ENTER\n");
+                        return ring_enter(drvdata, arg);
+                case SET_POLL_BUDGET:
+                        TRACE("ioctl: SET_POLL_BUDGET %lu\n", arg);
+                        /* a millisecond is already far longer than a tile */
+                        drvdata->poll_budget_us = min(arg, 1000UL);
                         return 0;
                 default:
                         retval = -EINVAL; /* unknown command, return an error */
@@ -632,6 +2274,14 @@ int dev_mmap(struct file *filp, struct vm_area_struct *vma)
   struct hwacc_drvdata *drvdata = filp->private_data;
   uintptr_t controller = (uintptr_t)drvdata->hls_controller;
 
+  // The shared rings live at their own offset, away from the registers
+  if(vma->vm_pgoff == (HWACC_RINGS_MMAP_OFFSET >> PAGE_SHIFT)){
+    if(drvdata->rings == NULL){
+      return -EINVAL;
+    }
+    return remap_vmalloc_range(vma, drvdata->rings, 0);
+  }
+
   physical_pfn = (controller >> PAGE_SHIFT) + vma->vm_pgoff; // Physical page
   vsize = vma->vm_end - vma->vm_start; // Requested virtual size (in bytes)
 
@@ -646,58 +2296,344 @@ int dev_mmap(struct file *filp, struct vm_area_struct *vma)
   return(0);
 }
 
+/* Readable when a finished frame is waiting (so PEND_PROCESSED_ANY won't
+ * block), and writable when a BufferSet is free (so PROCESS_IMAGE won't).
+ * This lets the accelerator sit in an epoll set with the camera and sockets.
+ */
+unsigned int dev_poll(struct file *filp, poll_table *wait)
+{
+  struct hwacc_drvdata *drvdata = filp->private_data;
+  unsigned int mask = 0;
+
+  poll_wait(filp, &drvdata->processing_finished, wait);
+  poll_wait(filp, &drvdata->buffer_free_queue, wait);
+
+  if(any_collectable(drvdata) ||
+     (drvdata->rings && ring_cq_ready(drvdata->rings) > 0)){
+    mask |= POLLIN | POLLRDNORM;
+  }
+  if(!buffer_listempty(&drvdata->free_list)){
+    mask |= POLLOUT | POLLWRNORM;
+  }
+  return(mask);
+}
+
+/* The debugfs gauges: how many BufferSets are in each state, and the DMA
+ * status register from the last error interrupt
+ */
+static void hwacc_show_gauges(struct seq_file *s, void *data)
+{
+  struct hwacc_drvdata *drvdata = data;
+
+  seq_printf(s, "sets_free %d\n", buffer_listcount(&drvdata->free_list));
+  seq_printf(s, "sets_queued %d\n", buffer_listcount(&drvdata->queued_list));
+  seq_printf(s, "sets_processing %d\n",
+             buffer_listcount(&drvdata->processing_list));
+  seq_printf(s, "sets_complete %d\n", atomic_read(&drvdata->nr_complete));
+  seq_printf(s, "ring_inflight %d\n", atomic_read(&drvdata->ring_inflight));
+  seq_printf(s, "last_dma_error 0x%08x\n", drvdata->last_dma_error);
+}
+
+#define HWACC_STAT(drvdata, field) \
+  stat_sum((drvdata)->stats, offsetof(struct hwacc_stats, field))
+
+/* Driver statistics, in /sys/class/hwacc/hwacc<n>/stats.  These are the
+ * same per-CPU counters as debugfs, which has the rest of them.
+ */
+static ssize_t pend_wakeups_show(struct device *dev,
+                                 struct device_attribute *attr, char *buf)
+{
+  struct hwacc_drvdata *drvdata = dev_get_drvdata(dev);
+  return(sprintf(buf, "%llu\n", HWACC_STAT(drvdata, pend_wakeups)));
+}
+static DEVICE_ATTR_RO(pend_wakeups);
+
+static ssize_t pend_spurious_wakeups_show(struct device *dev,
+                                          struct device_attribute *attr,
+                                          char *buf)
+{
+  struct hwacc_drvdata *drvdata = dev_get_drvdata(dev);
+  return(sprintf(buf, "%llu\n", HWACC_STAT(drvdata, pend_spurious_wakeups)));
+}
+static DEVICE_ATTR_RO(pend_spurious_wakeups);
+
+/* One line per bucket: the lower bound in microseconds, and the count */
+static ssize_t lat_hist_show(struct hwacc_drvdata *drvdata, size_t offset,
+                             char *buf)
+{
+  int b;
+  ssize_t len = 0;
+
+  for (b = 0; b < STAT_HIST_BUCKETS; b++) {
+    len += sprintf(buf + len, "%lu %llu\n", stat_hist_bound(b),
+                   stat_hist_sum(drvdata->stats, offset, b));
+  }
+  return(len);
+}
+
+#define LAT_HIST_ATTR(name) \
+static ssize_t name##_show(struct device *dev, \
+                           struct device_attribute *attr, char *buf) \
+{ \
+  struct hwacc_drvdata *drvdata = dev_get_drvdata(dev); \
+  return(lat_hist_show(drvdata, offsetof(struct hwacc_stats, name), buf)); \
+} \
+static DEVICE_ATTR_RO(name)
+
+LAT_HIST_ATTR(lat_queue);
+LAT_HIST_ATTR(lat_hw);
+LAT_HIST_ATTR(lat_irq);
+LAT_HIST_ATTR(lat_wake);
+
+static ssize_t completions_polled_show(struct device *dev,
+                                       struct device_attribute *attr,
+                                       char *buf)
+{
+  struct hwacc_drvdata *drvdata = dev_get_drvdata(dev);
+  return(sprintf(buf, "%llu\n", HWACC_STAT(drvdata, completions_polled)));
+}
+static DEVICE_ATTR_RO(completions_polled);
+
+static ssize_t completions_irq_show(struct device *dev,
+                                    struct device_attribute *attr, char *buf)
+{
+  struct hwacc_drvdata *drvdata = dev_get_drvdata(dev);
+  return(sprintf(buf, "%llu\n", HWACC_STAT(drvdata, completions_irq)));
+}
+static DEVICE_ATTR_RO(completions_irq);
+
+static struct attribute *hwacc_stats_attrs[] = {
+  &dev_attr_pend_wakeups.attr,
+  &dev_attr_pend_spurious_wakeups.attr,
+  &dev_attr_completions_polled.attr,
+  &dev_attr_completions_irq.attr,
+  &dev_attr_lat_queue.attr,
+  &dev_attr_lat_hw.attr,
+  &dev_attr_lat_irq.attr,
+  &dev_attr_lat_wake.attr,
+  NULL,
+};
+
+static const struct attribute_group hwacc_stats_group = {
+  .name = "stats",
+  .attrs = hwacc_stats_attrs,
+};
+
+/* Applies the coalescing settings to every channel, running or not.
+ * Called with coalesce_mutex held.
+ */
+static void apply_irq_coalescing(struct hwacc_drvdata *drvdata)
+{
+  int i;
+  unsigned long flags;
+  struct dma_chan *chan;
+
+  for (i = 0; i < drvdata->nr_channels; i++) {
+    chan = drvdata->chan[i];
+    spin_lock_irqsave(&chan->ring_lock, flags);
+    dma_ring_set_irq(&chan->ring, chan->controller,
+                     drvdata->irq_threshold, drvdata->irq_delay);
+    spin_unlock_irqrestore(&chan->ring_lock, flags);
+  }
+}
+
+/* Interrupt coalescing, in /sys/class/hwacc/hwacc<n>/irq_threshold and
+ * irq_delay.  The threshold counts completed packets, not descriptors; each
+ * frame is one packet on each channel, so it is frames per interrupt.
+ * A threshold above 1 needs the delay timer as well, or the last
+ * few frames of a burst would never interrupt; set irq_delay first.
+ */
+static ssize_t irq_threshold_show(struct device *dev,
+                                  struct device_attribute *attr, char *buf)
+{
+  struct hwacc_drvdata *drvdata = dev_get_drvdata(dev);
+  return(sprintf(buf, "%u\n", drvdata->irq_threshold));
+}
+
+static ssize_t irq_threshold_store(struct device *dev,
+                                   struct device_attribute *attr,
+                                   const char *buf, size_t count)
+{
+  struct hwacc_drvdata *drvdata = dev_get_drvdata(dev);
+  unsigned int val;
+
+  if (kstrtouint(buf, 0, &val) || val < 1 || val > 255) {
+    return(-EINVAL);
+  }
+  mutex_lock(&drvdata->coalesce_mutex);
+  if (val > 1 && drvdata->irq_delay == 0) {
+    mutex_unlock(&drvdata->coalesce_mutex);
+    return(-EINVAL);
+  }
+  drvdata->irq_threshold = val;
+  apply_irq_coalescing(drvdata);
+  mutex_unlock(&drvdata->coalesce_mutex);
+  return(count);
+}
+static DEVICE_ATTR_RW(irq_threshold);
+
+static ssize_t irq_delay_show(struct device *dev,
+                              struct device_attribute *attr, char *buf)
+{
+  struct hwacc_drvdata *drvdata = dev_get_drvdata(dev);
+  return(sprintf(buf, "%u\n", drvdata->irq_delay));
+}
+
+static ssize_t irq_delay_store(struct device *dev,
+                               struct device_attribute *attr,
+                               const char *buf, size_t count)
+{
+  struct hwacc_drvdata *drvdata = dev_get_drvdata(dev);
+  unsigned int val;
+
+  if (kstrtouint(buf, 0, &val) || val > 255) {
+    return(-EINVAL);
+  }
+  mutex_lock(&drvdata->coalesce_mutex);
+  if (val == 0 && drvdata->irq_threshold > 1) {
+    mutex_unlock(&drvdata->coalesce_mutex);
+    return(-EINVAL);
+  }
+  drvdata->irq_delay = val;
+  apply_irq_coalescing(drvdata);
+  mutex_unlock(&drvdata->coalesce_mutex);
+  return(count);
+}
+static DEVICE_ATTR_RW(irq_delay);
+
+static struct attribute *hwacc_attrs[] = {
+  &dev_attr_irq_threshold.attr,
+  &dev_attr_irq_delay.attr,
+  NULL,
+};
+
+static const struct attribute_group hwacc_group = {
+  .attrs = hwacc_attrs,
+};
+
+/* One line per channel, in PROCESS_IMAGE order: "in|out width height depth" */
+static ssize_t channels_show(struct device *dev,
+                             struct device_attribute *attr, char *buf)
+{
+  struct hwacc_drvdata *drvdata = dev_get_drvdata(dev);
+  struct dma_chan *chan;
+  ssize_t len = 0;
+  int i;
+
+  for (i = 0; i < drvdata->nr_channels; i++) {
+    chan = drvdata->chan[i];
+    len += sprintf(buf + len, "%s %u %u %u\n", chan->input_chan ? "in" : "out",
+                   chan->width, chan->height, chan->depth);
+  }
+  return(len);
+}
+static DEVICE_ATTR_RO(channels);
+
+/* One line per tap register: "name offset width" */
+static ssize_t taps_show(struct device *dev,
+                         struct device_attribute *attr, char *buf)
+{
+  struct hwacc_drvdata *drvdata = dev_get_drvdata(dev);
+  ssize_t len = 0;
+  int i;
+
+  for (i = 0; i < drvdata->nr_taps; i++) {
+    len += sprintf(buf + len, "%s 0x%x %u\n", drvdata->taps[i].name,
+                   drvdata->taps[i].offset, drvdata->taps[i].width);
+  }
+  return(len);
+}
+static DEVICE_ATTR_RO(taps);
+
+static struct attribute *hwacc_geometry_attrs[] = {
+  &dev_attr_channels.attr,
+  &dev_attr_taps.attr,
+  NULL,
+};
+
+static const struct attribute_group hwacc_geometry_group = {
+  .name = "geometry",
+  .attrs = hwacc_geometry_attrs,
+};
+
+static const struct attribute_group *hwacc_groups[] = {
+  &hwacc_group,
+  &hwacc_stats_group,
+  &hwacc_geometry_group,
+  NULL,
+};
+
 struct file_operations fops = {
   // No read/write; everything is handled by ioctl and mmap
   .open = dev_open,
   .release = dev_close,
   .unlocked_ioctl = dev_ioctl,
   .mmap = dev_mmap,
+  .poll = dev_poll,
 };
 
 static irqreturn_t dma_irq_handler(int irq, void *data)
 {
         struct dma_chan *chan = data;
-        struct hwacc_drvdata *drvdata = chan->drvdata;
+        bool claimed;
+        u32 sr;
 
         /* we need to distinguish between input and output channel */
         if (chan->input_chan) {
                 /* acknowledge/clear interrupt */
-                iowrite32(0x00007000, chan->controller + 0x04);
+                sr = ioread32(chan->controller + DMA_SR);
+                iowrite32(DMA_SR_IRQS, chan->controller + DMA_SR);
+                stat_inc(chan->drvdata->stats, irq_in);
+                if (sr & DMA_SR_ERR_IRQ)
+                        count_dma_errors(chan->drvdata, sr);
+                trace_hwacc_chan_irq(chan->id, true, true);
                 wake_up_interruptible(&chan->wq);
                 //DEBUG("irq: DMA channel %d finished.\n", chan->id);
 
                 return IRQ_HANDLED;
         } else {
-                iowrite32(0x00007000, chan->controller + 0x04);
+                /*
+                 * a polling PEND_PROCESSED may have got here first.  That's
+                 * still handled, or the kernel would decide the line was
+                 * stuck and disable it while polling is winning.
+                 */
+                claimed = claim_output_irq(chan);
+                trace_hwacc_chan_irq(chan->id, false, claimed);
+                stat_inc(chan->drvdata->stats, irq_out);
+                if (!claimed) {
+                        stat_inc(chan->drvdata->stats, irq_unclaimed);
+                        return IRQ_HANDLED;
+                }
+                chan->irq_time = ktime_get();
                 /* the next processing action can now start */
                 wake_up_interruptible(&chan->wq);
                 TRACE("irq: DMA chan: %d finished.\n", chan->id);
-
-                /* keep an explicit count of the number of buffers, to cover
-                 * the rare(hopefully impossible) case where a second buffer
-                 * finished before the work queue task actually executes. This
-                 * would cause dma_finished_work to only execute once, when it
-                 * was queued twice.
-                 */
-                atomic_inc(&drvdata->finished_count);
-                /* delegate the work of moving the buffer from "PROCESSING" to
-                 * "FINISHED".
-                 * We can't do it here, since we're in an atomic context and
-                 * trying to lock access to the list could cause us to block.
-                 */
-                DEBUG("irq: Launching workqueue to complete processing\n");
-                /* launch a work queue task to write this to the DMA */
-                schedule_work(&drvdata->finished_work);
-                return 0;
+                return IRQ_WAKE_THREAD;
         }
 }
 
+/*
+ * Threaded half of the output channel's interrupt, which moves frames from
+ * "PROCESSING" to "COMPLETE".  IRQ threads are SCHED_FIFO, and this one
+ * runs wherever the IRQ's affinity (rt_cpu) says.
+ */
+static irqreturn_t dma_irq_thread(int irq, void *data)
+{
+        struct dma_chan *chan = data;
+        struct hwacc_drvdata *drvdata = chan->drvdata;
+
+        drain_frames(drvdata, false, READ_ONCE(chan->irq_time));
+        return IRQ_HANDLED;
+}
+
 static int dma_chan_probe(struct device_node *node,
                            struct hwacc_drvdata *drvdata,
                            int chan_id)
 {
         struct dma_chan *chan;
         struct device *dev = &drvdata->pdev->dev;
+        struct device_node *parent;
+        u32 geom[3];
         int retval;
 
         chan = devm_kzalloc(dev, sizeof(*chan), GFP_KERNEL);
@@ -708,6 +2644,7 @@ static int dma_chan_probe(struct device_node *node,
         chan->drvdata = drvdata;
         chan->dev = dev;
         chan->id = chan_id;
+        spin_lock_init(&chan->irq_lock); /* before the IRQ can fire */
 
         /* based on the naming to determine data flow direction */
 	    if (of_device_is_compatible(node, "xlnx,axi-dma-mm2s-channel")) {
@@ -720,10 +2657,22 @@ static int dma_chan_probe(struct device_node *node,
                 goto failed0;
         }
 
+        /* stream geometry, which dtconfig.py puts on the DMA node itself */
+        parent = of_get_parent(node);
+        if (of_property_read_u32_array(parent, chan->input_chan ?
+                                       "input-geometry" : "output-geometry",
+                                       geom, 3) == 0) {
+                chan->width = geom[0];
+                chan->height = geom[1];
+                chan->depth = geom[2];
+        }
+        of_node_put(parent);
+
         /* request IRQ */
         chan->irq = irq_of_parse_and_map(node, 0);
-        retval = request_irq(chan->irq, dma_irq_handler, IRQF_SHARED,
-                             "dma-irq-handler", chan);
+        retval = request_threaded_irq(chan->irq, dma_irq_handler,
+                                      chan->input_chan ? NULL : dma_irq_thread,
+                                      IRQF_SHARED, "dma-irq-handler", chan);
         DEBUG("chan: %d irq->%d input?: %d\n", chan_id, chan->irq,
               chan->input_chan);
         if (retval < 0) {
@@ -731,6 +2680,8 @@ static int dma_chan_probe(struct device_node *node,
                         chan_id);
                 goto failed0;
         }
+        if (rt_cpu >= 0 && !chan->input_chan)
+                irq_set_affinity_hint(chan->irq, cpumask_of(rt_cpu));
 
         /*
          * we don't do ioremap for individual channels. instead we calculate
@@ -754,6 +2705,7 @@ static int dma_chan_probe(struct device_node *node,
 
         /* set up wait queue using macro */
         chan->wq = (wait_queue_head_t)__WAIT_QUEUE_HEAD_INITIALIZER(chan->wq);
+        spin_lock_init(&chan->ring_lock);
 
         /* save to drvdata chan list */
         drvdata->chan[chan->id] = chan;
@@ -761,6 +2713,7 @@ static int dma_chan_probe(struct device_node *node,
         return 0;
 
 failed1:
+        irq_set_affinity_hint(chan->irq, NULL);
         free_irq(chan->irq, chan);
 
 failed0:
@@ -771,6 +2724,7 @@ static int dma_chan_remove(struct dma_chan *chan)
 {
         DEBUG("remove chan: %d irq: %d\n", chan->id, chan->irq);
         /* free irq */
+        irq_set_affinity_hint(chan->irq, NULL);
         free_irq(chan->irq, chan);
 
         /* no need to free memory since chan is allocated based on dev */
@@ -885,6 +2839,43 @@ failed0:
         return retval;
 }
 
+/*
+ * Reads the accelerator's tap register layout (tap-names, tap-offsets and
+ * tap-widths, from dtconfig.py).  Older device trees don't have it, which
+ * just leaves no taps.
+ */
+static void read_taps(struct hwacc_drvdata *drvdata)
+{
+        struct device_node *node = drvdata->pdev->dev.of_node;
+        const char *name;
+        HwaccTap *tap;
+        int i, n;
+
+        n = of_property_count_strings(node, "tap-names");
+        if (n <= 0)
+                return;
+        if (n > HWACC_MAX_TAPS) {
+                dev_warn(&drvdata->pdev->dev, "only using %d of %d taps\n",
+                         HWACC_MAX_TAPS, n);
+                n = HWACC_MAX_TAPS;
+        }
+
+        for (i = 0; i < n; i++) {
+                tap = &drvdata->taps[i];
+                if (of_property_read_string_index(node, "tap-names", i, &name) ||
+                    of_property_read_u32_index(node, "tap-offsets", i,
+                                               &tap->offset) ||
+                    of_property_read_u32_index(node, "tap-widths", i,
+                                               &tap->width)) {
+                        dev_err(&drvdata->pdev->dev,
+                                "tap %d is missing its offset or width\n", i);
+                        break;
+                }
+                strlcpy(tap->name, name, HWACC_TAP_NAME_LEN);
+        }
+        drvdata->nr_taps = i;
+}
+
 static int find_set_gpio(struct hwacc_drvdata *drvdata)
 {
         struct platform_device *pdev = drvdata->pdev, *gpio;
@@ -936,6 +2927,21 @@ static int hwacc_probe(struct platform_device *pdev)
         atomic_set(&drvdata->usage_count, 0);
         init_waitqueue_head(&drvdata->processing_finished);
         init_waitqueue_head(&drvdata->buffer_free_queue);
+        init_waitqueue_head(&drvdata->ring_wait);
+        mutex_init(&drvdata->ring_mutex);
+        spin_lock_init(&drvdata->cq_lock);
+        spin_lock_init(&drvdata->claim_lock);
+        mutex_init(&drvdata->reap_mutex);
+        mutex_init(&drvdata->coalesce_mutex);
+        drvdata->irq_threshold = 1; /* an interrupt for every frame */
+        drvdata->irq_delay = 0;
+
+        /* before any of the interrupts are requested */
+        drvdata->stats = devm_alloc_percpu(&pdev->dev, struct hwacc_stats);
+        if (!drvdata->stats) {
+                retval = -ENOMEM;
+                goto failed0;
+        }
 
         /* request and map I/O memory  for hwacc*/
         io = platform_get_resource(pdev, IORESOURCE_MEM, 0);
@@ -966,20 +2972,16 @@ static int hwacc_probe(struct platform_device *pdev)
         if (retval < 0)
                 goto failed0;
 
+        read_taps(drvdata);
+
         /* set up buffer list */
         retval = setup_buffer_list(drvdata);
         if (retval < 0)
                 goto failed0;
 
-        /* manually setup the work queue because we want to pass drvdata
-         * into the callback.
-         * corresponding structures that get put in the queues.
-         * we only need one instance, since we're simply launching work,
-         * not queuing up a bunch of tasks.
-         */
-
-        INIT_WORK(&drvdata->launch_work, dma_launch_work);
-        INIT_WORK(&drvdata->finished_work, dma_finished_work);
+        /* the launch thread itself is started on open */
+        init_waitqueue_head(&drvdata->launch_wait);
+        init_waitqueue_head(&drvdata->hls_wait);
 
         /* Get a single character device number */
         alloc_chrdev_region(&drvdata->device_num, 0, 1, DEVNAME);
@@ -1004,10 +3006,21 @@ static int hwacc_probe(struct platform_device *pdev)
                 goto failed1;
         }
 
-        drvdata->pipe_dev = device_create(pipe_class, &pdev->dev,
-                                          drvdata->device_num, 0,
+        drvdata->pipe_dev = device_create_with_groups(pipe_class, &pdev->dev,
+                                          drvdata->device_num, drvdata,
+                                          hwacc_groups,
                                           DEVNAME "%d", drvdata->dev_index);
 
+        drvdata->stats_debugfs.stats = drvdata->stats;
+        drvdata->stats_debugfs.size = sizeof(struct hwacc_stats);
+        drvdata->stats_debugfs.fields = hwacc_stat_fields;
+        drvdata->stats_debugfs.nr_fields = ARRAY_SIZE(hwacc_stat_fields);
+        drvdata->stats_debugfs.show_gauges = hwacc_show_gauges;
+        drvdata->stats_debugfs.data = drvdata;
+        drvdata->debugfs = stats_debugfs_create(dev_name(drvdata->pipe_dev),
+                                                hwacc_debugfs_root,
+                                                &drvdata->stats_debugfs);
+
         /* register the driver with the kernel */
         cdev_init(&drvdata->cdev, &fops);
         drvdata->cdev.owner = THIS_MODULE;
@@ -1035,6 +3048,8 @@ static int hwacc_remove(struct platform_device *pdev)
         int i;
         struct hwacc_drvdata *drvdata = platform_get_drvdata(pdev);
 
+        debugfs_remove_recursive(drvdata->debugfs);
+
         /* clear each channel */
         for (i = 0; i < drvdata->nr_channels; i++) {
                 if (drvdata->chan[i])
@@ -1078,6 +3093,12 @@ static int uevent(struct device *dev, struct kobj_uevent_env *env)
 
 static int __init hwacc_init(void)
 {
+        debug_level_init();
+        hwacc_debugfs_root = debugfs_create_dir("hwacc", NULL);
+        /* without it, READ_TIMER just gives zeros */
+        ttc_regs = ioremap(TTC_REG_BASE, TTC_REG_SIZE);
+        if (!ttc_regs)
+                WARNING("couldn't map the TTC; READ_TIMER won't work\n");
         pipe_class = class_create(THIS_MODULE, CLASSNAME);
         /* allow non-root access */
         pipe_class->dev_uevent = uevent;
@@ -1089,6 +3110,9 @@ static void __exit hwacc_exit(void)
         platform_driver_unregister(&hwacc_driver);
         /* class destory has to happen after unregister */
         class_destroy(pipe_class);
+        debugfs_remove_recursive(hwacc_debugfs_root);
+        if (ttc_regs)
+                iounmap(ttc_regs);
 }
 
 /*
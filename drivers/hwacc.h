@@ -0,0 +1,199 @@
+/* hwacc.h
+ * Structures passed between user code and the hwacc driver through ioctl().
+ * The basic PROCESS_IMAGE/PEND_PROCESSED calls just take Buffers; everything
+ * here is for the extended calls.
+ */
+
+#ifndef _HWACC_H_
+#define _HWACC_H_
+
+#include "buffer.h"
+
+/* Where the data for an ImportBuffer lives */
+#define IMPORT_CMA 0 // A cmabuffer Buffer; same as PROCESS_IMAGE
+#define IMPORT_DMABUF 1 // A dma-buf from another driver, by file descriptor
+#define IMPORT_USERPTR 2 // Ordinary user memory, which is pinned for the transfer
+
+/* One channel's worth of data for PROCESS_IMPORT.  The image geometry always
+ * comes from buf; phys_addr is only used for IMPORT_CMA.
+ */
+typedef struct ImportBuffer
+{
+  unsigned int type; // One of the IMPORT_ constants above
+  int fd; // dma-buf file descriptor, for IMPORT_DMABUF
+  unsigned long offset; // Byte offset of the image within the dma-buf
+  unsigned long user_addr; // Start of the image in user memory, for IMPORT_USERPTR
+  Buffer buf;
+} ImportBuffer;
+
+/* Argument for PROCESS_IMAGE_BATCH.  bufs holds count frames back to back,
+ * each laid out the same as for PROCESS_IMAGE (one Buffer per channel).
+ * The driver takes at most 16 frames per call; count comes back as the number
+ * actually submitted, and ids gets the id of each one.
+ */
+typedef struct HwaccBatch
+{
+  unsigned int count;
+  Buffer* bufs;
+  int* ids;
+} HwaccBatch;
+
+/* Argument for PEND_PROCESSED_ANY.  Blocks until at least one frame is done
+ * (unless the device was opened O_NONBLOCK), then fills in the ids of up to
+ * max finished frames and sets count.  The frames are released just as with
+ * PEND_PROCESSED.  A frame which was lost to a DMA error (where
+ * PEND_PROCESSED would return EIO) has HWACC_FRAME_FAILED set in its id.
+ * Frames which a PEND_PROCESSED is already waiting for are left to it.
+ */
+#define HWACC_FRAME_FAILED 0x10000
+
+typedef struct HwaccReap
+{
+  unsigned int max;
+  unsigned int count;
+  int* ids;
+} HwaccReap;
+
+/* Argument for PROCESS_TILED.  in and out are cmabuffer Buffers for a whole
+ * image, which is usually far bigger than the accelerator takes.  The driver
+ * cuts them into tile_width x tile_height input tiles overlapping by 2*halo,
+ * runs every tile, and writes each tile's output into its place in out, so
+ * out must be 2*halo smaller than in each way.  One input and one output
+ * channel only.  The call returns once the whole image is done, with tiles
+ * set to the number of tiles it took.
+ */
+typedef struct HwaccTiled
+{
+  Buffer in;
+  Buffer out;
+  unsigned int tile_width;
+  unsigned int tile_height;
+  unsigned int halo;
+  unsigned int tiles;
+} HwaccTiled;
+
+/* Argument for GET_GEOMETRY: what the accelerator was built for, from the
+ * device tree.  chan is in the same order as the Buffers for PROCESS_IMAGE.
+ * A stream whose size wasn't in the hardware configuration reads as 0x0.
+ * taps are the accelerator's own AXI-Lite registers, past the control block.
+ */
+#define HWACC_MAX_CHANNELS 8
+#define HWACC_MAX_TAPS 16
+#define HWACC_TAP_NAME_LEN 32
+
+typedef struct HwaccStream
+{
+  unsigned int input; // 1 for data into the accelerator, 0 for results
+  unsigned int width;
+  unsigned int height;
+  unsigned int depth; // Bytes per pixel
+} HwaccStream;
+
+typedef struct HwaccTap
+{
+  char name[HWACC_TAP_NAME_LEN];
+  unsigned int offset; // Byte offset from the start of the accelerator's registers
+  unsigned int width; // In bits
+} HwaccTap;
+
+typedef struct HwaccGeometry
+{
+  unsigned int nr_channels;
+  HwaccStream chan[HWACC_MAX_CHANNELS];
+  unsigned int nr_taps;
+  HwaccTap taps[HWACC_MAX_TAPS];
+} HwaccGeometry;
+
+/* Argument for READ_TIMER: when a frame went to the hardware and when it came
+ * back, on the triple-timer clock (TTC1) which f4runtime's ttc_clock_now()
+ * reads, so they line up with the R5's camera timestamps.  Set id to what
+ * PROCESS_IMAGE returned.  kick is when the frame's descriptors were handed
+ * to the DMA engines, and done is when the driver found it finished (in the
+ * output interrupt's thread, or in a polling PEND_PROCESSED).
+ * Both are raw 100MHz counts; divide by HWACC_TTC_TICKS_PER_US for a Time.
+ * They stay put until the id is submitted again, so read them after
+ * PEND_PROCESSED; reading a frame which is still queued or running gives
+ * EBUSY.  Both are 0 if the clock couldn't be mapped.
+ */
+#define HWACC_TTC_TICKS_PER_US 100
+
+typedef struct HwaccTimer
+{
+  int id;
+  unsigned long long kick;
+  unsigned long long done;
+} HwaccTimer;
+
+/* Argument for PROCESS_REGS: a PROCESS_IMAGE frame (bufs, one Buffer per
+ * channel) plus writes to the accelerator's own registers, such as the taps
+ * from GET_GEOMETRY, so thresholds and gains can change from one frame to
+ * the next without draining the pipeline.  The driver stores the writes with
+ * the frame and makes them between the core starting the frame before and
+ * its ap_start for this one.  The core latches its registers as it starts
+ * each frame, so the values apply to exactly this frame, and later frames
+ * keep them until they're written again.  offset is in bytes from the start
+ * of the registers, past the control block, and must land in a tap if the
+ * device tree lists any.  No flags are defined yet; flags must be 0.
+ */
+#define HWACC_MAX_REG_WRITES 16
+
+typedef struct HwaccRegWrite
+{
+  unsigned int offset;
+  unsigned int value;
+} HwaccRegWrite;
+
+typedef struct HwaccFrameRegs
+{
+  Buffer* bufs;
+  unsigned int flags; // Reserved, must be 0
+  unsigned int nr_writes;
+  HwaccRegWrite writes[HWACC_MAX_REG_WRITES];
+} HwaccFrameRegs;
+
+/* Shared submission/completion rings (RING_SETUP, RING_ENTER).
+ *
+ * After RING_SETUP, mmap HwaccRings at HWACC_RINGS_MMAP_OFFSET.  To submit,
+ * fill in sq[sq_tail % HWACC_RING_ENTRIES] and then advance sq_tail; the
+ * driver takes entries from sq_head.  Finished frames appear in cq between
+ * cq_head and cq_tail, and user space advances cq_head once it has read them.
+ * Each side only writes its own index, but the loads of the other side's
+ * index need acquire ordering and the stores of its own release ordering
+ * (e.g., __atomic_load_n(..., __ATOMIC_ACQUIRE)).
+ *
+ * Without HWACC_RING_SQPOLL, RING_ENTER hands everything in the submission
+ * ring to the driver.  With it, a kernel thread watches the ring, and
+ * RING_ENTER is only needed when HWACC_RING_NEED_WAKEUP is set in flags
+ * (checked after a full barrier following the sq_tail update).
+ */
+#define HWACC_RING_ENTRIES 64
+#define HWACC_RING_MAX_CHANNELS 4
+#define HWACC_RINGS_MMAP_OFFSET 0x10000000
+
+#define HWACC_RING_SQPOLL 0x1 // RING_SETUP flag: start a polling thread
+#define HWACC_RING_NEED_WAKEUP 0x1 // In HwaccRings.flags: polling thread is asleep
+
+typedef struct HwaccSqe
+{
+  Buffer bufs[HWACC_RING_MAX_CHANNELS]; // One per channel, as for PROCESS_IMAGE
+  unsigned int user_data; // Passed back untouched in the completion
+} HwaccSqe;
+
+typedef struct HwaccCqe
+{
+  int result; // BufferSet id, or a negative error if the frame never ran
+  unsigned int user_data;
+} HwaccCqe;
+
+typedef struct HwaccRings
+{
+  unsigned int sq_head; // Written by the driver
+  unsigned int sq_tail; // Written by user space
+  unsigned int cq_head; // Written by user space
+  unsigned int cq_tail; // Written by the driver
+  unsigned int flags; // Written by the driver
+  HwaccSqe sq[HWACC_RING_ENTRIES];
+  HwaccCqe cq[HWACC_RING_ENTRIES];
+} HwaccRings;
+
+#endif
@@ -0,0 +1,117 @@
+/* hwacc_trace.h
+ * Tracepoints for each stage a frame goes through in the hwacc driver, so
+ * ftrace or perf can break the latency down frame by frame:
+ *   set_dequeue   process_image() took a BufferSet from the free list
+ *   sg_build      ...built (or patched) the SG chains for it
+ *   set_queued    ...put it on the queued list for the launch thread
+ *   dma_kick      the launch thread handed it to the DMA engines
+ *   chan_irq      a DMA channel interrupted
+ *   set_complete  the frame was reaped, by the IRQ thread or a poller
+ *   pend_return   PEND_PROCESSED (or PEND_PROCESSED_ANY) handed it back
+ * e.g., echo 1 > /sys/kernel/debug/tracing/events/hwacc/enable
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM hwacc
+
+#if !defined(_HWACC_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _HWACC_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(hwacc_set,
+        TP_PROTO(int id),
+        TP_ARGS(id),
+        TP_STRUCT__entry(
+                __field(int, id)
+        ),
+        TP_fast_assign(
+                __entry->id = id;
+        ),
+        TP_printk("set=%d", __entry->id)
+);
+
+DEFINE_EVENT(hwacc_set, hwacc_set_dequeue,
+        TP_PROTO(int id),
+        TP_ARGS(id)
+);
+
+DEFINE_EVENT(hwacc_set, hwacc_set_queued,
+        TP_PROTO(int id),
+        TP_ARGS(id)
+);
+
+TRACE_EVENT(hwacc_sg_build,
+        TP_PROTO(int id, int nr_desc),
+        TP_ARGS(id, nr_desc),
+        TP_STRUCT__entry(
+                __field(int, id)
+                __field(int, nr_desc)
+        ),
+        TP_fast_assign(
+                __entry->id = id;
+                __entry->nr_desc = nr_desc;
+        ),
+        TP_printk("set=%d descriptors=%d", __entry->id, __entry->nr_desc)
+);
+
+TRACE_EVENT(hwacc_dma_kick,
+        TP_PROTO(int id, int slot),
+        TP_ARGS(id, slot),
+        TP_STRUCT__entry(
+                __field(int, id)
+                __field(int, slot)
+        ),
+        TP_fast_assign(
+                __entry->id = id;
+                __entry->slot = slot;
+        ),
+        TP_printk("set=%d slot=%d", __entry->id, __entry->slot)
+);
+
+TRACE_EVENT(hwacc_chan_irq,
+        TP_PROTO(int chan, bool input, bool claimed),
+        TP_ARGS(chan, input, claimed),
+        TP_STRUCT__entry(
+                __field(int, chan)
+                __field(bool, input)
+                __field(bool, claimed)
+        ),
+        TP_fast_assign(
+                __entry->chan = chan;
+                __entry->input = input;
+                __entry->claimed = claimed;
+        ),
+        TP_printk("chan=%d %s%s", __entry->chan,
+                  __entry->input ? "in" : "out",
+                  __entry->claimed ? "" : " (already claimed)")
+);
+
+TRACE_EVENT(hwacc_set_complete,
+        TP_PROTO(int id, bool polled),
+        TP_ARGS(id, polled),
+        TP_STRUCT__entry(
+                __field(int, id)
+                __field(bool, polled)
+        ),
+        TP_fast_assign(
+                __entry->id = id;
+                __entry->polled = polled;
+        ),
+        TP_printk("set=%d by %s", __entry->id,
+                  __entry->polled ? "poll" : "irq")
+);
+
+DEFINE_EVENT(hwacc_set, hwacc_pend_return,
+        TP_PROTO(int id),
+        TP_ARGS(id)
+);
+
+#endif /* _HWACC_TRACE_H_ */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE hwacc_trace
+#include <trace/define_trace.h>
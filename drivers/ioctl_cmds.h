@@ -4,10 +4,21 @@
 // TODO: switch these out for "proper" mostly-system-unique ioctl numbers
 #define GET_BUFFER 1000 // Get an unused buffer
 #define GRAB_IMAGE 1001 // Acquire image from camera
-#define FREE_IMAGE 1002 // Release buffer
+#define FREE_IMAGE 1002 // Release a buffer (a grabbed camera frame on either device)
 #define PROCESS_IMAGE 1003 // Push to stencil path
 #define PEND_PROCESSED 1004 // Retreive from stencil path
-#define READ_TIMER 1010 // Retreive hw timer count
+#define EXPORT_DMABUF 1005 // Export a buffer as a dma-buf; returns the new fd
+#define PROCESS_IMPORT 1006 // Push ImportBuffers (dma-bufs, user memory) to stencil path
+#define PROCESS_IMAGE_BATCH 1007 // Push several frames at once (HwaccBatch)
+#define PEND_PROCESSED_ANY 1008 // Retrieve whichever frames are done (HwaccReap)
+#define READ_TIMER 1010 // TTC timestamps for a finished frame (HwaccTimer)
+#define RING_SETUP 1011 // Create the shared rings; arg is HWACC_RING_ flags
+#define RING_ENTER 1012 // Submit from the shared ring; arg is completions to wait for
+#define SET_POLL_BUDGET 1013 // Microseconds PEND_PROCESSED spins before sleeping (0 = never)
+#define PROCESS_TILED 1014 // Run a large image through in tiles (HwaccTiled)
+#define GET_GEOMETRY 1015 // Stream sizes and tap registers (HwaccGeometry)
+#define SLICE_BUFFER 1016 // Region of a buffer, sharing its memory (BufferSlice)
+#define PROCESS_REGS 1017 // PROCESS_IMAGE plus accelerator register writes (HwaccFrameRegs)
 
 // TODO: set width, height?
 
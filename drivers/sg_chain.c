@@ -0,0 +1,126 @@
+/* sg_chain.c
+ * Scatter-gather descriptor chains for the hwacc DMA engines.
+ *
+ * Descriptor layout (PG021), in 32-bit words:
+ *   0-1  next descriptor pointer
+ *   2-3  buffer address
+ *   4    AxUSER|AxCACHE|TUSER|TID|TDEST (multichannel only)
+ *   5    VSIZE|stride (multichannel only)
+ *   6    SOF|EOF|length in bytes
+ *   7    status, written back by the DMA engine
+ */
+
+#ifdef __KERNEL__
+#include <linux/string.h>
+#else
+#include <stdbool.h>
+#include <string.h>
+#endif
+
+#include "sg_chain.h"
+
+void sg_chain_init(SGChain* chain, unsigned int* desc, unsigned long desc_phys, int max_desc)
+{
+  memset(chain, 0, sizeof(SGChain));
+  chain->desc = desc;
+  chain->desc_phys = desc_phys;
+  chain->max_desc = max_desc;
+  chain->mode = SG_CHAIN_NONE;
+}
+
+// One descriptor per row, so the padding at the end of strided rows is skipped
+static void build_rows(SGChain* chain, const Buffer* buf)
+{
+  int sg;
+  unsigned int* sg_ptr = chain->desc;
+
+  for(sg = 0; sg < buf->height; sg++){
+    sg_ptr[0] = chain->desc_phys + (sg + 1) * SG_DESC_BYTES; // Pointer to next descriptor
+    sg_ptr[1] = 0; // Upper 32 bits of descriptor pointer (unused)
+    sg_ptr[2] = buf->phys_addr + (sg * buf->stride * buf->depth); // Address where the data lives
+    sg_ptr[3] = 0; // Upper 32 bits of data address (unused)
+    sg_ptr[4] = 0; // Next 2 words are reserved
+    sg_ptr[5] = 0;
+    sg_ptr[6] = (buf->width * buf->depth); // Width of data is width*depth of image
+    if(sg == 0){
+      sg_ptr[6] |= SG_SOF;
+    }
+    if(sg == buf->height-1){
+      sg_ptr[6] |= SG_EOF;
+    }
+    sg_ptr[7] = 0; // Clear the status; the DMA engine will set this
+
+    sg_ptr += SG_DESC_SIZE;
+  }
+}
+
+// With the 2D feature of the multichannel AXI DMA, a sub-block of a 2D image
+// takes only one descriptor.
+static void build_2d(SGChain* chain, const Buffer* buf, unsigned int axcache)
+{
+  unsigned int* sg_ptr = chain->desc;
+
+  sg_ptr[0] = chain->desc_phys + SG_DESC_BYTES; // Pointer to next descriptor
+  sg_ptr[1] = 0;
+  sg_ptr[2] = buf->phys_addr;
+  sg_ptr[3] = 0;
+  sg_ptr[4] = axcache;
+  sg_ptr[5] = (buf->stride * buf->depth) | (buf->height << 19); // Stride and VSIZE
+  sg_ptr[6] = (buf->width * buf->depth) | SG_SOF | SG_EOF;
+  sg_ptr[7] = 0;
+}
+
+int sg_chain_build(SGChain* chain, const Buffer* buf, int mode, unsigned int axcache)
+{
+  int n = (mode == SG_CHAIN_2D) ? 1 : buf->height;
+
+  if(n > chain->max_desc){
+    chain->mode = SG_CHAIN_NONE;
+    return(-1);
+  }
+
+  if(mode == SG_CHAIN_2D){
+    build_2d(chain, buf, axcache);
+  }
+  else{
+    build_rows(chain, buf);
+  }
+
+  chain->nr_desc = n;
+  chain->mode = mode;
+  chain->width = buf->width;
+  chain->height = buf->height;
+  chain->stride = buf->stride;
+  chain->depth = buf->depth;
+  chain->axcache = axcache;
+  return(n);
+}
+
+int sg_chain_update(SGChain* chain, const Buffer* buf, int mode, unsigned int axcache)
+{
+  int sg;
+  unsigned int addr, row_bytes;
+  unsigned int* sg_ptr = chain->desc;
+
+  if(chain->mode != mode || chain->width != buf->width ||
+     chain->height != buf->height || chain->stride != buf->stride ||
+     chain->depth != buf->depth || chain->axcache != axcache){
+    return(sg_chain_build(chain, buf, mode, axcache));
+  }
+
+  // Same shape, so the lengths, flags and next pointers are all still right
+  addr = buf->phys_addr;
+  row_bytes = buf->stride * buf->depth;
+  for(sg = 0; sg < chain->nr_desc; sg++){
+    sg_ptr[2] = addr;
+    sg_ptr[7] = 0;
+    addr += row_bytes;
+    sg_ptr += SG_DESC_SIZE;
+  }
+  return(chain->nr_desc);
+}
+
+void sg_chain_invalidate(SGChain* chain)
+{
+  chain->mode = SG_CHAIN_NONE;
+}
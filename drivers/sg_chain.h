@@ -0,0 +1,57 @@
+/* sg_chain.h
+ * Builds AXI DMA scatter-gather descriptor chains for image buffers.
+ *
+ * A chain remembers the geometry it was built for.  Streaming code sends the
+ * same size of image over and over, and only the buffer address changes, so
+ * sg_chain_update() patches the address words in place instead of writing
+ * out every descriptor again.
+ *
+ * This file is shared with the user-space benchmark in drivers/test, so it
+ * only deals in plain memory and addresses handed to it.
+ */
+
+#ifndef _SG_CHAIN_H_
+#define _SG_CHAIN_H_
+
+#include "buffer.h"
+
+#define SG_DESC_SIZE 16 // Size of each SG descriptor, in 32-bit words
+#define SG_DESC_BYTES (SG_DESC_SIZE * 4)  // Size of each descriptor in bytes
+
+#define SG_SOF 0x08000000 // Start of frame flag in the control word
+#define SG_EOF 0x04000000 // End of frame flag
+
+/* Chain layouts */
+#define SG_CHAIN_NONE 0 // Nothing cached; the next update rebuilds
+#define SG_CHAIN_ROWS 1 // One descriptor per image row
+#define SG_CHAIN_2D 2 // A single 2D descriptor (needs the multichannel DMA)
+
+typedef struct SGChain
+{
+  unsigned int* desc; // Descriptor memory
+  unsigned long desc_phys; // Physical address of desc, for the next pointers
+  int max_desc; // Number of descriptors that fit in desc
+  int nr_desc; // Length of the chain currently in desc
+
+  // What the current chain was built for
+  int mode;
+  unsigned int width, height, stride, depth;
+  unsigned int axcache; // Value of the AxCACHE/AxUSER word in 2D descriptors
+} SGChain;
+
+void sg_chain_init(SGChain* chain, unsigned int* desc, unsigned long desc_phys, int max_desc);
+
+/* Writes out a complete chain for buf.
+ * Returns the number of descriptors, or -1 if they don't fit.
+ */
+int sg_chain_build(SGChain* chain, const Buffer* buf, int mode, unsigned int axcache);
+
+/* Same as sg_chain_build(), except that if the chain was last built for the
+ * same geometry, only the buffer addresses and status words are rewritten.
+ */
+int sg_chain_update(SGChain* chain, const Buffer* buf, int mode, unsigned int axcache);
+
+/* Forgets the cached geometry, for when something else writes into desc */
+void sg_chain_invalidate(SGChain* chain);
+
+#endif
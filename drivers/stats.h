@@ -0,0 +1,225 @@
+/* stats.h
+ * Per-CPU event counters and latency histograms, read and reset through
+ * debugfs.
+ *
+ * A module describes its statistics as a struct made only of u64 counters
+ * and struct stat_hist histograms, and allocates one copy per CPU with
+ * alloc_percpu().  The hot paths bump their own CPU's copy with
+ * stat_inc()/stat_add()/stat_hist_record(), so there's no shared cache line
+ * and no atomic.  Readers add the copies up.  Reads and resets race with the
+ * writers, so a total can be a few events behind, which is fine here.
+ *
+ * stats_debugfs_create() makes a directory with:
+ *   counters   - "name total" for every counter
+ *   gauges     - "name value" for things which go up and down, like queue
+ *                depths; only there if the module has a show_gauges()
+ *   histograms - bucket bounds, then "name count count ..." per histogram
+ *   reset      - write anything to zero the counters and histograms
+ * utils/hwstat reads these and prints rates.
+ *
+ * Everything is inline so that vdma.c, which is built on its own, can use it
+ * as well as the composite modules.
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/string.h>
+#include <linux/log2.h>
+#include <linux/fs.h>
+#include <linux/module.h>
+#include <linux/seq_file.h>
+#include <linux/debugfs.h>
+
+// Power-of-two buckets in microseconds: bucket 0 is under 1us, bucket n is
+// [2^(n-1), 2^n) us, and the last catches the rest.
+#define STAT_HIST_BUCKETS 20
+
+struct stat_hist {
+  u64 bucket[STAT_HIST_BUCKETS];
+};
+
+static inline int stat_hist_bucket(s64 us)
+{
+  return((us <= 0) ? 0 : min(ilog2(us) + 1, STAT_HIST_BUCKETS - 1));
+}
+
+// The lower bound of a bucket, in microseconds
+static inline unsigned long stat_hist_bound(int b)
+{
+  return(b ? 1UL << (b - 1) : 0UL);
+}
+
+// stats is a __percpu pointer to the module's statistics struct
+#define stat_inc(stats, field) this_cpu_inc((stats)->field)
+#define stat_add(stats, field, n) this_cpu_add((stats)->field, (n))
+#define stat_hist_record(stats, field, us) \
+  this_cpu_inc((stats)->field.bucket[stat_hist_bucket(us)])
+
+/* One entry per counter or histogram in the statistics struct */
+struct stat_field {
+  const char* name;
+  size_t offset;
+  bool hist;
+};
+
+#define STAT_COUNTER(type, field) { #field, offsetof(type, field), false }
+#define STAT_HIST(type, field) { #field, offsetof(type, field), true }
+
+struct stats_debugfs {
+  void __percpu* stats;
+  size_t size; // Of the statistics struct
+  const struct stat_field* fields;
+  int nr_fields;
+  void (*show_gauges)(struct seq_file* s, void* data); // Optional
+  void* data; // For show_gauges
+};
+
+/* Total of the u64 at offset, over every CPU */
+static inline u64 stat_sum(void __percpu* stats, size_t offset)
+{
+  u64 sum = 0;
+  int cpu;
+
+  for_each_possible_cpu(cpu){
+    sum += *(u64*)((char*)per_cpu_ptr(stats, cpu) + offset);
+  }
+  return(sum);
+}
+
+static inline u64 stat_hist_sum(void __percpu* stats, size_t offset, int b)
+{
+  return(stat_sum(stats, offset + b * sizeof(u64)));
+}
+
+static inline void stats_reset(void __percpu* stats, size_t size)
+{
+  int cpu;
+
+  for_each_possible_cpu(cpu){
+    memset(per_cpu_ptr(stats, cpu), 0, size);
+  }
+}
+
+static inline int stats_counters_show(struct seq_file* s, void* unused)
+{
+  struct stats_debugfs* sd = s->private;
+  int i;
+
+  for(i = 0; i < sd->nr_fields; i++){
+    if(!sd->fields[i].hist){
+      seq_printf(s, "%s %llu\n", sd->fields[i].name,
+                 stat_sum(sd->stats, sd->fields[i].offset));
+    }
+  }
+  return(0);
+}
+
+static inline int stats_gauges_show(struct seq_file* s, void* unused)
+{
+  struct stats_debugfs* sd = s->private;
+
+  sd->show_gauges(s, sd->data);
+  return(0);
+}
+
+static inline int stats_histograms_show(struct seq_file* s, void* unused)
+{
+  struct stats_debugfs* sd = s->private;
+  int i, b;
+
+  seq_puts(s, "bucket_us");
+  for(b = 0; b < STAT_HIST_BUCKETS; b++){
+    seq_printf(s, " %lu", stat_hist_bound(b));
+  }
+  seq_putc(s, '\n');
+
+  for(i = 0; i < sd->nr_fields; i++){
+    if(sd->fields[i].hist){
+      seq_puts(s, sd->fields[i].name);
+      for(b = 0; b < STAT_HIST_BUCKETS; b++){
+        seq_printf(s, " %llu", stat_hist_sum(sd->stats, sd->fields[i].offset, b));
+      }
+      seq_putc(s, '\n');
+    }
+  }
+  return(0);
+}
+
+static inline int stats_counters_open(struct inode* inode, struct file* file)
+{
+  return(single_open(file, stats_counters_show, inode->i_private));
+}
+
+static inline int stats_gauges_open(struct inode* inode, struct file* file)
+{
+  return(single_open(file, stats_gauges_show, inode->i_private));
+}
+
+static inline int stats_histograms_open(struct inode* inode, struct file* file)
+{
+  return(single_open(file, stats_histograms_show, inode->i_private));
+}
+
+static inline ssize_t stats_reset_write(struct file* file, const char __user* buf,
+                                        size_t count, loff_t* ppos)
+{
+  struct stats_debugfs* sd = file->private_data;
+
+  stats_reset(sd->stats, sd->size);
+  return(count);
+}
+
+/* Makes the statistics directory under parent.  sd has to stay around until
+ * the directory is removed with debugfs_remove_recursive().  debugfs is only
+ * for diagnostics, so failures are ignored like everywhere else it's used.
+ */
+static inline struct dentry* stats_debugfs_create(const char* name, struct dentry* parent,
+                                                  struct stats_debugfs* sd)
+{
+  static const struct file_operations counters_fops = {
+    .owner = THIS_MODULE,
+    .open = stats_counters_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+  };
+  static const struct file_operations gauges_fops = {
+    .owner = THIS_MODULE,
+    .open = stats_gauges_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+  };
+  static const struct file_operations histograms_fops = {
+    .owner = THIS_MODULE,
+    .open = stats_histograms_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+  };
+  static const struct file_operations reset_fops = {
+    .owner = THIS_MODULE,
+    .open = simple_open,
+    .write = stats_reset_write,
+    .llseek = noop_llseek,
+  };
+  struct dentry* dir;
+
+  dir = debugfs_create_dir(name, parent);
+  if(IS_ERR_OR_NULL(dir)){
+    return(dir);
+  }
+  debugfs_create_file("counters", 0444, dir, sd, &counters_fops);
+  if(sd->show_gauges){
+    debugfs_create_file("gauges", 0444, dir, sd, &gauges_fops);
+  }
+  debugfs_create_file("histograms", 0444, dir, sd, &histograms_fops);
+  debugfs_create_file("reset", 0200, dir, sd, &reset_fops);
+  return(dir);
+}
+
+#endif
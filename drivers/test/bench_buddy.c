@@ -0,0 +1,153 @@
+/* bench_buddy.c
+ * Checks and benchmarks the buddy allocator used by the cmabuffer driver.
+ *
+ * - A randomized allocate/free run which verifies that no two live blocks
+ *   overlap and that everything merges back together at the end.
+ * - A fragmentation test with the workload we actually run: lots of small
+ *   accelerator tiles mixed with a few full camera frames.
+ * - Raw allocate/free throughput.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "buddy.h"
+
+#define PAGE_SHIFT 12
+#define POOL_SIZE (4*2048*1080*4) // Same as the driver default
+#define NSLOTS 256
+
+static int failures = 0;
+#define CHECK(cond, ...) if(!(cond)){ printf("FAIL: " __VA_ARGS__); printf("\n"); failures++; }
+
+static double now_sec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Picks a random image-ish size between one page and a full frame
+static unsigned long random_size(void)
+{
+  switch(rand() % 4){
+    case 0: return 64 * 64 * 3;
+    case 1: return 170 * 170 * 3;
+    case 2: return (rand() % 512 + 1) * 4096;
+    default: return 1640 * 1232 * 2;
+  }
+}
+
+static void test_random(void)
+{
+  BuddyPool pool;
+  long offsets[NSLOTS];
+  unsigned char* owner;
+  unsigned long size, b, nblocks;
+  int i, iter, slot;
+
+  CHECK(buddy_init(&pool, POOL_SIZE, PAGE_SHIFT) == 0, "buddy_init");
+  nblocks = POOL_SIZE >> PAGE_SHIFT;
+  owner = calloc(nblocks, 1);
+  for(i = 0; i < NSLOTS; i++){
+    offsets[i] = -1;
+  }
+
+  for(iter = 0; iter < 100000; iter++){
+    slot = rand() % NSLOTS;
+    if(offsets[slot] < 0){
+      offsets[slot] = buddy_alloc(&pool, random_size());
+      if(offsets[slot] < 0){
+        continue; // Pool is full, which is fine
+      }
+      // Mark every page of the block; none of them may already be taken
+      size = buddy_block_size(&pool, offsets[slot]);
+      CHECK((offsets[slot] & (size - 1)) == 0, "block at %lx isn't aligned to %lu", offsets[slot], size);
+      for(b = offsets[slot] >> PAGE_SHIFT; b < (offsets[slot] + size) >> PAGE_SHIFT; b++){
+        CHECK(owner[b] == 0, "page %lu handed out twice", b);
+        owner[b] = 1;
+      }
+    }
+    else{
+      size = buddy_block_size(&pool, offsets[slot]);
+      for(b = offsets[slot] >> PAGE_SHIFT; b < (offsets[slot] + size) >> PAGE_SHIFT; b++){
+        owner[b] = 0;
+      }
+      buddy_free(&pool, offsets[slot]);
+      offsets[slot] = -1;
+    }
+  }
+
+  for(i = 0; i < NSLOTS; i++){
+    if(offsets[i] >= 0){
+      buddy_free(&pool, offsets[i]);
+    }
+  }
+  CHECK(buddy_free_bytes(&pool) == (nblocks << PAGE_SHIFT), "pool didn't drain: %lu free", buddy_free_bytes(&pool));
+  CHECK(buddy_alloc(&pool, 16 << 20) == 0, "blocks didn't merge back together");
+
+  printf("random alloc/free: %s\n", failures ? "FAILED" : "ok");
+  free(owner);
+  buddy_destroy(&pool);
+}
+
+static void test_fragmentation(void)
+{
+  BuddyPool pool;
+  int frames = 0, tiles = 0;
+  unsigned long requested = 0;
+
+  buddy_init(&pool, POOL_SIZE, PAGE_SHIFT);
+
+  // A couple of full-resolution captures, then fill the rest with tiles
+  while(frames < 2 && buddy_alloc(&pool, 1640 * 1232 * 2) >= 0){
+    frames++;
+    requested += 1640 * 1232 * 2;
+  }
+  while(buddy_alloc(&pool, 64 * 64 * 3) >= 0){
+    tiles++;
+    requested += 64 * 64 * 3;
+  }
+
+  printf("fragmentation: %d frames + %d 64x64x3 tiles in %dMB (old scheme: 4 buffers total)\n",
+         frames, tiles, POOL_SIZE >> 20);
+  printf("  %.1f%% of the pool holds requested data\n", 100.0 * requested / POOL_SIZE);
+  CHECK(frames == 2 && tiles > 100, "expected dozens of tiles next to the frames");
+  buddy_destroy(&pool);
+}
+
+static void bench_throughput(void)
+{
+  BuddyPool pool;
+  long offsets[NSLOTS];
+  int i, iter;
+  const int NITER = 200;
+  double start, elapsed;
+
+  buddy_init(&pool, POOL_SIZE, PAGE_SHIFT);
+
+  start = now_sec();
+  for(iter = 0; iter < NITER; iter++){
+    for(i = 0; i < NSLOTS; i++){
+      offsets[i] = buddy_alloc(&pool, (i % 8 + 1) * 4096 * 3);
+    }
+    for(i = 0; i < NSLOTS; i++){
+      buddy_free(&pool, offsets[i]);
+    }
+  }
+  elapsed = now_sec() - start;
+
+  printf("throughput: %.1f ns per alloc+free pair\n", elapsed * 1e9 / (NITER * NSLOTS));
+  buddy_destroy(&pool);
+}
+
+int main(int argc, char* argv[])
+{
+  srand(1);
+  test_random();
+  test_fragmentation();
+  bench_throughput();
+  return(failures ? 1 : 0);
+}
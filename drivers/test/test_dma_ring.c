@@ -0,0 +1,217 @@
+/* test_dma_ring.c
+ * Runs the hwacc descriptor ring against an emulated AXI DMA channel.
+ *
+ * The emulator follows the PG021 register model closely enough to catch the
+ * mistakes that matter: writing CURDESC while running, fetching a descriptor
+ * that was already completed (i.e., a slot reused too early), or running
+ * past the tail.  Frames are submitted while earlier ones are still in
+ * flight, and every row address must come out in order with the engine
+ * started exactly once.  Frames are retired by looking for the Cmplt bit,
+ * the way the driver reaps several frames per (coalesced) interrupt.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dma_ring.h"
+
+#define RING_SLOTS 16
+#define RING_PHYS 0x70000000UL
+#define MAX_FRAME_ROWS 6
+#define NFRAMES 5000
+
+static int failures = 0;
+#define CHECK(cond, ...) if(!(cond)){ printf("FAIL: " __VA_ARGS__); printf("\n"); failures++; }
+
+/* ---- Emulated DMA channel ---- */
+static unsigned int regs[16];
+static unsigned int* ring_mem;
+static struct {
+  bool halted;
+  bool idle; // Caught up with the tail
+  unsigned long next; // Next descriptor to fetch
+  unsigned long tail;
+} eng;
+static int curdesc_writes = 0;
+
+static unsigned int* emu_log; // Buffer addresses, in the order they were transferred
+static int nlog = 0;
+
+unsigned int ioread32(void* addr)
+{
+  int off = (char*)addr - (char*)regs;
+  if(off == DMA_SR){
+    return((eng.halted ? DMA_SR_HALTED : 0) | (eng.idle ? DMA_SR_IDLE : 0));
+  }
+  return(regs[off / 4]);
+}
+
+void iowrite32(unsigned int value, void* addr)
+{
+  int off = (char*)addr - (char*)regs;
+  regs[off / 4] = value;
+
+  if(off == DMA_CR){
+    if((value & 1) && eng.halted){
+      eng.halted = false;
+      eng.idle = true; // Nothing to do until the tail is written
+      eng.next = regs[DMA_CURDESC / 4];
+    }
+    else if(!(value & 1)){
+      eng.halted = true;
+    }
+  }
+  else if(off == DMA_CURDESC){
+    curdesc_writes++;
+    CHECK(eng.halted, "CURDESC written while the channel was running");
+  }
+  else if(off == DMA_TAILDESC){
+    eng.tail = value;
+    if(!eng.halted){
+      eng.idle = false;
+    }
+  }
+}
+
+static unsigned int* desc_at(unsigned long phys)
+{
+  if(phys < RING_PHYS || phys >= RING_PHYS + RING_SLOTS * SG_DESC_BYTES ||
+     (phys - RING_PHYS) % SG_DESC_BYTES != 0){
+    printf("FAIL: engine followed a bad pointer %lx\n", phys);
+    exit(1);
+  }
+  return(ring_mem + (phys - RING_PHYS) / 4);
+}
+
+// Lets the engine complete up to n descriptors; returns how many it did
+static int emu_step(int n)
+{
+  unsigned int* d;
+  int done = 0;
+
+  while(done < n && !eng.halted && !eng.idle){
+    d = desc_at(eng.next);
+    CHECK((d[7] & DMA_DESC_CMPLT) == 0, "engine fetched an already-completed descriptor at %lx", eng.next);
+    emu_log[nlog++] = d[2];
+    d[7] = DMA_DESC_CMPLT | (d[6] & 0x03ffffff);
+    if(eng.next == eng.tail){
+      eng.idle = true;
+    }
+    eng.next = d[0];
+    done++;
+  }
+  return(done);
+}
+
+/* ---- Driver side ---- */
+static unsigned int* expected;
+static int nexpected = 0;
+
+static void make_frame(SGChain* chain, int frame)
+{
+  Buffer buf;
+  int row;
+
+  memset(&buf, 0, sizeof(buf));
+  buf.width = 32;
+  buf.stride = 32;
+  buf.depth = 1;
+  buf.height = 1 + rand() % MAX_FRAME_ROWS;
+  buf.phys_addr = frame << 12;
+  sg_chain_build(chain, &buf, SG_CHAIN_ROWS, 0);
+
+  for(row = 0; row < buf.height; row++){
+    expected[nexpected++] = buf.phys_addr + row * 32;
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  DMARing ring;
+  SGChain chain;
+  unsigned int chain_mem[MAX_FRAME_ROWS * SG_DESC_SIZE];
+  int fifo[RING_SLOTS]; // Descriptor counts of frames in flight, oldest first
+  int fifo_slot[RING_SLOTS]; // ...and the slots they start at
+  int fifo_head = 0, fifo_len = 0;
+  int frame = 0, done_in_oldest = 0, n, slot, submitted_rows = 0;
+
+  srand(1);
+  ring_mem = calloc(RING_SLOTS, SG_DESC_BYTES);
+  emu_log = calloc(NFRAMES * MAX_FRAME_ROWS + 1, sizeof(unsigned int));
+  expected = calloc(NFRAMES * MAX_FRAME_ROWS + 1, sizeof(unsigned int));
+  eng.halted = true;
+
+  sg_chain_init(&chain, chain_mem, 0x60000000, MAX_FRAME_ROWS);
+  dma_ring_init(&ring, ring_mem, RING_PHYS, RING_SLOTS);
+
+  while(frame < NFRAMES || fifo_len > 0){
+    // Queue up as much as fits, some of the time
+    if(frame < NFRAMES && rand() % 2){
+      make_frame(&chain, frame);
+      if((slot = dma_ring_submit(&ring, regs, &chain)) >= 0){
+        fifo[(fifo_head + fifo_len) % RING_SLOTS] = chain.nr_desc;
+        fifo_slot[(fifo_head + fifo_len) % RING_SLOTS] = slot;
+        fifo_len++;
+        frame++;
+        submitted_rows += chain.nr_desc;
+      }
+      else{
+        CHECK(chain.nr_desc > dma_ring_space(&ring), "submit refused with room to spare");
+        nexpected -= chain.nr_desc; // Not submitted after all
+      }
+    }
+
+    // Let the hardware make some progress, and retire finished frames,
+    // which have to be exactly the ones the engine has finished
+    n = emu_step(rand() % 8);
+    done_in_oldest += n;
+    while(fifo_len > 0 && dma_ring_complete(&ring, fifo_slot[fifo_head], fifo[fifo_head])){
+      CHECK(done_in_oldest >= fifo[fifo_head], "frame at slot %d complete too early", fifo_slot[fifo_head]);
+      done_in_oldest -= fifo[fifo_head];
+      dma_ring_retire(&ring, fifo[fifo_head]);
+      fifo_head = (fifo_head + 1) % RING_SLOTS;
+      fifo_len--;
+    }
+    CHECK(fifo_len == 0 || done_in_oldest < fifo[fifo_head], "finished frame not seen as complete");
+  }
+
+  CHECK(nlog == nexpected, "engine transferred %d rows, expected %d", nlog, nexpected);
+  CHECK(memcmp(emu_log, expected, nexpected * sizeof(unsigned int)) == 0, "rows came out in the wrong order");
+  CHECK(curdesc_writes == 1 && ring.restarts == 1, "engine was restarted %d times", curdesc_writes);
+  CHECK(dma_ring_space(&ring) == RING_SLOTS, "ring didn't drain");
+  printf("streaming: %d frames, %d rows, %d engine start(s): %s\n",
+         NFRAMES, submitted_rows, curdesc_writes, failures ? "FAILED" : "ok");
+
+  // After the engine stops by itself (say, on an error), submitting is
+  // refused rather than silently skipping what was in flight.  Once the ring
+  // is reset the next frame restarts it.
+  iowrite32(0, regs + DMA_CR);
+  make_frame(&chain, frame);
+  CHECK(dma_ring_submit(&ring, regs, &chain) == DMA_RING_STOPPED, "stopped engine wasn't noticed");
+  CHECK(ring.restarts == 1, "stopped engine was restarted");
+  dma_ring_reset(&ring);
+  CHECK(dma_ring_space(&ring) == RING_SLOTS, "reset ring isn't empty");
+  dma_ring_submit(&ring, regs, &chain);
+  emu_step(MAX_FRAME_ROWS);
+  CHECK(nlog == nexpected && emu_log[nlog - 1] == expected[nexpected - 1], "frame after a reset was lost");
+  CHECK(ring.restarts == 2, "reset ring didn't restart the engine");
+  dma_ring_retire(&ring, chain.nr_desc);
+  printf("restart after an error: %s\n", failures ? "FAILED" : "ok");
+
+  // Coalescing settings go straight to a running engine, without a restart,
+  // and survive halting it
+  dma_ring_set_irq(&ring, regs, 8, 10);
+  CHECK(regs[DMA_CR / 4] == 0x0a087003, "control register is %08x", regs[DMA_CR / 4]);
+  CHECK(!eng.halted && ring.restarts == 2, "setting the coalescing restarted the engine");
+  make_frame(&chain, frame + 1);
+  dma_ring_halt(&ring, regs);
+  CHECK(eng.halted && regs[DMA_CR / 4] == 0x0a087002, "halt left the control register at %08x",
+        regs[DMA_CR / 4]);
+  dma_ring_submit(&ring, regs, &chain);
+  CHECK(regs[DMA_CR / 4] == 0x0a087003, "restart lost the coalescing settings");
+  printf("interrupt coalescing: %s\n", failures ? "FAILED" : "ok");
+
+  return(failures ? 1 : 0);
+}
@@ -0,0 +1,210 @@
+/* test_tiling.c
+ * Runs images through a software stand-in for a fixed-size stencil
+ * accelerator, one tile at a time, the way PROCESS_TILED feeds the hardware,
+ * and checks the result against running the stencil over the whole image.
+ *
+ * The stand-in only sees the tile Buffers, like the DMA engines do, and
+ * checks that every pixel it touches is inside the real images (and that the
+ * physical and kernel addresses agree).  Every output pixel has to be written
+ * and the padding past the edge of each row has to be left alone.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tiling.h"
+
+#define PHYS_IN 0x70000000U
+#define PHYS_OUT 0x78000000U
+#define PAD 0xa5 // Fill for the bytes between width and stride
+
+static int failures = 0;
+#define CHECK(cond, ...) if(!(cond)){ printf("FAIL: " __VA_ARGS__); printf("\n"); failures++; }
+
+/* ---- The whole images the tiles are cut from ---- */
+static Buffer img_in, img_out;
+static unsigned char* writes; // How many times each output pixel was written
+static int bad_reads, bad_writes, bad_phys;
+
+static void alloc_image(Buffer* b, unsigned int w, unsigned int h, unsigned int stride,
+                        unsigned int phys)
+{
+  memset(b, 0, sizeof(Buffer));
+  b->width = w;
+  b->height = h;
+  b->stride = stride;
+  b->depth = 3;
+  b->phys_addr = phys;
+  b->kern_addr = malloc(h * stride * 3);
+  memset(b->kern_addr, PAD, h * stride * 3);
+}
+
+// Where a pointer into one of the images is, or false if it's outside
+static bool locate(const Buffer* img, const unsigned char* p, unsigned int* x, unsigned int* y)
+{
+  long off = p - (unsigned char*)img->kern_addr;
+
+  if(off < 0 || off >= (long)(img->height * img->stride * img->depth)){
+    return false;
+  }
+  *y = off / (img->stride * img->depth);
+  *x = (off % (img->stride * img->depth)) / img->depth;
+  return(*x < img->width);
+}
+
+/* ---- Software accelerator ----
+ * Each output channel is a position-weighted sum of the (2*halo+1)^2 window
+ * around the matching input pixel, so a tile which is off by even one pixel
+ * gives different values.
+ */
+static void stencil(const Buffer* in, const Buffer* out, unsigned int halo)
+{
+  unsigned int x, y, c, dx, dy, px, py, sum;
+  const unsigned char* src;
+  unsigned char* dst;
+
+  if((in->phys_addr - PHYS_IN) != (unsigned int)((char*)in->kern_addr - (char*)img_in.kern_addr) ||
+     (out->phys_addr - PHYS_OUT) != (unsigned int)((char*)out->kern_addr - (char*)img_out.kern_addr)){
+    bad_phys++;
+  }
+
+  for(y = 0; y < out->height; y++){
+    for(x = 0; x < out->width; x++){
+      dst = (unsigned char*)out->kern_addr + (y * out->stride + x) * out->depth;
+      if(!locate(&img_out, dst, &px, &py)){
+        bad_writes++;
+        continue;
+      }
+      writes[py * img_out.width + px]++;
+
+      for(c = 0; c < out->depth; c++){
+        sum = 0;
+        for(dy = 0; dy <= 2 * halo; dy++){
+          for(dx = 0; dx <= 2 * halo; dx++){
+            src = (unsigned char*)in->kern_addr + ((y + dy) * in->stride + x + dx) * in->depth + c;
+            if(!locate(&img_in, src, &px, &py)){
+              bad_reads++;
+              continue;
+            }
+            sum += *src * (dy * (2 * halo + 1) + dx + 1);
+          }
+        }
+        dst[c] = sum;
+      }
+    }
+  }
+}
+
+static void run_case(unsigned int in_w, unsigned int in_h, unsigned int stride,
+                     unsigned int tile_w, unsigned int tile_h, unsigned int halo)
+{
+  TileGrid grid;
+  Buffer t_in, t_out, ref, saved;
+  unsigned int i, x, y;
+  int n, missed = 0, mismatched = 0, padding = 0;
+  unsigned char *a, *b;
+
+  alloc_image(&img_in, in_w, in_h, stride, PHYS_IN);
+  alloc_image(&img_out, in_w - 2 * halo, in_h - 2 * halo, stride, PHYS_OUT);
+  writes = calloc(img_out.width * img_out.height, 1);
+  bad_reads = bad_writes = bad_phys = 0;
+  for(y = 0; y < in_h; y++){
+    for(x = 0; x < in_w * 3; x++){
+      ((unsigned char*)img_in.kern_addr)[y * stride * 3 + x] = rand();
+    }
+  }
+
+  // What the whole image should come out as, from the same stencil with the
+  // output image standing in for itself
+  alloc_image(&ref, img_out.width, img_out.height, stride, PHYS_OUT);
+  saved = img_out;
+  img_out = ref;
+  stencil(&img_in, &ref, halo);
+  img_out = saved;
+  memset(writes, 0, img_out.width * img_out.height);
+
+  n = tile_grid_init(&grid, &img_in, &img_out, tile_w, tile_h, halo);
+  CHECK(n > 0, "%ux%u: tile_grid_init refused %ux%u tiles, halo %u",
+        in_w, in_h, tile_w, tile_h, halo);
+  for(i = 0; i < (unsigned int)n; i++){
+    tile_grid_get(&grid, &img_in, &img_out, i, &t_in, &t_out);
+    CHECK(t_in.width == tile_w && t_in.height == tile_h,
+          "tile %u input is %ux%u", i, t_in.width, t_in.height);
+    CHECK(t_out.width == tile_w - 2 * halo && t_out.height == tile_h - 2 * halo,
+          "tile %u output is %ux%u", i, t_out.width, t_out.height);
+    stencil(&t_in, &t_out, halo);
+  }
+
+  for(y = 0; y < img_out.height; y++){
+    a = (unsigned char*)img_out.kern_addr + y * stride * 3;
+    b = (unsigned char*)ref.kern_addr + y * stride * 3;
+    for(x = 0; x < img_out.width; x++){
+      missed += (writes[y * img_out.width + x] == 0);
+    }
+    mismatched += (memcmp(a, b, img_out.width * 3) != 0);
+    for(x = img_out.width * 3; x < stride * 3; x++){
+      padding += (a[x] != PAD);
+    }
+  }
+
+  printf("%4ux%-4u stride %4u, %3ux%-3u tiles, halo %u: %4d tiles\n",
+         in_w, in_h, stride, tile_w, tile_h, halo, n);
+  CHECK(bad_reads == 0, "%d reads outside the input image", bad_reads);
+  CHECK(bad_writes == 0, "%d writes outside the output image", bad_writes);
+  CHECK(bad_phys == 0, "%d tiles with phys_addr and kern_addr out of step", bad_phys);
+  CHECK(missed == 0, "%d output pixels never written", missed);
+  CHECK(mismatched == 0, "%d rows differ from the whole-image result", mismatched);
+  CHECK(padding == 0, "%d padding bytes overwritten", padding);
+
+  free(img_in.kern_addr);
+  free(img_out.kern_addr);
+  free(ref.kern_addr);
+  free(writes);
+}
+
+static void check_rejected(unsigned int in_w, unsigned int in_h, unsigned int out_w,
+                           unsigned int out_h, unsigned int tile, unsigned int halo)
+{
+  TileGrid grid;
+  Buffer in = {0}, out = {0};
+
+  in.width = in.stride = in_w;
+  in.height = in_h;
+  out.width = out.stride = out_w;
+  out.height = out_h;
+  in.depth = out.depth = 3;
+  CHECK(tile_grid_init(&grid, &in, &out, tile, tile, halo) < 0,
+        "%ux%u -> %ux%u accepted with %u tiles, halo %u", in_w, in_h, out_w, out_h, tile, halo);
+}
+
+int main(void)
+{
+  srand(18);
+
+  // A full camera frame through the 170x170 core
+  run_case(1640, 1232, 1640, 170, 170, 1);
+  run_case(1640, 1232, 2048, 170, 170, 1);
+  // Sizes which aren't a whole number of tiles, in one or both directions
+  run_case(500, 333, 512, 170, 170, 1);
+  run_case(338, 171, 338, 170, 170, 1);
+  run_case(401, 257, 409, 64, 32, 4);
+  // Exactly one tile, and an exact multiple
+  run_case(170, 170, 170, 170, 170, 1);
+  run_case(16 * 3 + 2, 16 * 5 + 2, 64, 18, 18, 1);
+  // No halo at all, so the tiles don't overlap
+  run_case(100, 90, 100, 32, 32, 0);
+
+  check_rejected(1640, 1232, 1640, 1232, 170, 1); // Output not shrunk by the halo
+  check_rejected(1640, 1232, 1638, 1230, 2, 1); // Tile is all halo
+  check_rejected(100, 100, 98, 98, 170, 1); // Image smaller than a tile
+
+  if(failures){
+    printf("%d failures\n", failures);
+    return(1);
+  }
+  printf("All tiling tests passed\n");
+  return(0);
+}
+
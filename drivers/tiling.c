@@ -0,0 +1,67 @@
+/* tiling.c
+ * Fixed-size tiles with overlapping halos; see tiling.h.
+ */
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdbool.h>
+#include <stddef.h>
+#endif
+
+#include "tiling.h"
+
+int tile_grid_init(TileGrid* grid, const Buffer* in, const Buffer* out,
+                   unsigned int tile_width, unsigned int tile_height, unsigned int halo)
+{
+  if(tile_width <= 2 * halo || tile_height <= 2 * halo ||
+     in->width < tile_width || in->height < tile_height ||
+     out->width != in->width - 2 * halo || out->height != in->height - 2 * halo){
+    return(-1);
+  }
+
+  grid->tile_width = tile_width;
+  grid->tile_height = tile_height;
+  grid->halo = halo;
+  grid->out_width = tile_width - 2 * halo;
+  grid->out_height = tile_height - 2 * halo;
+  grid->image_width = out->width;
+  grid->image_height = out->height;
+  grid->cols = (grid->image_width + grid->out_width - 1) / grid->out_width;
+  grid->rows = (grid->image_height + grid->out_height - 1) / grid->out_height;
+  return(grid->cols * grid->rows);
+}
+
+// Moves a Buffer's origin to (x, y), keeping its stride
+static void sub_block(const Buffer* whole, unsigned int x, unsigned int y,
+                      unsigned int width, unsigned int height, Buffer* part)
+{
+  unsigned int offset = (y * whole->stride + x) * whole->depth;
+
+  *part = *whole;
+  part->width = width;
+  part->height = height;
+  part->phys_addr = whole->phys_addr + offset;
+  part->kern_addr = whole->kern_addr ? (char*)whole->kern_addr + offset : NULL;
+}
+
+void tile_grid_get(const TileGrid* grid, const Buffer* in, const Buffer* out,
+                   unsigned int n, Buffer* in_tile, Buffer* out_tile)
+{
+  unsigned int x = (n % grid->cols) * grid->out_width;
+  unsigned int y = (n / grid->cols) * grid->out_height;
+
+  // The last column and row end at the edge rather than hanging off it
+  if(x + grid->out_width > grid->image_width){
+    x = grid->image_width - grid->out_width;
+  }
+  if(y + grid->out_height > grid->image_height){
+    y = grid->image_height - grid->out_height;
+  }
+
+  // Output pixel (x, y) comes from the input pixels around (x + halo,
+  // y + halo), so the input tile starts at the same coordinates
+  sub_block(in, x, y, grid->tile_width, grid->tile_height, in_tile);
+  sub_block(out, x, y, grid->out_width, grid->out_height, out_tile);
+}
+
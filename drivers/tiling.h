@@ -0,0 +1,48 @@
+/* tiling.h
+ * Splits an image which is too big for the accelerator into fixed-size
+ * tiles, for PROCESS_TILED.
+ *
+ * The accelerator takes a tile_width x tile_height input and produces an
+ * output which is smaller by the stencil's halo on every side, so input
+ * tiles overlap by 2*halo and the output tiles butt up against each other.
+ * Images don't have to be a whole number of tiles: the last row and column
+ * of tiles are pulled back to end at the edge of the image, and overlap the
+ * ones before them.  Every tile is a sub-block of the original Buffer with
+ * the same stride, which the 2D SG descriptors handle directly, so no data
+ * gets copied.
+ *
+ * Like sg_chain.c, this is shared with the tests in drivers/test.
+ */
+
+#ifndef _TILING_H_
+#define _TILING_H_
+
+#include "buffer.h"
+
+typedef struct TileGrid
+{
+  unsigned int tile_width; // Accelerator input
+  unsigned int tile_height;
+  unsigned int halo;
+  unsigned int out_width; // Accelerator output, tile size less the halo
+  unsigned int out_height;
+  unsigned int image_width; // Whole output image
+  unsigned int image_height;
+  unsigned int cols;
+  unsigned int rows;
+} TileGrid;
+
+/* Works out the tiles for an input image and the output image it turns
+ * into.  The output must be 2*halo smaller than the input in each
+ * direction, and the input at least one tile.
+ * Returns the number of tiles, or -1 if the sizes don't work.
+ */
+int tile_grid_init(TileGrid* grid, const Buffer* in, const Buffer* out,
+                   unsigned int tile_width, unsigned int tile_height, unsigned int halo);
+
+/* Fills in the input and output sub-Buffers for tile n, in row-major order */
+void tile_grid_get(const TileGrid* grid, const Buffer* in, const Buffer* out,
+                   unsigned int n, Buffer* in_tile, Buffer* out_tile);
+
+#endif
+
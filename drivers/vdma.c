@@ -17,11 +17,17 @@
 #include <linux/device.h>
 #include <linux/interrupt.h>
 #include <linux/of_platform.h>
+#include <linux/poll.h>
+#include <linux/ktime.h>
 
 #include "common.h"
 #include "buffer.h"
+#include "stats.h"
 #include "ioctl_cmds.h"
 
+#define CREATE_TRACE_POINTS
+#include "vdma_trace.h"
+
 MODULE_LICENSE("GPL");
 
 #define CLASSNAME "xilcam" // Shows up in /sys/class
@@ -43,27 +49,81 @@ struct cdev *chardev;
 struct device *vdma_dev;
 struct class *vdma_class;
 
-#define N_VDMA_BUFFERS 3 // Number of "live" buffers in the VDMA buffer ring
-Buffer* vdma_buf[N_VDMA_BUFFERS]; // Handles for buffers in the ring
+// The frame store address registers start at 0xac; 16 of them fit in the
+// register window we map.  The engine must be built with at least as many
+// frame stores (C_NUM_FSTORES) as we ask for.
+#define MAX_VDMA_BUFFERS 16
+Buffer* vdma_buf[MAX_VDMA_BUFFERS]; // Handles for buffers in the ring
+
+DEFINE_DEBUG_LEVEL(3);
+
+// Number of "live" buffers in the VDMA buffer ring.  This can come from the
+// "vdma-buffers" device tree property; the module parameter overrides it.
+static unsigned int n_buffers = 0;
+module_param(n_buffers, uint, 0444);
+MODULE_PARM_DESC(n_buffers, "number of buffers in the VDMA ring (0 uses the device tree or default)");
+unsigned int n_vdma_buffers = 3;
+
+// Frame geometry, from the "vdma-geometry" device tree property
+// (width, height, depth, stride) if it's there
+unsigned int frame_width = 1920;
+unsigned int frame_height = 1080;
+unsigned int frame_depth = 1;
+unsigned int frame_stride = 2048;
+
+// Per-CPU statistics (see stats.h), in /sys/kernel/debug/xilcam
+struct xilcam_stats {
+  u64 frames; // Frame interrupts
+  u64 frames_unread; // ...which replaced a frame nobody grabbed
+  u64 frames_with_errors; // ...with error bits set in the status register
+  u64 bytes; // Written by the engine
+  u64 grabs;
+  u64 grab_failures; // No buffer to swap in
+  struct stat_hist lat_frame; // Between frame interrupts
+  struct stat_hist lat_grab; // GRAB_IMAGE waiting for a frame
+};
+
+static const struct stat_field xilcam_stat_fields[] = {
+  STAT_COUNTER(struct xilcam_stats, frames),
+  STAT_COUNTER(struct xilcam_stats, frames_unread),
+  STAT_COUNTER(struct xilcam_stats, frames_with_errors),
+  STAT_COUNTER(struct xilcam_stats, bytes),
+  STAT_COUNTER(struct xilcam_stats, grabs),
+  STAT_COUNTER(struct xilcam_stats, grab_failures),
+  STAT_HIST(struct xilcam_stats, lat_frame),
+  STAT_HIST(struct xilcam_stats, lat_grab),
+};
+
+// Error bits in the S2MM status register (0x34), which stay set until written back
+#define VDMA_SR_ERRORS 0x000089f0
 
-int debug_level = 3; // 0 is errors only, increasing numbers print more stuff
+struct xilcam_stats __percpu* stats;
+struct stats_debugfs stats_debugfs;
+struct dentry* vdma_debugfs;
+ktime_t last_frame_time;
+u32 last_error_status;
 
 static int dev_open(struct inode *inode, struct file *file)
 {
   int i;
   unsigned long status;
   iowrite32(0x00010044, vdma_controller + 0x30); // reset, so we can configure
+  last_frame_time = ktime_set(0, 0); // The first frame has nothing to time against
 
   // Acquire buffers and hand them to the VDMA engine
-  for(i = 0; i < N_VDMA_BUFFERS; i++){
-    vdma_buf[i] = acquire_buffer(1920, 1080, 1, 2048);
+  for(i = 0; i < n_vdma_buffers; i++){
+    vdma_buf[i] = acquire_buffer(frame_width, frame_height, frame_depth, frame_stride);
     if(vdma_buf[i] == NULL){
+      // Give back the ones we already got
+      while(--i >= 0){
+        release_buffer(vdma_buf[i]);
+      }
       return(-ENOMEM);
     }
     iowrite32(vdma_buf[i]->phys_addr, vdma_controller + 0xac + i*4);
   }
 
-  iowrite32(N_VDMA_BUFFERS, vdma_controller + 0x48); // Set number of buffers
+  iowrite32(n_vdma_buffers, vdma_controller + 0x48); // Set number of buffers
 
   status = ioread32(vdma_controller + 0x34);
   DEBUG("dev_open: ioread32 at offset 0x34 returned %08lx\n", status);
@@ -80,9 +140,9 @@ static int dev_open(struct inode *inode, struct file *file)
   DEBUG("dev_open: ioread32 at offset 0x34 returned %08lx\n", status);
 
   // Write the size.  This also commits the settings and begins transfer
-  iowrite32(1920, vdma_controller + 0xa4); // Horizontal size (1 byte/pixel)
-  iowrite32(2048, vdma_controller + 0xa8); // Stride (1 byte/pixel)
-  iowrite32(1080, vdma_controller + 0xa0); // Vertical size, start transfer
+  iowrite32(frame_width * frame_depth, vdma_controller + 0xa4); // Horizontal size in bytes
+  iowrite32(frame_stride * frame_depth, vdma_controller + 0xa8); // Stride in bytes
+  iowrite32(frame_height, vdma_controller + 0xa0); // Vertical size, start transfer
 
   TRACE("dev_open: Started VDMA\n");
   return(0);
@@ -90,33 +150,43 @@ static int dev_open(struct inode *inode, struct file *file)
 
 static int dev_close(struct inode *inode, struct file *file)
 {
-  int i;
+  int i, count;
   iowrite32(0x00010040, vdma_controller + 0x30); // Stop, so we can configure
   // Free our collection of big buffers
-  for(i = 0; i < N_VDMA_BUFFERS; i++){
+  for(i = 0; i < n_vdma_buffers; i++){
     release_buffer(vdma_buf[i]);
   }
+  count = release_owned_buffers(file); // Grabbed frames which weren't freed
+  if(count > 0){
+    WARNING("xilcam: reclaimed %d frames left allocated at close\n", count);
+  }
 
   TRACE("dev_close: Stopped VDMA\n");
   return(0);
 }
 
 
-int grab_image(Buffer* buf)
+/* Swaps the most recent frame out of the ring.  The frame then belongs to
+ * the grabbing file, and is reclaimed when it closes; the grabbing process
+ * frees it with FREE_IMAGE here or on /dev/cmabuffer0. */
+int grab_image(Buffer* buf, struct file* filp)
 {
   Buffer* tmp;
   unsigned long slot; // Slot VDMA S2MM is working on
   //unsigned long status; // For printing debug messages
+  ktime_t start = ktime_get();
 
   // Wait until there's a new image
   wait_event_interruptible(wq_frame, atomic_read(&new_frame) == 1);
   atomic_set(&new_frame, 0); // Mark the image as read
+  stat_hist_record(stats, lat_grab, ktime_us_delta(ktime_get(), start));
 
   // Allocate a new buffer to swap in
-  tmp = acquire_buffer(1920, 1080, 1, 2048);
+  tmp = acquire_buffer(frame_width, frame_height, frame_depth, frame_stride);
 
   // If this fails, return failure
   if(tmp == NULL){
+    stat_inc(stats, grab_failures);
     return(-ENOBUFS);
   }
 
@@ -139,10 +209,11 @@ int grab_image(Buffer* buf)
 
   // Get the previous one, which is the most recently finished
   DEBUG("grab_image: VMDA current working frame in slot %lu\n", slot);
-  slot = (slot + N_VDMA_BUFFERS - 1) % N_VDMA_BUFFERS;
+  slot = (slot + n_vdma_buffers - 1) % n_vdma_buffers;
   DEBUG("grab_image: most recently finished frame in slot %lu\n", slot);
 
   // Copy the buffer object for the caller
+  set_buffer_owner(vdma_buf[slot], filp);
   *buf = *vdma_buf[slot];
 
   // Replace it with the new buffer
@@ -152,8 +223,10 @@ int grab_image(Buffer* buf)
   iowrite32(vdma_buf[slot]->phys_addr, vdma_controller + 0xac + slot*4);
 
   // Write the vertical size again so the settings take effect
-  iowrite32(1080, vdma_controller + 0xa0);
+  iowrite32(frame_height, vdma_controller + 0xa0);
 
+  stat_inc(stats, grabs);
+  trace_xilcam_grab(slot, buf->id, vdma_buf[slot]->id);
   TRACE("grab_image: replaced %d with %d\n", buf->id, vdma_buf[slot]->id);
   return(0);
 }
@@ -166,7 +239,7 @@ long dev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
   switch(cmd){
     case GRAB_IMAGE:
       TRACE("ioctl: GRAB_IMAGE\n");
-      if(grab_image(&tmp) == 0 && 
+      if(grab_image(&tmp, filp) == 0 && 
         access_ok(VERIFY_WRITE, (void*)arg, sizeof(Buffer)))
       {
         TRACE("Copying raw buffer object to user\n");
@@ -180,6 +253,13 @@ long dev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
       }
       break;
 
+    case FREE_IMAGE:
+      TRACE("ioctl: FREE_IMAGE\n");
+      if(copy_from_user(&tmp, (void*)arg, sizeof(Buffer)) != 0){
+        return(-EACCES);
+      }
+      return(release_owned_buffer(tmp.id, filp));
+
     default:
       return(-EINVAL); // Unknown command, return an error
       break;
@@ -187,32 +267,107 @@ long dev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
   return(0); // Success
 }
 
+/* Readable when there's a frame GRAB_IMAGE can take without blocking */
+unsigned int dev_poll(struct file *filp, poll_table *wait)
+{
+  poll_wait(filp, &wq_frame, wait);
+  if(atomic_read(&new_frame) == 1){
+    return(POLLIN | POLLRDNORM);
+  }
+  return(0);
+}
+
 struct file_operations fops = {
   // No read/write; everything is handled by ioctl
   .open = dev_open,
   .release = dev_close,
   .unlocked_ioctl = dev_ioctl,
+  .poll = dev_poll,
 };
 
 // Interrupt handler for when a frame finishes
 irqreturn_t frame_finished_handler(int irq, void* dev_id)
 {
-  iowrite32(0x00001000, vdma_controller + 0x34); // Acknowledge/clear interrupt
+  int unread;
+  u32 status;
+  ktime_t now = ktime_get();
+
+  status = ioread32(vdma_controller + 0x34);
+  // Acknowledge the interrupt, and clear any errors so each is counted once
+  iowrite32(0x00001000 | (status & VDMA_SR_ERRORS), vdma_controller + 0x34);
+  stat_inc(stats, frames);
+  stat_add(stats, bytes, frame_width * frame_height * frame_depth);
+  if(ktime_to_ns(last_frame_time) != 0){
+    stat_hist_record(stats, lat_frame, ktime_us_delta(now, last_frame_time));
+  }
+  last_frame_time = now;
+  if(status & VDMA_SR_ERRORS){
+    stat_inc(stats, frames_with_errors);
+    last_error_status = status;
+  }
   // TODO: reset the frame count back to 1?
   //e.g., iowrite32(0x00011043, vdma_controller + 0x30);
 
   // TODO: get the current time and save it somewhere
   // Should be able to use do_gettimeofday()
-  atomic_set(&new_frame, 1);
+  unread = atomic_xchg(&new_frame, 1);
+  if(unread){
+    stat_inc(stats, frames_unread);
+  }
+  trace_xilcam_frame_done(unread);
   wake_up_interruptible(&wq_frame);
   DEBUG("irq: VDMA frame finished.\n");
   return(IRQ_HANDLED);
 }
 
+// The debugfs gauges: the status register from the last frame with errors
+static void xilcam_show_gauges(struct seq_file* s, void* data)
+{
+  seq_printf(s, "last_error_status 0x%08x\n", last_error_status);
+}
+
 static int vdma_probe(struct platform_device *pdev)
 {
   int irqok;
+  u32 val;
+  u32 geom[4];
   struct resource* r_irq = NULL;
+
+  debug_level_init();
+
+  // Size of the buffer ring
+  if(of_property_read_u32(pdev->dev.of_node, "vdma-buffers", &val) == 0){
+    n_vdma_buffers = val;
+  }
+  if(n_buffers > 0){
+    n_vdma_buffers = n_buffers;
+  }
+  if(n_vdma_buffers < 2 || n_vdma_buffers > MAX_VDMA_BUFFERS){
+    ERROR("VDMA ring needs 2 to %d buffers, not %u\n", MAX_VDMA_BUFFERS, n_vdma_buffers);
+    return(-EINVAL);
+  }
+  TRACE("VDMA ring has %u buffers\n", n_vdma_buffers);
+
+  // Frame size
+  if(of_property_read_u32_array(pdev->dev.of_node, "vdma-geometry", geom, 4) == 0){
+    if(geom[0] == 0 || geom[1] == 0 || geom[2] == 0 || geom[3] < geom[0]){
+      ERROR("Bad vdma-geometry %ux%ux%u, stride %u\n", geom[0], geom[1], geom[2], geom[3]);
+      return(-EINVAL);
+    }
+    frame_width = geom[0];
+    frame_height = geom[1];
+    frame_depth = geom[2];
+    frame_stride = geom[3];
+  }
+  TRACE("VDMA frames are %ux%ux%u, stride %u\n", frame_width, frame_height,
+        frame_depth, frame_stride);
+
+  // Before the interrupt handler can use them
+  stats = devm_alloc_percpu(&pdev->dev, struct xilcam_stats);
+  if(stats == NULL){
+    return(-ENOMEM);
+  }
+
   // Register the IRQ
   r_irq = platform_get_resource(pdev, IORESOURCE_IRQ, 0);
   if(r_irq == NULL){
@@ -244,6 +399,13 @@ static int vdma_probe(struct platform_device *pdev)
   chardev->ops = &fops;
   cdev_add(chardev, device_num, 1);
 
+  stats_debugfs.stats = stats;
+  stats_debugfs.size = sizeof(struct xilcam_stats);
+  stats_debugfs.fields = xilcam_stat_fields;
+  stats_debugfs.nr_fields = ARRAY_SIZE(xilcam_stat_fields);
+  stats_debugfs.show_gauges = xilcam_show_gauges;
+  vdma_debugfs = stats_debugfs_create(CLASSNAME, NULL, &stats_debugfs);
+
   DEBUG("VDMA driver initialized\n");
   return(0);
 }
@@ -251,6 +413,9 @@ static int vdma_probe(struct platform_device *pdev)
 static int vdma_remove(struct platform_device *pdev)
 {
   struct resource* r_irq = NULL;
+
+  debugfs_remove_recursive(vdma_debugfs);
+
   // Release the IRQ line
   r_irq = platform_get_resource(pdev, IORESOURCE_IRQ, 0);
   if(r_irq == NULL){
@@ -0,0 +1,51 @@
+/* vdma_trace.h
+ * Tracepoints for the camera VDMA driver, to line up with the hwacc ones:
+ *   frame_done  a frame finished (unread says the last one was never grabbed)
+ *   grab        GRAB_IMAGE swapped a new buffer into the ring
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM xilcam
+
+#if !defined(_VDMA_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _VDMA_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(xilcam_frame_done,
+        TP_PROTO(bool unread),
+        TP_ARGS(unread),
+        TP_STRUCT__entry(
+                __field(bool, unread)
+        ),
+        TP_fast_assign(
+                __entry->unread = unread;
+        ),
+        TP_printk("unread=%d", __entry->unread)
+);
+
+TRACE_EVENT(xilcam_grab,
+        TP_PROTO(int slot, int id, int replacement),
+        TP_ARGS(slot, id, replacement),
+        TP_STRUCT__entry(
+                __field(int, slot)
+                __field(int, id)
+                __field(int, replacement)
+        ),
+        TP_fast_assign(
+                __entry->slot = slot;
+                __entry->id = id;
+                __entry->replacement = replacement;
+        ),
+        TP_printk("slot=%d buffer=%d replacement=%d", __entry->slot,
+                  __entry->id, __entry->replacement)
+);
+
+#endif /* _VDMA_TRACE_H_ */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE vdma_trace
+#include <trace/define_trace.h>
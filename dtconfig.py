@@ -24,6 +24,12 @@ prop_name_hls_ref = "hls-node"
 # name of the property that contains device node's name
 prop_name_node_name = "hw-name"
 
+# value of "compatible" property for the cma buffer pool node
+cma_compatible_string = "cmabuffer"
+
+# page size the buffer pool is allocated in
+cma_page_size = 4096
+
 ######## END OF PARAMETE DEFINITIONS ########
 
 # check command-line args
@@ -81,9 +87,24 @@ for key in overlay:
 		if node['outputto'] in overlay and overlay[node['outputto']]['definition']['type'] == 'dma':
                     if node['outputto'] not in overlay[node_name]['dmas']:
                             overlay[node_name]['dmas'].append(node['outputto'])
-                            overlay[node['outputto']]['hls-node'] = node_name
-                            overlay[node['outputto']]['direction'] += 2
-
+                    # a DMA which also feeds this node was already listed above
+                    overlay[node['outputto']]['hls-node'] = node_name
+                    overlay[node['outputto']]['direction'] += 2
+
+
+# stream geometry, as "<width height depth>", for the first stream of the
+# given type (and name, if one is given).  The sizes are only there once
+# extractparams.py has been run, i.e., in hwconfig.all.
+def stream_geometry(hls_def, stream_type, stream_name=None):
+	for stream in hls_def.get('streams', []):
+		if stream['type'] != stream_type:
+			continue
+		if stream_name is not None and stream['name'] != stream_name:
+			continue
+		if 'width' in stream and 'height' in stream and 'depth' in stream:
+			return "<" + str(stream['width']) + " " + str(stream['height']) + " " + str(stream['depth']) + ">"
+		return None
+	return None
 
 # creating dt overlay
 dt_overlay = ""
@@ -94,13 +115,37 @@ for key in sorted(overlay.iterkeys()):
 	if overlay[key]['definition']['type'] == 'dma':
 		if overlay[key]['hls-node'] == "":
 			dt_overlay += "\n\tcompatible = \"xilcam\";"
+			if 'buffers' in overlay[key]['definition']:
+				dt_overlay += "\n\tvdma-buffers = <" + str(overlay[key]['definition']['buffers']) + ">;"
+			cam = overlay[key]['definition']
+			if 'width' in cam and 'height' in cam:
+				dt_overlay += "\n\tvdma-geometry = <" + str(cam['width']) + " " + str(cam['height']) + " " \
+					+ str(cam.get('depth', 1)) + " " + str(cam.get('stride', cam['width'])) + ">;"
 		else:
 			dt_overlay += "\n\tcompatible = \"" + dma_compatible_string + "\";"
 			dt_overlay += "\n\tdirection = <" + str(overlay[key]['direction']) + ">;"
 			dt_overlay += "\n\t" + prop_name_hls_ref + " = <&" + overlay[key]['hls-node'] + ">;"
+			hls_def = overlay[overlay[key]['hls-node']]['definition']
+			# into the accelerator (mm2s), possibly to a particular stream
+			if overlay[key]['direction'] & 1:
+				parts = overlay[key]['definition']['outputto'].split('.')
+				geometry = stream_geometry(hls_def, 'input', parts[1] if len(parts) > 1 else None)
+				if geometry is not None:
+					dt_overlay += "\n\tinput-geometry = " + geometry + ";"
+			# results out of the accelerator (s2mm)
+			if overlay[key]['direction'] & 2:
+				geometry = stream_geometry(hls_def, 'output')
+				if geometry is not None:
+					dt_overlay += "\n\toutput-geometry = " + geometry + ";"
 	else:
 		dt_overlay += "\n\tcompatible = \"" + hls_compatible_string + "\";"
 		dt_overlay += "\n\tgpio = <&axi_gpio_1>;"
+		# tap register layout, from extractparams.py
+		taps = overlay[key]['definition'].get('taps', [])
+		if len(taps) > 0:
+			dt_overlay += "\n\ttap-names = " + ", ".join(["\"" + t['name'] + "\"" for t in taps]) + ";"
+			dt_overlay += "\n\ttap-offsets = <" + " ".join([hex(t['offset']) for t in taps]) + ">;"
+			dt_overlay += "\n\ttap-widths = <" + " ".join([str(t['width']) for t in taps]) + ">;"
 		#input dmas
 		if len(overlay[key]['dmas']) == 0:
 			dt_overlay += "\n\t" + prop_name_dmas + " = <empty>;"
@@ -115,6 +160,31 @@ for key in sorted(overlay.iterkeys()):
 
 	dt_overlay += "\n};\n"
 
+# buffer pool geometry
+# The pool can be given directly with pool_size/max_buffers, or as a list of
+# buffer classes (width, height, depth, count) which the pool must hold at
+# once.  The buffer driver hands out power-of-two blocks, so each class is
+# rounded up the same way here.
+if 'cma' in cfg:
+	cma = cfg['cma']
+	pool_size = cma.get('pool_size', 0)
+	max_buffers = cma.get('max_buffers', 0)
+	for bufclass in cma.get('buffers', []):
+		nbytes = bufclass['width'] * bufclass['height'] * bufclass['depth']
+		block = cma_page_size
+		while block < nbytes:
+			block *= 2
+		pool_size += block * bufclass['count']
+		max_buffers += bufclass['count']
+
+	dt_overlay += "/ {\n\tcmabuffer {"
+	dt_overlay += "\n\t\tcompatible = \"" + cma_compatible_string + "\";"
+	if pool_size > 0:
+		dt_overlay += "\n\t\tpool-size = <" + str(pool_size) + ">;"
+	if max_buffers > 0:
+		dt_overlay += "\n\t\tmax-buffers = <" + str(max_buffers) + ">;"
+	dt_overlay += "\n\t};\n};\n"
+
 with open(dts_file_path, 'a') as dts_file:
 	dts_file.write(dt_overlay)
 
@@ -21,6 +21,9 @@ for module in params['hw']:
     continue
 
   print("Extracting parameters for", module['name'])
+  # Image sizes aren't part of the IP, so they come from hwconfig.user, either
+  # for the whole module or per stream (by name); keep them to merge back in
+  user_streams = dict((s['name'], s) for s in module.get('streams', []))
   module['streams'] = [] # Start empty list of data streams
 
   desc = etree.parse(open(module['path']+'/component.xml'))
@@ -53,8 +56,25 @@ for module in params['hw']:
     else:
       print("[Warning] Failed to get stream depth for stream", stream['name'])
 
+    for key in ['width', 'height']:
+      if key in module:
+        stream[key] = module[key]
+    stream.update(user_streams.get(stream['name'], {}))
+
     module['streams'].append(stream)
 
+  # The AXI-Lite registers past the HLS control block (0x00-0x0f) are the taps
+  module['taps'] = []
+  regs = desc.xpath('//spirit:memoryMap//spirit:register', namespaces=ns)
+  for reg in regs:
+    tap = {}
+    tap['name'] = str(reg.xpath('spirit:name/text()', namespaces=ns)[0])
+    tap['offset'] = int(str(reg.xpath('spirit:addressOffset/text()', namespaces=ns)[0]), 0)
+    tap['width'] = int(str(reg.xpath('spirit:size/text()', namespaces=ns)[0]), 0)
+    if tap['offset'] >= 0x10:
+      print("  Found tap register: '{}' at 0x{:x}".format(tap['name'], tap['offset']))
+      module['taps'].append(tap)
+
 # second pass
 for module in params["hw"]:
   if module["type"] == "hls":
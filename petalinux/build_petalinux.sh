@@ -19,7 +19,14 @@ fi
 cp -r project_skeleton $PROJECT_DIR
 cp bootgen_static.bif $PROJECT_DIR
 cp regs.init $PROJECT_DIR
-cp ../hwconfig.user $PROJECT_DIR
+# The extracted parameters (stream sizes, tap registers) go into the device
+# tree too, if extractparams.py has been run
+if [ -e ../hwconfig.all ]; then
+	HWCONFIG=hwconfig.all
+else
+	HWCONFIG=hwconfig.user
+fi
+cp ../$HWCONFIG $PROJECT_DIR
 cp ../dtconfig.py $PROJECT_DIR
 
 # get the petalinux dir
@@ -40,7 +47,7 @@ done
 sed -i "s,<PETALINUX_PROJECT_ROOT>,$PROJECT_DIR," project-spec/configs/config
 
 # Create device tree overlay
-python dtconfig.py hwconfig.user project-spec/meta-user/recipes-bsp/device-tree/files/system-user-overlay.dtsi
+python dtconfig.py $HWCONFIG project-spec/meta-user/recipes-bsp/device-tree/files/system-user-overlay.dtsi
 
 # Make an empty directory to Petalinux doesn't choke on the import
 mkdir project-spec/hw-description
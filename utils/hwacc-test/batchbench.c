@@ -0,0 +1,285 @@
+/* batchbench.c
+ * Compares per-frame PROCESS_IMAGE/PEND_PROCESSED against the batched
+ * PROCESS_IMAGE_BATCH/PEND_PROCESSED_ANY calls and the shared submission/
+ * completion rings, on a one-input kernel.  Small tiles make the per-call
+ * overhead stand out.  The per-frame calls are also timed with PEND_PROCESSED
+ * busy-polling for up to poll_us before it sleeps.  The per-frame runs also
+ * report the CPU time this process spent per frame, most of which is in the
+ * driver's ioctl paths (e.g., to see what the driver's logging costs).
+ * Finally, READ_TIMER gives the accelerator's own service time per frame,
+ * from the TTC stamps the driver takes at the DMA kick and the output
+ * interrupt, which shows how much of the per-frame time is the hardware.
+ *
+ * Usage: batchbench [frames] [tile size] [batch size] [sqpoll (0/1)] [poll_us]
+ *
+ * This uses the driver's own headers rather than ubuffer.h, since the batch
+ * calls take the full Buffer struct.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "../../drivers/buffer.h"
+#include "../../drivers/hwacc.h"
+#include "../../drivers/ioctl_cmds.h"
+
+#define MAX_BATCH 16 // The driver has 16 BufferSets
+#define NCHAN 2 // One input, one output
+
+static double now_sec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// CPU time (user and system) used by this process
+static double cpu_sec(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int alloc_tile(int cma, Buffer* buf, int size)
+{
+  memset(buf, 0, sizeof(Buffer));
+  buf->width = size;
+  buf->height = size;
+  buf->stride = size;
+  buf->depth = 3;
+  return ioctl(cma, GET_BUFFER, (long unsigned int)buf);
+}
+
+// One ioctl to submit and one to wait, for every frame
+static double run_single(int hwacc, Buffer* bufs, int frames, double* cpu)
+{
+  int i, id;
+  double start = now_sec();
+  double cpu_start = cpu_sec();
+
+  for(i = 0; i < frames; i++){
+    id = ioctl(hwacc, PROCESS_IMAGE, (long unsigned int)&bufs[(i % MAX_BATCH) * NCHAN]);
+    if(id < 0){
+      printf("PROCESS_IMAGE failed: %s\n", strerror(errno));
+      return(-1);
+    }
+    ioctl(hwacc, PEND_PROCESSED, id);
+  }
+  *cpu = cpu_sec() - cpu_start;
+  return(now_sec() - start);
+}
+
+// One frame at a time again, reading back the TTC stamps after each.  Gives
+// the mean kick-to-interrupt time in microseconds and the worst one in
+// max_us, or -1 if the driver has no clock.
+static double run_timed(int hwacc, Buffer* bufs, int frames, double* max_us)
+{
+  HwaccTimer timer;
+  double us, total = 0;
+  int i, id;
+
+  *max_us = 0;
+  for(i = 0; i < frames; i++){
+    id = ioctl(hwacc, PROCESS_IMAGE, (long unsigned int)&bufs[(i % MAX_BATCH) * NCHAN]);
+    if(id < 0){
+      printf("PROCESS_IMAGE failed: %s\n", strerror(errno));
+      return(-1);
+    }
+    ioctl(hwacc, PEND_PROCESSED, id);
+    timer.id = id;
+    if(ioctl(hwacc, READ_TIMER, (long unsigned int)&timer) < 0){
+      printf("READ_TIMER failed: %s\n", strerror(errno));
+      return(-1);
+    }
+    if(timer.kick == 0){
+      return(-1); // The driver couldn't map the TTC
+    }
+    us = (double)(timer.done - timer.kick) / HWACC_TTC_TICKS_PER_US;
+    total += us;
+    if(us > *max_us){
+      *max_us = us;
+    }
+  }
+  return(total / frames);
+}
+
+// Submit batch frames per call, and reap whatever has finished
+static double run_batched(int hwacc, Buffer* bufs, int frames, int batch)
+{
+  HwaccBatch b;
+  HwaccReap r;
+  int ids[MAX_BATCH];
+  int submitted = 0, reaped = 0, inflight = 0, n;
+  double start = now_sec();
+
+  while(reaped < frames){
+    n = frames - submitted;
+    if(n > batch){ n = batch; }
+    if(n > MAX_BATCH - inflight){ n = MAX_BATCH - inflight; }
+    if(n > 0){
+      b.count = n;
+      b.bufs = &bufs[(submitted % MAX_BATCH) * NCHAN];
+      b.ids = ids;
+      // Wrapping past the end of bufs would need two calls
+      if((submitted % MAX_BATCH) + n > MAX_BATCH){
+        b.count = MAX_BATCH - (submitted % MAX_BATCH);
+      }
+      if(ioctl(hwacc, PROCESS_IMAGE_BATCH, (long unsigned int)&b) < 0){
+        printf("PROCESS_IMAGE_BATCH failed: %s\n", strerror(errno));
+        return(-1);
+      }
+      submitted += b.count;
+      inflight += b.count;
+    }
+
+    r.max = MAX_BATCH;
+    r.ids = ids;
+    if(ioctl(hwacc, PEND_PROCESSED_ANY, (long unsigned int)&r) < 0){
+      printf("PEND_PROCESSED_ANY failed: %s\n", strerror(errno));
+      return(-1);
+    }
+    reaped += r.count;
+    inflight -= r.count;
+  }
+  return(now_sec() - start);
+}
+
+// Stream through the shared rings.  With the polling thread, this makes no
+// system calls at all while frames keep coming.
+static double run_ring(int hwacc, Buffer* bufs, int frames, int sqpoll)
+{
+  HwaccRings* rings;
+  unsigned int tail, head, ready;
+  int submitted = 0, reaped = 0, inflight = 0;
+  double start;
+
+  if(ioctl(hwacc, RING_SETUP, sqpoll ? HWACC_RING_SQPOLL : 0) < 0){
+    printf("RING_SETUP failed: %s\n", strerror(errno));
+    return(-1);
+  }
+  rings = (HwaccRings*) mmap(NULL, sizeof(HwaccRings), PROT_READ | PROT_WRITE,
+                             MAP_SHARED, hwacc, HWACC_RINGS_MMAP_OFFSET);
+  if(rings == MAP_FAILED){
+    printf("mmap of rings failed: %s\n", strerror(errno));
+    return(-1);
+  }
+
+  start = now_sec();
+  while(reaped < frames){
+    // Fill the submission ring, but never reuse a buffer that's in flight
+    tail = rings->sq_tail;
+    while(submitted < frames && inflight < MAX_BATCH){
+      memcpy(rings->sq[tail % HWACC_RING_ENTRIES].bufs,
+             &bufs[(submitted % MAX_BATCH) * NCHAN], NCHAN * sizeof(Buffer));
+      rings->sq[tail % HWACC_RING_ENTRIES].user_data = submitted;
+      tail++;
+      submitted++;
+      inflight++;
+    }
+    __atomic_store_n(&rings->sq_tail, tail, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if(!sqpoll){
+      ioctl(hwacc, RING_ENTER, 1); // Submit, and wait for something to finish
+    }
+    else if(__atomic_load_n(&rings->flags, __ATOMIC_ACQUIRE) & HWACC_RING_NEED_WAKEUP){
+      ioctl(hwacc, RING_ENTER, 0);
+    }
+
+    head = rings->cq_head;
+    ready = __atomic_load_n(&rings->cq_tail, __ATOMIC_ACQUIRE);
+    for(; head != ready; head++){
+      if(rings->cq[head % HWACC_RING_ENTRIES].result < 0){
+        printf("frame %u failed: %d\n", rings->cq[head % HWACC_RING_ENTRIES].user_data,
+               rings->cq[head % HWACC_RING_ENTRIES].result);
+      }
+      reaped++;
+      inflight--;
+    }
+    __atomic_store_n(&rings->cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  munmap(rings, sizeof(HwaccRings));
+  return(now_sec() - start);
+}
+
+int main(int argc, char* argv[])
+{
+  int frames = (argc > 1) ? atoi(argv[1]) : 10000;
+  int size = (argc > 2) ? atoi(argv[2]) : 16;
+  int batch = (argc > 3) ? atoi(argv[3]) : 8;
+  int sqpoll = (argc > 4) ? atoi(argv[4]) : 1;
+  int poll_us = (argc > 5) ? atoi(argv[5]) : 50;
+  Buffer bufs[MAX_BATCH * NCHAN];
+  double t_single, t_poll, t_batch, t_ring;
+  double cpu_single, cpu_poll;
+  double hw_mean, hw_max;
+  int i;
+
+  if(batch < 1 || batch > MAX_BATCH){
+    printf("batch size must be 1-%d\n", MAX_BATCH);
+    return(1);
+  }
+
+  int cma = open("/dev/cmabuffer0", O_RDWR);
+  if(cma == -1){
+    printf("Failed to open cma provider!\n");
+    return(1);
+  }
+  int hwacc = open("/dev/hwacc0", O_RDWR);
+  if(hwacc == -1){
+    printf("Failed to open hardware device!\n");
+    return(1);
+  }
+
+  // A separate input/output pair for every frame that can be in flight
+  for(i = 0; i < MAX_BATCH * NCHAN; i++){
+    if(alloc_tile(cma, &bufs[i], size) < 0){
+      printf("Failed to allocate buffer %d!\n", i);
+      return(1);
+    }
+  }
+
+  t_single = run_single(hwacc, bufs, frames, &cpu_single);
+  ioctl(hwacc, SET_POLL_BUDGET, poll_us);
+  t_poll = run_single(hwacc, bufs, frames, &cpu_poll);
+  ioctl(hwacc, SET_POLL_BUDGET, 0);
+  t_batch = run_batched(hwacc, bufs, frames, batch);
+  t_ring = run_ring(hwacc, bufs, frames, sqpoll);
+  if(t_single < 0 || t_poll < 0 || t_batch < 0 || t_ring < 0){
+    return(1);
+  }
+  hw_mean = run_timed(hwacc, bufs, frames < 1000 ? frames : 1000, &hw_max);
+
+  printf("%d frames of %dx%d\n", frames, size, size);
+  printf("  single:  %8.2f us/frame, %.2f us CPU\n", t_single * 1e6 / frames,
+         cpu_single * 1e6 / frames);
+  printf("  polled:  %8.2f us/frame (%.2fx, %d us budget), %.2f us CPU\n",
+         t_poll * 1e6 / frames, t_single / t_poll, poll_us, cpu_poll * 1e6 / frames);
+  printf("  batch %2d: %7.2f us/frame (%.2fx)\n", batch, t_batch * 1e6 / frames,
+         t_single / t_batch);
+  printf("  rings%s: %7.2f us/frame (%.2fx)\n", sqpoll ? "+sqpoll" : "       ",
+         t_ring * 1e6 / frames, t_single / t_ring);
+  if(hw_mean >= 0){
+    printf("  hardware: %7.2f us/frame from the TTC, %.2f us worst\n", hw_mean, hw_max);
+  }
+  else{
+    printf("  hardware: no TTC timestamps\n");
+  }
+
+  for(i = 0; i < MAX_BATCH * NCHAN; i++){
+    ioctl(cma, FREE_IMAGE, (long unsigned int)&bufs[i]);
+  }
+  close(hwacc);
+  close(cma);
+  return(0);
+}
@@ -0,0 +1,295 @@
+/* Print the hwacc, cmabuffer and xilcam driver statistics from debugfs every
+ * few seconds, in the style of vmstat.  Counters are shown as rates per
+ * second, except on the first line, which has the totals since the module
+ * loaded (or the last reset).  Gauges, like queue depths, are shown as they
+ * are.
+ *
+ * Usage: hwstat [-a] [-z] [-d DIR]... [INTERVAL [COUNT]]
+ *   -a      show every counter and gauge, not just the main ones
+ *   -z      reset the counters first
+ *   -d DIR  a statistics directory to read; by default, every directory
+ *           in /sys/kernel/debug/hwacc, plus cmabuffer and xilcam there
+ * Gauges the driver prints in hex, like status registers, stay in hex.
+ * The latency histograms are in the "histograms" file next to the counters.
+ *
+ * debugfs has to be mounted, and is normally only readable by root.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#define DEBUGFS "/sys/kernel/debug"
+#define HEADER_EVERY 20 // Lines between repeated headers
+
+struct Column
+{
+  std::string name;
+  bool gauge;
+  bool hex; // A gauge the driver prints in hex, like a status register
+  unsigned long long last;
+  int width;
+};
+
+struct Source
+{
+  std::string dir;
+  std::string label;
+  std::vector<Column> cols;
+};
+
+// What's shown without -a; anything else only with -a
+static const char* main_stats[] = {
+  // hwacc
+  "sets_queued", "sets_processing", "sets_complete", "frames_completed",
+  "bytes_in", "bytes_out", "irq_out", "dma_err_irq",
+  // cmabuffer
+  "buffers_live", "pool_free_bytes", "allocs", "frees",
+  // xilcam
+  "frames", "frames_unread", "grabs",
+  NULL
+};
+
+static bool is_main(const char* name)
+{
+  for(int i = 0; main_stats[i] != NULL; i++){
+    if(strcmp(main_stats[i], name) == 0){
+      return(true);
+    }
+  }
+  return(false);
+}
+
+/* Reads "name value" lines, calling back for each one with the value and
+ * whether it was written in hex.
+ * Returns false if the file couldn't be opened. */
+template<typename F>
+static bool read_stats(const std::string& path, F each)
+{
+  FILE* f = fopen(path.c_str(), "r");
+  char name[64];
+  char value[32];
+
+  if(f == NULL){
+    return(false);
+  }
+  while(fscanf(f, "%63s %31s", name, value) == 2){
+    each(name, strtoull(value, NULL, 0), strncmp(value, "0x", 2) == 0);
+  }
+  fclose(f);
+  return(true);
+}
+
+static bool add_source(std::vector<Source>& sources, const std::string& dir, bool all)
+{
+  Source src;
+
+  src.dir = dir;
+  src.label = dir.substr(dir.find_last_of('/') + 1);
+  bool ok = read_stats(dir + "/gauges", [&](const char* name, unsigned long long val, bool hex){
+    src.cols.push_back(Column{name, true, hex, val, 0});
+  });
+  ok = read_stats(dir + "/counters", [&](const char* name, unsigned long long val, bool hex){
+    src.cols.push_back(Column{name, false, false, 0, 0});
+  }) || ok;
+  if(!ok){
+    return(false);
+  }
+
+  if(!all){
+    std::vector<Column> picked;
+    for(size_t i = 0; i < src.cols.size(); i++){
+      if(is_main(src.cols[i].name.c_str())){
+        picked.push_back(src.cols[i]);
+      }
+    }
+    if(!picked.empty()){
+      src.cols = picked;
+    }
+  }
+  for(size_t i = 0; i < src.cols.size(); i++){
+    src.cols[i].width = src.cols[i].name.size() > 6 ? src.cols[i].name.size() : 6;
+  }
+  sources.push_back(src);
+  return(true);
+}
+
+static void find_sources(std::vector<Source>& sources, bool all)
+{
+  DIR* d = opendir(DEBUGFS "/hwacc");
+  struct dirent* e;
+
+  if(d != NULL){
+    std::vector<std::string> names;
+    while((e = readdir(d)) != NULL){
+      if(e->d_name[0] != '.'){
+        names.push_back(e->d_name);
+      }
+    }
+    closedir(d);
+    std::sort(names.begin(), names.end());
+    for(size_t i = 0; i < names.size(); i++){
+      add_source(sources, DEBUGFS "/hwacc/" + names[i], all);
+    }
+  }
+  add_source(sources, DEBUGFS "/cmabuffer", all);
+  add_source(sources, DEBUGFS "/xilcam", all);
+}
+
+static int group_width(const Source& src)
+{
+  int w = -1;
+  for(size_t i = 0; i < src.cols.size(); i++){
+    w += src.cols[i].width + 1;
+  }
+  return(w);
+}
+
+static void print_header(const std::vector<Source>& sources)
+{
+  for(size_t s = 0; s < sources.size(); s++){
+    // The label centred in dashes, across the group's columns
+    int w = group_width(sources[s]);
+    int pad = w - (int)sources[s].label.size();
+    int left = pad > 0 ? pad / 2 : 0;
+    int right = pad > 0 ? pad - left : 0;
+    printf("%s%s%s%s", s ? " " : "", std::string(left, '-').c_str(),
+           sources[s].label.c_str(), std::string(right, '-').c_str());
+  }
+  printf("\n");
+  for(size_t s = 0; s < sources.size(); s++){
+    for(size_t i = 0; i < sources[s].cols.size(); i++){
+      printf("%s%*s", (s || i) ? " " : "", sources[s].cols[i].width,
+             sources[s].cols[i].name.c_str());
+    }
+  }
+  printf("\n");
+}
+
+// Right-justified in width, scaled down with k/M/G/T if it doesn't fit;
+// hex values are never scaled
+static void print_value(unsigned long long val, int width, bool hex)
+{
+  const char* suffix = " kMGT";
+  char buf[32];
+  int i = 0;
+
+  if(hex){
+    snprintf(buf, sizeof(buf), "0x%llx", val);
+    printf("%*s", width, buf);
+    return;
+  }
+  snprintf(buf, sizeof(buf), "%llu", val);
+  while((int)strlen(buf) > width && suffix[i + 1] != '\0'){
+    val /= 1000;
+    i++;
+    snprintf(buf, sizeof(buf), "%llu%c", val, suffix[i]);
+  }
+  printf("%*s", width, buf);
+}
+
+static double now(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return(t.tv_sec + t.tv_nsec * 1e-9);
+}
+
+static void sample(std::vector<Source>& sources, double elapsed)
+{
+  for(size_t s = 0; s < sources.size(); s++){
+    Source& src = sources[s];
+    auto update = [&](const char* name, unsigned long long val, bool hex){
+      for(size_t i = 0; i < src.cols.size(); i++){
+        Column& c = src.cols[i];
+        if(c.name == name){
+          unsigned long long shown = val;
+          if(!c.gauge && elapsed > 0){
+            // A counter that went backwards was reset (hwstat -z, or the
+            // module reloaded), so everything since counts from 0
+            shown = ((val >= c.last) ? val - c.last : val) / elapsed + 0.5;
+          }
+          c.last = val;
+          printf("%s", (s || i) ? " " : "");
+          print_value(shown, c.width, c.hex);
+          return;
+        }
+      }
+    };
+    // Same order as the columns: gauges, then counters
+    read_stats(src.dir + "/gauges", update);
+    read_stats(src.dir + "/counters", update);
+  }
+  printf("\n");
+  fflush(stdout);
+}
+
+int main(int argc, char* argv[])
+{
+  std::vector<Source> sources;
+  std::vector<std::string> dirs;
+  bool all = false, reset = false;
+  int opt;
+
+  while((opt = getopt(argc, argv, "azd:")) != -1){
+    switch(opt){
+      case 'a': all = true; break;
+      case 'z': reset = true; break;
+      case 'd': dirs.push_back(optarg); break;
+      default:
+        printf("Usage: hwstat [-a] [-z] [-d DIR]... [INTERVAL [COUNT]]\n");
+        return(1);
+    }
+  }
+  double interval = (optind < argc) ? atof(argv[optind]) : 1.0;
+  int count = (optind + 1 < argc) ? atoi(argv[optind + 1]) : -1;
+  if(interval <= 0){
+    printf("Interval must be more than 0\n");
+    return(1);
+  }
+
+  if(dirs.empty()){
+    find_sources(sources, all);
+  }
+  for(size_t i = 0; i < dirs.size(); i++){
+    if(!add_source(sources, dirs[i], all)){
+      printf("Couldn't read statistics in %s\n", dirs[i].c_str());
+    }
+  }
+  if(sources.empty()){
+    printf("No driver statistics found.  Is debugfs mounted, and are you root?\n");
+    return(1);
+  }
+
+  if(reset){
+    for(size_t s = 0; s < sources.size(); s++){
+      FILE* f = fopen((sources[s].dir + "/reset").c_str(), "w");
+      if(f == NULL){
+        printf("Couldn't reset %s\n", sources[s].dir.c_str());
+        return(1);
+      }
+      fputs("1\n", f);
+      fclose(f);
+    }
+  }
+
+  double last = now();
+  for(int line = 0; count < 0 || line < count; line++){
+    if(line % HEADER_EVERY == 0){
+      print_header(sources);
+    }
+    if(line > 0){
+      usleep(interval * 1e6);
+    }
+    double t = now();
+    sample(sources, line > 0 ? t - last : 0);
+    last = t;
+  }
+  return(0);
+}